@@ -0,0 +1,174 @@
+#ifndef ADMISSION_CONTROL_HPP
+#define ADMISSION_CONTROL_HPP
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+
+#include "BandwidthScheduler.hpp"
+#include "Clock.hpp"
+
+namespace tftp {
+
+// Decides which incoming requests may start a session, so a burst of clients
+// or a flood of spoofed requests can't exhaust memory and descriptors or slow
+// down the transfers already running. Sessions are capped in total and per
+// source address, requests beyond the total cap wait in a bounded backlog,
+// and every source may only send so many requests per second.
+class AdmissionControl {
+public:
+    using Clock = tftp::Clock;
+    using Address = boost::asio::ip::address;
+    using udp = boost::asio::ip::udp;
+    using Start = std::function<void()>;
+
+    struct Limits {
+        size_t max_sessions = 512;
+        size_t max_sessions_per_source = 16;
+        size_t max_backlog = 256;
+        // requests per second of each source, 0 for unlimited
+        double request_rate = 20;
+        double request_burst = 40;
+        // the client has given up on older requests anyway
+        Clock::duration backlog_timeout = std::chrono::seconds(3);
+        // addresses remembered for rate limiting
+        size_t max_sources = 65536;
+    };
+
+    enum class Admission {
+        accepted,  // the slot is taken, start the session now
+        queued,    // the start function runs once a slot frees up
+        refused,   // overloaded, tell the client to come back later
+    };
+
+    const Limits &limits() const {
+        return limits_;
+    }
+
+    void set_limits(const Limits &limits) {
+        limits_ = limits;
+        for (auto &[address, source] : sources_)
+            source.bucket.set_rate(limits_.request_rate, limits_.request_burst);
+    }
+
+    size_t sessions() const {
+        return sessions_;
+    }
+
+    // return false if the request must be dropped without an answer, answering
+    // floods would only help to reflect them at the spoofed address
+    bool allow_request(const Address &address, Clock::time_point now = Clock::now()) {
+        auto source = find_source(address, now);
+        if (!source)
+            return false;
+        source->last_request = now;
+        if (!source->bucket.has_tokens(1, now))
+            return false;
+        source->bucket.consume(1);
+        return true;
+    }
+
+    Admission admit(const udp::endpoint &endpoint, Start start, Clock::time_point now = Clock::now()) {
+        auto source = find_source(endpoint.address(), now);
+        if (!source || source->sessions >= limits_.max_sessions_per_source)
+            return Admission::refused;
+
+        if (sessions_ < limits_.max_sessions) {
+            acquire(*source);
+            return Admission::accepted;
+        }
+
+        // a retransmitted request replaces the one waiting already
+        for (auto &pending : backlog_) {
+            if (pending.endpoint == endpoint) {
+                pending.start = std::move(start);
+                return Admission::queued;
+            }
+        }
+        if (backlog_.size() >= limits_.max_backlog)
+            return Admission::refused;
+        backlog_.push_back({endpoint, now, std::move(start)});
+        return Admission::queued;
+    }
+
+    // a session ended, return the start function of a queued request that got its slot
+    Start release(const udp::endpoint &endpoint, Clock::time_point now = Clock::now()) {
+        auto it = sources_.find(endpoint.address());
+        if (it != sources_.end() && it->second.sessions > 0)
+            it->second.sessions--;
+        if (sessions_ > 0)
+            sessions_--;
+
+        while (!backlog_.empty() && sessions_ < limits_.max_sessions) {
+            auto pending = std::move(backlog_.front());
+            backlog_.pop_front();
+            if (now - pending.queued > limits_.backlog_timeout)
+                continue;
+
+            auto source = find_source(pending.endpoint.address(), now);
+            if (!source || source->sessions >= limits_.max_sessions_per_source)
+                continue;
+            acquire(*source);
+            return pending.start;
+        }
+        return nullptr;
+    }
+
+private:
+    struct Source {
+        size_t sessions = 0;
+        TokenBucket bucket;
+        Clock::time_point last_request;
+    };
+
+    struct Pending {
+        udp::endpoint endpoint;
+        Clock::time_point queued;
+        Start start;
+    };
+
+    Limits limits_;
+    size_t sessions_ = 0;
+    std::map<Address, Source> sources_;
+    std::deque<Pending> backlog_;
+
+    void acquire(Source &source) {
+        source.sessions++;
+        sessions_++;
+    }
+
+    // nullptr if too many sources are tracked already
+    Source *find_source(const Address &address, Clock::time_point now) {
+        auto it = sources_.find(address);
+        if (it != sources_.end())
+            return &it->second;
+
+        if (sources_.size() >= limits_.max_sources) {
+            prune(now);
+            if (sources_.size() >= limits_.max_sources)
+                return nullptr;
+        }
+
+        auto &source = sources_[address];
+        source.bucket.set_rate(limits_.request_rate, limits_.request_burst);
+        source.last_request = now;
+        return &source;
+    }
+
+    // forget sources without sessions whose bucket would be full again
+    void prune(Clock::time_point now) {
+        auto idle = limits_.request_rate > 0
+                        ? std::chrono::duration_cast<Clock::duration>(
+                              std::chrono::duration<double>(limits_.request_burst / limits_.request_rate))
+                        : Clock::duration::zero();
+        std::erase_if(sources_, [&](auto &entry) {
+            return entry.second.sessions == 0 && now - entry.second.last_request >= idle;
+        });
+    }
+};
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,235 @@
+#ifndef BANDWIDTH_SCHEDULER_HPP
+#define BANDWIDTH_SCHEDULER_HPP
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <set>
+
+#include "Clock.hpp"
+#include "TimingWheel.hpp"
+
+namespace tftp {
+
+// Classic token bucket, rate in bytes/s. A rate of 0 means unlimited.
+class TokenBucket {
+public:
+    using Clock = tftp::Clock;
+
+    TokenBucket(double rate = 0, double burst = 0) {
+        set_rate(rate, burst);
+    }
+
+    void set_rate(double rate, double burst = 0) {
+        rate_ = rate;
+        // default burst: 10ms worth of traffic
+        burst_ = burst > 0 ? burst : rate * 0.01;
+        tokens_ = burst_;
+        last_ = Clock::now();
+    }
+
+    bool is_unlimited() const {
+        return rate_ <= 0;
+    }
+
+    // a packet larger than the burst is let through once the bucket is full
+    bool has_tokens(size_t bytes, Clock::time_point now) {
+        if (is_unlimited())
+            return true;
+        refill(now);
+        return tokens_ >= std::min<double>(bytes, burst_);
+    }
+
+    // may leave the bucket in debt, which delays the following packets
+    void consume(size_t bytes) {
+        if (!is_unlimited())
+            tokens_ -= bytes;
+    }
+
+    // time until the bucket holds enough tokens for the packet
+    Clock::duration wait_time(size_t bytes, Clock::time_point now) {
+        if (is_unlimited())
+            return Clock::duration::zero();
+        refill(now);
+        double need = std::min<double>(bytes, burst_) - tokens_;
+        if (need <= 0)
+            return Clock::duration::zero();
+        return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(need / rate_));
+    }
+
+private:
+    double rate_ = 0;
+    double burst_ = 0;
+    double tokens_ = 0;
+    Clock::time_point last_;
+
+    void refill(Clock::time_point now) {
+        if (now <= last_)
+            return;
+        tokens_ = std::min(burst_, tokens_ + rate_ * std::chrono::duration<double>(now - last_).count());
+        last_ = now;
+    }
+};
+
+// Paces outgoing packets of many sessions. Each session is limited by its own
+// token bucket, all of them share a global bucket, and sessions with packets
+// waiting are served in weighted fair order (self-clocked fair queueing), so
+// a few big transfers can't starve the small ones.
+template <typename Key>
+class BandwidthScheduler {
+public:
+    using Clock = TokenBucket::Clock;
+    using Task = std::function<void()>;
+
+    BandwidthScheduler(boost::asio::io_context &io_context)
+        : timer_(io_context, [this]() { dispatch(); }) {}
+
+    // bytes/s shared by all sessions, 0 for unlimited
+    void set_global_rate(double rate) {
+        global_bucket_.set_rate(rate);
+        dispatch();
+    }
+
+    // bytes/s of each session, 0 for unlimited
+    void set_session_rate(double rate) {
+        session_rate_ = rate;
+        for (auto &[key, session] : sessions_)
+            session.bucket.set_rate(rate);
+        dispatch();
+    }
+
+    // a session with twice the weight gets twice the bandwidth while both wait
+    void set_session_weight(const Key &key, double weight) {
+        session(key).weight = std::max(weight, 0.001);
+    }
+
+    // queue a packet of the session, the task is called once it may be sent
+    void submit(const Key &key, size_t bytes, Task task) {
+        auto &s = session(key);
+        double finish = std::max(virtual_time_, s.last_finish) + bytes / s.weight;
+        s.last_finish = finish;
+        s.queue.push_back({bytes, finish, std::move(task)});
+        if (s.queue.size() == 1)
+            ready_.insert({finish, key});
+        dispatch();
+    }
+
+    // drop the waiting packets of the session but keep its state
+    void cancel(const Key &key) {
+        auto it = sessions_.find(key);
+        if (it == sessions_.end() || it->second.queue.empty())
+            return;
+        ready_.erase({it->second.queue.front().finish, key});
+        it->second.queue.clear();
+    }
+
+    // forget the session and drop its waiting packets
+    void remove(const Key &key) {
+        auto it = sessions_.find(key);
+        if (it == sessions_.end())
+            return;
+        if (!it->second.queue.empty())
+            ready_.erase({it->second.queue.front().finish, key});
+        sessions_.erase(it);
+    }
+
+private:
+    struct Packet {
+        size_t bytes;
+        double finish;
+        Task task;
+    };
+
+    struct Session {
+        double weight = 1;
+        double last_finish = 0;
+        TokenBucket bucket;
+        std::deque<Packet> queue;
+    };
+
+    // pacing deadlines share the timing wheel with the transactions
+    TimingWheel::Timer timer_;
+    bool dispatching_ = false;
+
+    TokenBucket global_bucket_;
+    double session_rate_ = 0;
+    double virtual_time_ = 0;
+
+    std::map<Key, Session> sessions_;
+    // head packet of every backlogged session, ordered by finish tag
+    std::set<std::pair<double, Key>> ready_;
+
+    Session &session(const Key &key) {
+        auto it = sessions_.find(key);
+        if (it == sessions_.end()) {
+            it = sessions_.emplace(key, Session()).first;
+            it->second.bucket.set_rate(session_rate_);
+        }
+        return it->second;
+    }
+
+    void dispatch() {
+        if (dispatching_)
+            return;
+        dispatching_ = true;
+
+        auto now = Clock::now();
+        auto next_wakeup = Clock::time_point::max();
+        std::vector<std::pair<double, Key>> throttled;
+
+        while (!ready_.empty()) {
+            auto head = *ready_.begin();
+            auto &s = sessions_.at(head.second);
+            auto &packet = s.queue.front();
+
+            // session over its own rate, let the others go first
+            if (!s.bucket.has_tokens(packet.bytes, now)) {
+                next_wakeup = std::min(next_wakeup, now + s.bucket.wait_time(packet.bytes, now));
+                throttled.push_back(head);
+                ready_.erase(ready_.begin());
+                continue;
+            }
+
+            // link over the global rate, nobody may send
+            if (!global_bucket_.has_tokens(packet.bytes, now)) {
+                next_wakeup = std::min(next_wakeup, now + global_bucket_.wait_time(packet.bytes, now));
+                break;
+            }
+
+            s.bucket.consume(packet.bytes);
+            global_bucket_.consume(packet.bytes);
+
+            ready_.erase(ready_.begin());
+            virtual_time_ = packet.finish;
+            auto task = std::move(packet.task);
+            s.queue.pop_front();
+            if (!s.queue.empty())
+                ready_.insert({s.queue.front().finish, head.second});
+
+            task();
+        }
+
+        // tasks may have removed sessions meanwhile
+        for (auto &head : throttled) {
+            auto it = sessions_.find(head.second);
+            if (it != sessions_.end() && !it->second.queue.empty() && it->second.queue.front().finish == head.first)
+                ready_.insert(head);
+        }
+        dispatching_ = false;
+
+        if (next_wakeup != Clock::time_point::max())
+            arm_timer(next_wakeup);
+    }
+
+    void arm_timer(Clock::time_point deadline) {
+        if (deadline < timer_.expiry())
+            timer_.expires_at(deadline);
+    }
+};
+
+}  // namespace tftp
+
+#endif
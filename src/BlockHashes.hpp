@@ -0,0 +1,86 @@
+#ifndef BLOCK_HASHES_HPP
+#define BLOCK_HASHES_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <latch>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+
+#include <unistd.h>
+
+#include "Crc32c.hpp"
+#include "TftpPacketBuilder.hpp"
+
+namespace tftp {
+
+// The threads hashing for all transfers together, one per core. A run of
+// blocks queued behind those of other transfers just waits its turn.
+inline boost::asio::thread_pool &hash_pool() {
+    static boost::asio::thread_pool pool(std::max(1u, std::thread::hardware_concurrency()));
+    return pool;
+}
+
+// The crc32c of each of the first count blocks of block_size bytes of a file,
+// for option "delta". The blocks are split into a contiguous run per core,
+// each read in chunks of about a megabyte, the first by the calling thread and
+// the others by hash_pool, so a file in the page cache is hashed at the speed
+// of all cores together and one on disk is read sequentially. nullopt if the
+// file can't be read that far.
+inline std::optional<std::vector<uint32_t>> hash_blocks(int fd, size_t count, size_t block_size) {
+    static const size_t chunk_size = 1 << 20;
+    size_t chunk_blocks = std::max<size_t>(1, chunk_size / block_size);
+
+    // a thread gets at least a few chunks, a small file isn't worth starting one
+    size_t runs = std::clamp<size_t>((count + 4 * chunk_blocks - 1) / (4 * chunk_blocks), 1,
+                                     std::max(1u, std::thread::hardware_concurrency()));
+
+    std::vector<uint32_t> hashes(count);
+    std::atomic<bool> failed = false;
+    auto hash_run = [&](size_t begin, size_t end) {
+        Buffer chunk(chunk_blocks * block_size);
+        for (size_t block = begin; block < end && !failed; block += chunk_blocks) {
+            size_t blocks = std::min(chunk_blocks, end - block);
+            size_t size = blocks * block_size, done = 0;
+            while (done < size) {
+                auto n = ::pread(fd, chunk.data() + done, size - done, block * block_size + done);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    failed = true;
+                    return;
+                }
+                done += n;
+            }
+            for (size_t i = 0; i < blocks; i++) {
+                Crc32c crc;
+                crc.update(chunk.data() + i * block_size, block_size);
+                hashes[block + i] = crc.value();
+            }
+        }
+    };
+
+    std::latch done(runs - 1);
+    for (size_t i = 1; i < runs; i++) {
+        boost::asio::post(hash_pool(), [&, i]() {
+            hash_run(count * i / runs, count * (i + 1) / runs);
+            done.count_down();
+        });
+    }
+    hash_run(0, count / runs);
+    done.wait();
+
+    if (failed)
+        return std::nullopt;
+    return hashes;
+}
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef BYTE_RANGE_HPP
+#define BYTE_RANGE_HPP
+
+#include <algorithm>
+#include <cstdio>
+#include <optional>
+#include <string>
+#include <utility>
+
+namespace tftp {
+
+// Part of a file carried by one session of a striped transfer, negotiated
+// with the non-standard option "range". The side sending the data picks the
+// range and announces "offset:length/total": a write request carries it, a
+// read request asks for stripe "index/count" and the oack answers with it.
+struct ByteRange {
+    size_t offset = 0;
+    size_t length = 0;
+    size_t total = 0;
+
+    // stripe index of count, the first stripes take the remainder
+    static ByteRange stripe(size_t index, size_t count, size_t total) {
+        size_t begin = total / count * index + std::min(index, total % count);
+        size_t end = total / count * (index + 1) + std::min(index + 1, total % count);
+        return {begin, end - begin, total};
+    }
+
+    std::string to_string() const {
+        return std::to_string(offset) + ":" + std::to_string(length) + "/" + std::to_string(total);
+    }
+
+    static std::optional<ByteRange> parse(const std::string &value) {
+        ByteRange range;
+        int consumed = 0;
+        if (std::sscanf(value.c_str(), "%zu:%zu/%zu%n", &range.offset, &range.length, &range.total, &consumed) != 3 ||
+            consumed != (int)value.size())
+            return std::nullopt;
+        if (range.offset > range.total || range.length > range.total - range.offset)
+            return std::nullopt;
+        return range;
+    }
+
+    static std::string stripe_request(size_t index, size_t count) {
+        return std::to_string(index) + "/" + std::to_string(count);
+    }
+
+    // "index/count" of a read request
+    static std::optional<std::pair<size_t, size_t>> parse_stripe_request(const std::string &value) {
+        size_t index = 0, count = 0;
+        int consumed = 0;
+        if (std::sscanf(value.c_str(), "%zu/%zu%n", &index, &count, &consumed) != 2 ||
+            consumed != (int)value.size() || count == 0 || index >= count)
+            return std::nullopt;
+        return std::make_pair(index, count);
+    }
+};
+
+}  // namespace tftp
+
+#endif
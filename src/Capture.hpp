@@ -0,0 +1,169 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Clock.hpp"
+#include "DatagramTransport.hpp"
+#include "TftpPacketBuilder.hpp"
+
+namespace tftp {
+
+// A datagram received by a peer, as recorded in a capture.
+struct CaptureRecord {
+    enum class Transport : uint8_t {
+        requests = 0,  // the port requests arrive on
+        data = 1,      // the port of the transfers
+    };
+
+    Clock::duration time{};  // since the capture started
+    Transport transport = Transport::data;
+    udp::endpoint endpoint;  // the sender
+    Buffer datagram;
+};
+
+// The file format of a capture, little endian throughout:
+//
+//     "TFTPCAP1"
+//     per datagram received, in order of arrival:
+//         u64  nanoseconds since the capture started
+//         u8   transport, 0 requests, 1 data
+//         16   address of the sender, ipv6 or ipv4 mapped into it
+//         u16  port of the sender
+//         u16  length
+//         the datagram
+//
+// 29 bytes per datagram on top of it, there are no link, ip or udp headers.
+struct CaptureFormat {
+    static constexpr char magic[8] = {'T', 'F', 'T', 'P', 'C', 'A', 'P', '1'};
+    static constexpr size_t header_size = 8 + 1 + 16 + 2 + 2;
+
+    static void put(uint8_t *out, uint64_t value, size_t bytes) {
+        for (size_t i = 0; i < bytes; i++)
+            out[i] = value >> (8 * i);
+    }
+
+    static uint64_t get(const uint8_t *in, size_t bytes) {
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; i++)
+            value |= (uint64_t)in[i] << (8 * i);
+        return value;
+    }
+};
+
+// Appends the datagrams received to a capture file. Used on the thread of
+// the io_context only, records are buffered and written out in large chunks.
+class CaptureWriter {
+public:
+    // throws std::invalid_argument if the file can't be created
+    explicit CaptureWriter(const std::string &path)
+        : out_(path, std::ios::binary | std::ios::trunc), started_(Clock::now()) {
+        if (!out_)
+            throw std::invalid_argument("cannot create " + path);
+        out_.write(CaptureFormat::magic, sizeof(CaptureFormat::magic));
+    }
+
+    void write(CaptureRecord::Transport transport, const udp::endpoint &endpoint, const void *data, size_t size) {
+        uint8_t header[CaptureFormat::header_size];
+        CaptureFormat::put(header, std::chrono::nanoseconds(Clock::now() - started_).count(), 8);
+        header[8] = (uint8_t)transport;
+        auto address = endpoint.address().is_v4()
+                           ? boost::asio::ip::make_address_v6(boost::asio::ip::v4_mapped, endpoint.address().to_v4())
+                           : endpoint.address().to_v6();
+        auto bytes = address.to_bytes();
+        std::memcpy(header + 9, bytes.data(), bytes.size());
+        CaptureFormat::put(header + 25, endpoint.port(), 2);
+        CaptureFormat::put(header + 27, size, 2);
+        out_.write((const char *)header, sizeof(header));
+        out_.write((const char *)data, size);
+        records_++;
+    }
+
+    size_t records() const {
+        return records_;
+    }
+
+private:
+    std::ofstream out_;
+    Clock::time_point started_;
+    size_t records_ = 0;
+};
+
+// A record cut short at the end, as a capture of a process that was killed
+// has it, is left out. Throws std::invalid_argument if the file is no capture.
+inline std::vector<CaptureRecord> read_capture(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    char magic[sizeof(CaptureFormat::magic)];
+    if (!in.read(magic, sizeof(magic)) || std::memcmp(magic, CaptureFormat::magic, sizeof(magic)) != 0)
+        throw std::invalid_argument(path + " is no capture");
+
+    std::vector<CaptureRecord> records;
+    uint8_t header[CaptureFormat::header_size];
+    while (in.read((char *)header, sizeof(header))) {
+        CaptureRecord record;
+        record.time = std::chrono::nanoseconds(CaptureFormat::get(header, 8));
+        record.transport = (CaptureRecord::Transport)header[8];
+        boost::asio::ip::address_v6::bytes_type address;
+        std::memcpy(address.data(), header + 9, address.size());
+        record.endpoint = udp::endpoint(boost::asio::ip::address_v6(address), CaptureFormat::get(header + 25, 2));
+        record.datagram.resize(CaptureFormat::get(header + 27, 2));
+        if (!in.read((char *)record.datagram.data(), record.datagram.size()))
+            break;
+        records.push_back(std::move(record));
+    }
+    return records;
+}
+
+// Records what another transport receives into a capture, while one is set.
+// Sending goes straight through.
+class CaptureTransport : public DatagramTransport {
+public:
+    CaptureTransport(std::unique_ptr<DatagramTransport> next, CaptureRecord::Transport transport)
+        : next_(std::move(next)), transport_(transport) {}
+
+    // nullptr stops recording, transports of one peer share the writer
+    void set_capture(std::shared_ptr<CaptureWriter> capture) {
+        capture_ = std::move(capture);
+    }
+
+    udp::endpoint local_endpoint() const override {
+        return next_->local_endpoint();
+    }
+
+    size_t dropped() const override {
+        return next_->dropped();
+    }
+
+    void async_receive(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, Handler handler) override {
+        next_->async_receive(buffer, endpoint, [this, buffer, &endpoint, handler = std::move(handler)](
+                                                   boost::system::error_code e, std::size_t bytes) {
+            if (!e && capture_)
+                capture_->write(transport_, endpoint, buffer.data(), bytes);
+            handler(e, bytes);
+        });
+    }
+
+    void async_send(boost::asio::const_buffer buffer, const udp::endpoint &endpoint, Handler handler) override {
+        next_->async_send(buffer, endpoint, std::move(handler));
+    }
+
+    void async_send_shared(std::shared_ptr<const Buffer> datagram, const udp::endpoint &endpoint, Handler handler) override {
+        next_->async_send_shared(std::move(datagram), endpoint, std::move(handler));
+    }
+
+private:
+    std::unique_ptr<DatagramTransport> next_;
+    CaptureRecord::Transport transport_;
+    std::shared_ptr<CaptureWriter> capture_;
+};
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef CHANNEL_HPP
+#define CHANNEL_HPP
+
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <deque>
+#include <optional>
+
+#include "Clock.hpp"
+#include "TimingWheel.hpp"
+
+namespace tftp {
+
+// Single consumer queue between the packet dispatcher and the coroutine of a
+// transaction. The consumer waits for a push or its deadline, which is a
+// timer of the timing wheel, so moving it on every packet stays O(1).
+template <typename T>
+class Channel {
+public:
+    using Clock = tftp::Clock;
+
+    explicit Channel(boost::asio::io_context &io_context)
+        : timer_(io_context, [this]() { wake(); }) {}
+
+    void push(T value) {
+        queue_.push_back(std::move(value));
+        wake();
+    }
+
+    // wake up the consumer without a value, e.g. when its deadline changed
+    void notify() {
+        wake();
+    }
+
+    // wait for the next value until the deadline, nothing means timeout or notify
+    boost::asio::awaitable<std::optional<T>> receive(Clock::time_point deadline) {
+        if (queue_.empty()) {
+            timer_.expires_at(deadline);
+            co_await boost::asio::async_initiate<const boost::asio::use_awaitable_t<> &, void()>(
+                [this](Waiter waiter) { waiter_.emplace(std::move(waiter)); }, boost::asio::use_awaitable);
+            timer_.cancel();
+        }
+
+        if (queue_.empty())
+            co_return std::nullopt;
+
+        std::optional<T> value(std::move(queue_.front()));
+        queue_.pop_front();
+        co_return value;
+    }
+
+    // the next value if one is queued, without waiting
+    std::optional<T> try_receive() {
+        if (queue_.empty())
+            return std::nullopt;
+        std::optional<T> value(std::move(queue_.front()));
+        queue_.pop_front();
+        return value;
+    }
+
+    // forget the suspended consumer without resuming it
+    void cancel() {
+        auto waiter = std::move(waiter_);
+        waiter_.reset();
+    }
+
+private:
+    // the suspended consumer, resumed through its executor
+    using Waiter = boost::asio::async_result<boost::asio::use_awaitable_t<>, void()>::handler_type;
+
+    std::deque<T> queue_;
+    TimingWheel::Timer timer_;
+    std::optional<Waiter> waiter_;
+
+    void wake() {
+        if (!waiter_)
+            return;
+        auto waiter = std::move(*waiter_);
+        waiter_.reset();
+        boost::asio::post(std::move(waiter));
+    }
+};
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef CLOCK_HPP
+#define CLOCK_HPP
+
+#include <algorithm>
+#include <chrono>
+
+namespace tftp {
+
+class VirtualClock;
+
+// The clock of every deadline and measurement of the protocol. It reads
+// std::chrono::steady_clock, unless the thread asking runs on a VirtualClock,
+// like the replay of a capture does. Its time points are those of
+// steady_clock, so they mix with steady timers and durations of asio.
+struct Clock {
+    using base = std::chrono::steady_clock;
+    using rep = base::rep;
+    using period = base::period;
+    using duration = base::duration;
+    using time_point = base::time_point;
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept;
+};
+
+// Time of the current thread while it exists, it only moves when set, so a
+// run is independent of how fast the machine is. Not shared between threads.
+class VirtualClock {
+public:
+    explicit VirtualClock(Clock::time_point start = Clock::base::now())
+        : now_(start), previous_(current()) {
+        current() = this;
+    }
+
+    VirtualClock(const VirtualClock &) = delete;
+    VirtualClock &operator=(const VirtualClock &) = delete;
+
+    ~VirtualClock() {
+        current() = previous_;
+    }
+
+    Clock::time_point now() const {
+        return now_;
+    }
+
+    // never goes back
+    void set(Clock::time_point now) {
+        now_ = std::max(now_, now);
+    }
+
+    // nullptr unless the thread runs on a virtual clock
+    static VirtualClock *&current() {
+        thread_local VirtualClock *clock = nullptr;
+        return clock;
+    }
+
+private:
+    Clock::time_point now_;
+    VirtualClock *previous_;
+};
+
+inline Clock::time_point Clock::now() noexcept {
+    auto clock = VirtualClock::current();
+    return clock ? clock->now() : base::now();
+}
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef CONGESTION_CONTROL_HPP
+#define CONGESTION_CONTROL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <limits>
+
+#include "Clock.hpp"
+
+namespace tftp {
+
+// Congestion window of a send transaction, counted in blocks. Slow start and
+// AIMD like TCP Reno, with loss detected by repeated acks of the block in
+// front of a gap or by retransmission timeout, and a delay based exit from slow start so dozens of transactions sharing a path
+// stop growing once the queue builds up instead of once packets get dropped.
+// The retransmission timeout is estimated from ack timing after RFC 6298.
+class CongestionControl {
+public:
+    using Clock = tftp::Clock;
+
+    // the negotiated "windowsize" caps the congestion window
+    void set_max_window(size_t window) {
+        max_window_ = std::max<size_t>(window, 1);
+    }
+
+    // number of blocks the transaction may keep outstanding
+    size_t window() const {
+        return std::min<size_t>(std::max(cwnd_, 1.0), max_window_);
+    }
+
+    // the timeout until the first rtt sample, e.g. negotiated with option "timeout"
+    void set_initial_rto(Clock::duration rto) {
+        if (srtt_ == Clock::duration::zero())
+            rto_ = std::clamp<Clock::duration>(rto, min_rto_, max_rto_);
+    }
+
+    Clock::duration rto() const {
+        return rto_;
+    }
+
+    void on_ack(size_t acked_blocks) {
+        if (cwnd_ < ssthresh_)
+            cwnd_ += acked_blocks;
+        else
+            cwnd_ += acked_blocks / cwnd_;
+        // don't grow beyond what may ever be outstanding
+        cwnd_ = std::min<double>(cwnd_, max_window_);
+    }
+
+    void on_rtt_sample(Clock::duration rtt) {
+        if (srtt_ == Clock::duration::zero()) {
+            srtt_ = rtt;
+            rttvar_ = rtt / 2;
+        } else {
+            auto delta = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+            rttvar_ = (3 * rttvar_ + delta) / 4;
+            srtt_ = (7 * srtt_ + rtt) / 8;
+        }
+        rto_ = std::clamp<Clock::duration>(srtt_ + 4 * rttvar_, min_rto_, max_rto_);
+
+        min_rtt_ = std::min(min_rtt_, rtt);
+        if (cwnd_ < ssthresh_ && rtt > min_rtt_ + std::clamp<Clock::duration>(min_rtt_ / 8, delay_threshold_min_, delay_threshold_max_))
+            ssthresh_ = cwnd_;
+    }
+
+    // the receiver reported a gap, the path still delivers the blocks behind
+    // it: halve the window like fast recovery, the timeout stays as it is
+    void on_fast_retransmit() {
+        ssthresh_ = std::max(cwnd_ / 2, 2.0);
+        cwnd_ = ssthresh_;
+    }
+
+    void on_timeout() {
+        ssthresh_ = std::max(cwnd_ / 2, 2.0);
+        cwnd_ = 1;
+        rto_ = std::min<Clock::duration>(rto_ * 2, max_rto_);
+    }
+
+private:
+    double cwnd_ = 2;
+    double ssthresh_ = std::numeric_limits<double>::max();
+    size_t max_window_ = 1;
+
+    Clock::duration srtt_ = Clock::duration::zero();
+    Clock::duration rttvar_ = Clock::duration::zero();
+    Clock::duration min_rtt_ = Clock::duration::max();
+    Clock::duration rto_ = std::chrono::seconds(1);
+
+    const Clock::duration min_rto_ = std::chrono::milliseconds(100);
+    const Clock::duration max_rto_ = std::chrono::seconds(8);
+    const Clock::duration delay_threshold_min_ = std::chrono::milliseconds(4);
+    const Clock::duration delay_threshold_max_ = std::chrono::milliseconds(16);
+};
+
+}  // namespace tftp
+
+#endif
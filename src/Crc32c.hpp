@@ -0,0 +1,112 @@
+#ifndef CRC32C_HPP
+#define CRC32C_HPP
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define TFTP_CRC32C_HAS_SSE42 1
+#endif
+
+namespace tftp {
+
+// Incremental CRC32C (Castagnoli), updated block by block while a file is
+// transferred. Uses the SSE4.2 crc32 instruction when the cpu supports it and
+// falls back to a slicing-by-8 table otherwise.
+class Crc32c {
+public:
+    void update(const uint8_t *data, size_t size) {
+#ifdef TFTP_CRC32C_HAS_SSE42
+        static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+        if (has_sse42) {
+            crc_ = update_hw(crc_, data, size);
+            return;
+        }
+#endif
+        crc_ = update_sw(crc_, data, size);
+    }
+
+    void reset() {
+        crc_ = 0xFFFFFFFF;
+    }
+
+    uint32_t value() const {
+        return ~crc_;
+    }
+
+    std::string hex_digest() const {
+        static const char digits[] = "0123456789abcdef";
+        uint32_t v = value();
+        std::string digest(8, '0');
+        for (int i = 7; i >= 0; i--, v >>= 4)
+            digest[i] = digits[v & 0xF];
+        return digest;
+    }
+
+    // the two ways update computes it, the register goes in and out without
+    // the final inversion of value
+    static uint32_t update_sw(uint32_t crc, const uint8_t *data, size_t size) {
+        auto &t = table();
+        while (size >= 8) {
+            uint32_t lo, hi;
+            std::memcpy(&lo, data, 4);
+            std::memcpy(&hi, data + 4, 4);
+            lo ^= crc;
+            crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+                  t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+                  t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+                  t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+            data += 8;
+            size -= 8;
+        }
+        while (size--)
+            crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+        return crc;
+    }
+
+#ifdef TFTP_CRC32C_HAS_SSE42
+    __attribute__((target("sse4.2"))) static uint32_t update_hw(uint32_t crc, const uint8_t *data, size_t size) {
+        uint64_t crc64 = crc;
+        while (size >= 8) {
+            uint64_t word;
+            std::memcpy(&word, data, 8);
+            crc64 = _mm_crc32_u64(crc64, word);
+            data += 8;
+            size -= 8;
+        }
+        crc = static_cast<uint32_t>(crc64);
+        while (size--)
+            crc = _mm_crc32_u8(crc, *data++);
+        return crc;
+    }
+#endif
+
+private:
+    uint32_t crc_ = 0xFFFFFFFF;
+
+    using Table = std::array<std::array<uint32_t, 256>, 8>;
+
+    static const Table &table() {
+        static const Table table = [] {
+            Table t{};
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; j++)
+                    crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; i++)
+                for (int k = 1; k < 8; k++)
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xFF];
+            return t;
+        }();
+        return table;
+    }
+};
+
+}  // namespace tftp
+
+#endif
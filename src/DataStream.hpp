@@ -0,0 +1,740 @@
+#ifndef DATA_STREAM_HPP
+#define DATA_STREAM_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "BlockHashes.hpp"
+#include "ByteRange.hpp"
+#include "Crc32c.hpp"
+#include "FileIndex.hpp"
+#include "TftpPacketBuilder.hpp"
+
+namespace tftp {
+
+// Where a send transaction takes its data from.
+class DataSource {
+public:
+    virtual ~DataSource() = default;
+
+    // fill up to size bytes, less only once the data is exhausted
+    virtual size_t read(uint8_t *data, size_t size) = 0;
+
+    // total size if known up front, it is announced with option "tsize"
+    virtual std::optional<size_t> size() const {
+        return std::nullopt;
+    }
+
+    // the regular file all of the data is read from, -1 unless there is one.
+    // A receiver on the same host may copy it itself, see option "local".
+    virtual int file_descriptor() const {
+        return -1;
+    }
+
+    // Bytes a read returns without waiting for a producer, SIZE_MAX for a
+    // source that never waits or has reached its end. A read of more would
+    // block the thread running the io_context.
+    virtual size_t available() const {
+        return SIZE_MAX;
+    }
+
+    // notify is called, from any thread, whenever more data or the end arrived
+    virtual void on_available(std::function<void()> /*notify*/) {}
+};
+
+// Where a receive transaction puts its data.
+class DataSink {
+public:
+    virtual ~DataSink() = default;
+
+    // return false if the data could not be stored, e.g. the disk is full
+    virtual bool write(const uint8_t *data, size_t size) = 0;
+
+    // every block arrived and was verified, a sink destroyed without it got an
+    // incomplete transfer. Return false if the data could not be committed.
+    virtual bool finish() {
+        return true;
+    }
+
+    // finish waits for the disk, the transaction calls it on a worker thread
+    virtual bool is_finish_blocking() {
+        return false;
+    }
+
+    // the data is one range of a striped file, called before the first write.
+    // Return false if the sink can't place data at an offset.
+    virtual bool set_range(const ByteRange &) {
+        return false;
+    }
+
+    // Option "delta": the sink holds the data of an earlier transfer, which
+    // it updates in place, the blocks the sender finds unchanged aren't sent.
+    // The size of that data, nullopt if the sink can't update it.
+    virtual std::optional<size_t> previous_size() {
+        return std::nullopt;
+    }
+
+    // the crc32c of each whole block of the earlier data, sent to the sender.
+    // Called before the first write, write_at follows instead of write.
+    virtual std::optional<std::vector<uint32_t>> begin_delta(size_t /*block_size*/) {
+        return std::nullopt;
+    }
+
+    // replace the data at the offset with a block that changed
+    virtual bool write_at(size_t /*offset*/, const uint8_t * /*data*/, size_t /*size*/) {
+        return false;
+    }
+
+    // the last block arrived, the data ends at size. Hash all of it, the
+    // blocks that weren't sent too, the sender hashed them as well.
+    virtual bool end_delta(size_t /*size*/, Crc32c & /*checksum*/) {
+        return false;
+    }
+
+    // Option "local": the data is the first size bytes of the regular file
+    // fd, instead of any write. Called on a worker thread, it may take long.
+    virtual bool copy_from(int fd, size_t size) {
+        Buffer chunk(1 << 20);
+        for (size_t offset = 0; offset < size;) {
+            auto n = ::pread(fd, chunk.data(), std::min(chunk.size(), size - offset), offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            // the file shrank since it was announced
+            if (n <= 0 || !write(chunk.data(), n))
+                return false;
+            offset += n;
+        }
+        return true;
+    }
+};
+
+// A regular file, read positionally through a handle that may be shared.
+// Given an offset, only size bytes from there are read, one stripe of it.
+class FileSource : public DataSource {
+public:
+    FileSource(std::shared_ptr<const FileHandle> file, size_t size, size_t offset = 0)
+        : file_(std::move(file)), size_(size), begin_(offset) {}
+
+    // nullptr if the file can't be opened
+    static std::unique_ptr<FileSource> open(const std::string &path) {
+        auto file = FileHandle::open(path);
+        struct stat st;
+        if (!file || ::fstat(file->fd(), &st) != 0)
+            return nullptr;
+        return std::make_unique<FileSource>(std::move(file), st.st_size);
+    }
+
+    size_t read(uint8_t *data, size_t size) override {
+        size_t n = file_->read(data, std::min(size, size_ - offset_), begin_ + offset_);
+        offset_ += n;
+        return n;
+    }
+
+    std::optional<size_t> size() const override {
+        return size_;
+    }
+
+    // not for a stripe
+    int file_descriptor() const override {
+        struct stat st;
+        return begin_ == 0 && ::fstat(file_->fd(), &st) == 0 && (size_t)st.st_size == size_ ? file_->fd() : -1;
+    }
+
+private:
+    std::shared_ptr<const FileHandle> file_;
+    size_t size_;
+    size_t begin_;
+    size_t offset_ = 0;
+};
+
+// A pipe, socket or terminal, read until end of file. A thread of its own
+// reads ahead into a bounded buffer, the transaction only takes what is
+// there already, so a stalled producer never blocks the io_context.
+class PipeSource : public DataSource {
+public:
+    explicit PipeSource(int fd, bool owns_fd = true)
+        : fd_(fd), owns_fd_(owns_fd) {
+        if (::pipe2(stop_, O_CLOEXEC) != 0)
+            throw std::system_error(errno, std::generic_category(), "pipe2");
+        reader_ = std::thread([this]() { read_ahead(); });
+    }
+
+    static std::unique_ptr<PipeSource> standard_input() {
+        return std::make_unique<PipeSource>(STDIN_FILENO, false);
+    }
+
+    ~PipeSource() override {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_stopping_ = true;
+        }
+        space_.notify_all();
+        while (::write(stop_[1], "", 1) < 0 && errno == EINTR) {
+        }
+        reader_.join();
+        ::close(stop_[0]);
+        ::close(stop_[1]);
+        if (owns_fd_)
+            ::close(fd_);
+    }
+
+    // waits for the producer only if asked for more than available()
+    size_t read(uint8_t *data, size_t size) override {
+        std::unique_lock<std::mutex> lock(mutex_);
+        data_.wait(lock, [&]() { return is_end_ || buffered_.size() - offset_ >= size; });
+        size = std::min(size, buffered_.size() - offset_);
+        std::memcpy(data, buffered_.data() + offset_, size);
+        offset_ += size;
+        if (offset_ >= buffered_.size() / 2) {
+            buffered_.erase(buffered_.begin(), buffered_.begin() + offset_);
+            offset_ = 0;
+        }
+        space_.notify_one();
+        return size;
+    }
+
+    size_t available() const override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return is_end_ ? SIZE_MAX : buffered_.size() - offset_;
+    }
+
+    void on_available(std::function<void()> notify) override {
+        std::lock_guard<std::mutex> lock(mutex_);
+        notify_ = std::move(notify);
+    }
+
+private:
+    // enough for the largest block, and to ride out a producer that hiccups
+    static const size_t max_buffered = 1 << 20;
+    static const size_t read_size = 64 << 10;
+
+    int fd_;
+    bool owns_fd_;
+    int stop_[2];  // written once to wake the reader from its poll
+
+    mutable std::mutex mutex_;
+    std::condition_variable data_;
+    std::condition_variable space_;
+    Buffer buffered_;
+    size_t offset_ = 0;  // read up to here
+    bool is_end_ = false;
+    bool is_stopping_ = false;
+    std::function<void()> notify_;
+
+    std::thread reader_;
+
+    void read_ahead() {
+        Buffer chunk(read_size);
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                space_.wait(lock, [this]() { return is_stopping_ || buffered_.size() - offset_ < max_buffered; });
+                if (is_stopping_)
+                    return;
+            }
+
+            pollfd fds[2] = {{fd_, POLLIN, 0}, {stop_[0], POLLIN, 0}};
+            if (::poll(fds, 2, -1) < 0 && errno == EINTR)
+                continue;
+            if (fds[1].revents)
+                return;
+            auto n = ::read(fd_, chunk.data(), chunk.size());
+            if (n < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+
+            std::function<void()> notify;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (n > 0)
+                    buffered_.insert(buffered_.end(), chunk.begin(), chunk.begin() + n);
+                else
+                    is_end_ = true;
+                notify = notify_;
+            }
+            data_.notify_one();
+            if (notify)
+                notify();
+            if (n <= 0)
+                return;
+        }
+    }
+};
+
+// Data held in memory, e.g. a generated config.
+class MemorySource : public DataSource {
+public:
+    explicit MemorySource(Buffer data)
+        : data_(std::move(data)) {}
+
+    size_t read(uint8_t *data, size_t size) override {
+        size = std::min(size, data_.size() - offset_);
+        // an empty buffer may have no storage at all, memcpy wants a pointer even for 0 bytes
+        if (size > 0)
+            std::memcpy(data, data_.data() + offset_, size);
+        offset_ += size;
+        return size;
+    }
+
+    std::optional<size_t> size() const override {
+        return data_.size();
+    }
+
+private:
+    Buffer data_;
+    size_t offset_ = 0;
+};
+
+// Data produced on demand. The generator fills up to size bytes and returns
+// how many, 0 ends the transfer.
+class GeneratorSource : public DataSource {
+public:
+    using Generator = std::function<size_t(uint8_t *data, size_t size)>;
+
+    explicit GeneratorSource(Generator generator)
+        : generator_(std::move(generator)) {}
+
+    size_t read(uint8_t *data, size_t size) override {
+        size_t done = 0;
+        while (!is_end_ && done < size) {
+            size_t n = generator_(data + done, size - done);
+            is_end_ = n == 0;
+            done += n;
+        }
+        return done;
+    }
+
+private:
+    Generator generator_;
+    bool is_end_ = false;
+};
+
+// How a received file reaches the disk.
+struct Durability {
+    enum class Sync {
+        none,      // leave it to the page cache
+        on_close,  // fdatasync once the transfer is complete
+        batched,   // write back every batch_bytes while receiving, fdatasync at the end
+    };
+    Sync sync = Sync::none;
+    size_t batch_bytes = 8 << 20;
+
+    // write to a hidden temp file next to it and rename it once complete, a
+    // crash or failed transfer never leaves a truncated file under the name
+    bool atomic = true;
+};
+
+// A file created or truncated at path, or one stripe of a file that several
+// sessions write at once.
+class FileSink : public DataSink {
+public:
+    FileSink(int fd, std::string path, std::string temp_path, const Durability &durability)
+        : fd_(fd), path_(std::move(path)), temp_path_(std::move(temp_path)), durability_(durability) {}
+
+    // nullptr if the file can't be created
+    static std::unique_ptr<FileSink> open(const std::string &path, const Durability &durability = {}) {
+        if (!durability.atomic) {
+            int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            return fd < 0 ? nullptr : std::make_unique<FileSink>(fd, path, "", durability);
+        }
+
+        // same directory, so the rename stays on one filesystem
+        auto target = std::filesystem::path(path);
+        auto temp = (target.parent_path() / ("." + target.filename().string() + ".XXXXXX")).string();
+        int fd = ::mkostemp(temp.data(), O_CLOEXEC);
+        if (fd < 0)
+            return nullptr;
+        ::fchmod(fd, 0644);
+        return std::make_unique<FileSink>(fd, path, temp, durability);
+    }
+
+    // Open a file that an option "delta" transfer may update. With
+    // durability.atomic the changed blocks go to the temp file. It shares
+    // the extents of the file on filesystems with reflinks, elsewhere the
+    // file is hashed where it is and the unchanged blocks are copied over
+    // once the last block arrived. Otherwise the blocks are replaced in
+    // place, an interrupted transfer leaves a mix of old and new ones. A
+    // transfer without delta starts over as open does. nullptr if it can't
+    // be opened.
+    static std::unique_ptr<FileSink> open_update(const std::string &path, const Durability &durability = {}) {
+        std::unique_ptr<FileSink> sink;
+        if (durability.atomic) {
+            sink = open(path, durability);
+        } else {
+            int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd >= 0) {
+                sink = std::make_unique<FileSink>(fd, path, "", durability);
+                sink->is_truncate_pending_ = true;
+            }
+        }
+        if (sink)
+            sink->is_update_ = true;
+        return sink;
+    }
+
+    // Open without truncating, for stripes of the same file written side by
+    // side, set_range must follow. The stripes go to the file in place, so
+    // durability.atomic doesn't apply. nullptr if the file can't be opened.
+    static std::unique_ptr<FileSink> open_stripe(const std::string &path, const Durability &durability = {}) {
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        return fd < 0 ? nullptr : std::make_unique<FileSink>(fd, path, "", durability);
+    }
+
+    // Size the file to the total, which the first stripe does and the others
+    // find done, and reserve the blocks of this stripe, so the file isn't
+    // fragmented by stripes arriving interleaved and a full disk shows now.
+    bool set_range(const ByteRange &range) override {
+        struct stat st;
+        if (written_ > 0 || ::fstat(fd_, &st) != 0)
+            return false;
+        if ((size_t)st.st_size != range.total && ::ftruncate(fd_, range.total) != 0)
+            return false;
+        if (range.length > 0) {
+            int e = ::posix_fallocate(fd_, range.offset, range.length);
+            if (e != 0 && e != EOPNOTSUPP && e != EINVAL)
+                return false;
+        }
+        begin_ = range.offset;
+        limit_ = range.length;
+        return true;
+    }
+
+    ~FileSink() override {
+        ::close(fd_);
+        if (original_fd_ >= 0)
+            ::close(original_fd_);
+        if (!temp_path_.empty() && !is_finished_)
+            ::unlink(temp_path_.c_str());
+    }
+
+    bool write(const uint8_t *data, size_t size) override {
+        if (is_truncate_pending_) {
+            if (::ftruncate(fd_, 0) != 0)
+                return false;
+            is_truncate_pending_ = false;
+        }
+        if (size > limit_ - written_ || !pwrite_all(fd_, data, size, begin_ + written_))
+            return false;
+        written_ += size;
+        if (durability_.sync == Durability::Sync::batched && written_ - flushed_ >= durability_.batch_bytes)
+            write_back();
+        return true;
+    }
+
+    std::optional<size_t> previous_size() override {
+        struct stat st;
+        if (!is_update_ || written_ > 0)
+            return std::nullopt;
+        if (!temp_path_.empty())
+            return ::stat(path_.c_str(), &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+        return ::fstat(fd_, &st) == 0 ? st.st_size : 0;
+    }
+
+    std::optional<std::vector<uint32_t>> begin_delta(size_t block_size) override {
+        if (!is_update_ || written_ > 0)
+            return std::nullopt;
+        is_truncate_pending_ = false;
+
+        int previous = fd_;
+        if (!temp_path_.empty()) {
+            original_fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+            if (original_fd_ < 0)
+                return errno == ENOENT ? std::make_optional<std::vector<uint32_t>>() : std::nullopt;
+            if (::ioctl(fd_, FICLONE, original_fd_) == 0) {
+                ::close(original_fd_);
+                original_fd_ = -1;
+            } else {
+                previous = original_fd_;
+            }
+        }
+
+        struct stat st;
+        if (::fstat(previous, &st) != 0)
+            return std::nullopt;
+        return hash_blocks(previous, st.st_size / block_size, block_size);
+    }
+
+    bool write_at(size_t offset, const uint8_t *data, size_t size) override {
+        if (!pwrite_all(fd_, data, size, offset))
+            return false;
+        // the blocks are written in order, adjacent ones make a single range
+        if (original_fd_ >= 0) {
+            if (!delta_written_.empty() && delta_written_.back().second == offset)
+                delta_written_.back().second += size;
+            else
+                delta_written_.push_back({offset, offset + size});
+        }
+        return true;
+    }
+
+    bool end_delta(size_t size, Crc32c &checksum) override {
+        if (!copy_unchanged(size) || ::ftruncate(fd_, size) != 0)
+            return false;
+        ::posix_fadvise(fd_, 0, size, POSIX_FADV_SEQUENTIAL);
+        Buffer chunk(1 << 20);
+        for (size_t offset = 0; offset < size;) {
+            auto n = ::pread(fd_, chunk.data(), std::min(chunk.size(), size - offset), offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            checksum.update(chunk.data(), n);
+            offset += n;
+        }
+        return true;
+    }
+
+    // shares the extents of fd if the filesystem can, the data never passes
+    // through user space otherwise, unless the files are on two filesystems
+    bool copy_from(int fd, size_t size) override {
+        if (written_ > 0 || begin_ > 0 || limit_ != SIZE_MAX)
+            return false;
+        is_truncate_pending_ = false;
+        if (::ftruncate(fd_, 0) != 0)
+            return false;
+        if (!copy_file(fd, fd_, size))
+            return false;
+        written_ = size;
+        return true;
+    }
+
+    bool finish() override {
+        if (durability_.sync != Durability::Sync::none && ::fdatasync(fd_) != 0)
+            return false;
+        if (!temp_path_.empty()) {
+            if (::rename(temp_path_.c_str(), path_.c_str()) != 0)
+                return false;
+            // the rename itself is only durable once the directory is
+            if (durability_.sync != Durability::Sync::none)
+                sync_directory();
+        }
+        is_finished_ = true;
+        return true;
+    }
+
+    bool is_finish_blocking() override {
+        return durability_.sync != Durability::Sync::none || !temp_path_.empty();
+    }
+
+    static bool write_all(int fd, const uint8_t *data, size_t size) {
+        while (size > 0) {
+            auto n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool pwrite_all(int fd, const uint8_t *data, size_t size, size_t offset) {
+        while (size > 0) {
+            auto n = ::pwrite(fd, data, size, offset);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+private:
+    int fd_;
+    std::string path_;
+    std::string temp_path_;  // empty unless atomic
+    Durability durability_;
+    bool is_finished_ = false;
+
+    // the stripe written, the whole file unless set_range
+    size_t begin_ = 0;
+    size_t limit_ = SIZE_MAX;
+
+    size_t written_ = 0;
+    size_t flushed_ = 0;  // writeback started up to here
+    size_t synced_ = 0;   // on disk up to here
+
+    // opened by open_update, the file keeps its data until the first write
+    bool is_update_ = false;
+    bool is_truncate_pending_ = false;
+
+    // option "delta" into a temp file that couldn't share the extents: the
+    // file it replaces, and the ranges of changed blocks written so far
+    int original_fd_ = -1;
+    std::vector<std::pair<size_t, size_t>> delta_written_;
+
+    // Option "delta" without shared extents: the blocks of the original
+    // that didn't change fill the gaps between the changed ones, up to size.
+    bool copy_unchanged(size_t size) {
+        if (original_fd_ < 0)
+            return true;
+        struct stat st;
+        if (::fstat(original_fd_, &st) != 0)
+            return false;
+        size = std::min<size_t>(size, st.st_size);
+
+        size_t offset = 0;
+        for (auto &[begin, end] : delta_written_) {
+            if (begin > offset && !copy_range(original_fd_, fd_, offset, std::min(begin, size) - offset))
+                return false;
+            offset = std::max(offset, end);
+            if (offset >= size)
+                return true;
+        }
+        return offset >= size || copy_range(original_fd_, fd_, offset, size - offset);
+    }
+
+    // copy the first size bytes of source into the empty file fd, sharing
+    // the extents if the filesystem can. False if source is shorter.
+    static bool copy_file(int source, int fd, size_t size) {
+        struct stat st;
+        if (::fstat(source, &st) != 0 || (size_t)st.st_size < size)
+            return false;
+        if ((size_t)st.st_size == size && ::ioctl(fd, FICLONE, source) == 0)
+            return true;
+        return copy_range(source, fd, 0, size);
+    }
+
+    // copy size bytes at offset within the kernel, through a buffer where the
+    // filesystems can't do that
+    static bool copy_range(int source, int fd, size_t offset, size_t size) {
+        loff_t in = offset, out = offset;
+        size_t end = offset + size;
+        while ((size_t)in < end) {
+            auto n = ::copy_file_range(source, &in, fd, &out, end - in, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOSYS))
+                break;
+            if (n <= 0)
+                return false;
+        }
+
+        Buffer chunk(1 << 20);
+        while ((size_t)in < end) {
+            auto n = ::pread(source, chunk.data(), std::min<size_t>(chunk.size(), end - in), in);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0 || !pwrite_all(fd, chunk.data(), n, in))
+                return false;
+            in += n;
+        }
+        return true;
+    }
+
+    // Start writeback of the new batch without waiting for it, and wait for
+    // the batch before, which had a whole batch worth of time to complete.
+    // The final fdatasync then only has little left to do, and the dirty
+    // pages never pile up to the size of the file. The counters start at
+    // the stripe, the file offsets at begin_.
+    void write_back() {
+#ifdef SYNC_FILE_RANGE_WRITE
+        ::sync_file_range(fd_, begin_ + flushed_, written_ - flushed_, SYNC_FILE_RANGE_WRITE);
+        if (flushed_ > synced_) {
+            ::sync_file_range(fd_, begin_ + synced_, flushed_ - synced_,
+                              SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+            synced_ = flushed_;
+        }
+#else
+        ::fdatasync(fd_);
+        synced_ = written_;
+#endif
+        flushed_ = written_;
+    }
+
+    void sync_directory() {
+        auto dir = std::filesystem::path(path_).parent_path();
+        int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            ::fsync(fd);
+            ::close(fd);
+        }
+    }
+};
+
+// A pipe, socket or terminal, e.g. standard output.
+class PipeSink : public DataSink {
+public:
+    explicit PipeSink(int fd, bool owns_fd = true)
+        : fd_(fd), owns_fd_(owns_fd) {}
+
+    static std::unique_ptr<PipeSink> standard_output() {
+        return std::make_unique<PipeSink>(STDOUT_FILENO, false);
+    }
+
+    ~PipeSink() override {
+        if (owns_fd_)
+            ::close(fd_);
+    }
+
+    bool write(const uint8_t *data, size_t size) override {
+        return FileSink::write_all(fd_, data, size);
+    }
+
+private:
+    int fd_;
+    bool owns_fd_;
+};
+
+// Collects the data in memory, the buffer is shared with the caller.
+class MemorySink : public DataSink {
+public:
+    explicit MemorySink(std::shared_ptr<Buffer> data)
+        : data_(std::move(data)) {}
+
+    bool write(const uint8_t *data, size_t size) override {
+        data_->insert(data_->end(), data, data + size);
+        return true;
+    }
+
+private:
+    std::shared_ptr<Buffer> data_;
+};
+
+// Hands every chunk to a callback, the callback gets an empty chunk at the end.
+class CallbackSink : public DataSink {
+public:
+    using Callback = std::function<void(const uint8_t *data, size_t size)>;
+
+    explicit CallbackSink(Callback callback)
+        : callback_(std::move(callback)) {}
+
+    bool write(const uint8_t *data, size_t size) override {
+        if (size > 0)
+            callback_(data, size);
+        return true;
+    }
+
+    bool finish() override {
+        callback_(nullptr, 0);
+        return true;
+    }
+
+private:
+    Callback callback_;
+};
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef DATAGRAM_TRANSPORT_HPP
+#define DATAGRAM_TRANSPORT_HPP
+
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "Log.hpp"
+#include "TftpPacketBuilder.hpp"
+
+namespace tftp {
+
+using boost::asio::ip::udp;
+
+// Where TftpPeer gets its datagrams from. The default is a plain udp socket,
+// decorators such as ImpairedTransport sit in between to emulate a network.
+class DatagramTransport {
+public:
+    using Handler = std::function<void(boost::system::error_code, std::size_t)>;
+
+    virtual ~DatagramTransport() = default;
+
+    virtual udp::endpoint local_endpoint() const = 0;
+
+    // datagrams the kernel dropped because the receive buffer was full
+    virtual size_t dropped() const {
+        return 0;
+    }
+
+    // the buffer and endpoint must stay valid until the handler runs, like with a socket
+    virtual void async_receive(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, Handler handler) = 0;
+    virtual void async_send(boost::asio::const_buffer buffer, const udp::endpoint &endpoint, Handler handler) = 0;
+
+    // Send a datagram the transport may go on reading after the handler ran,
+    // as zero copy sends do, it holds on to it until the kernel is done.
+    // Anywhere else it is sent like with async_send.
+    virtual void async_send_shared(std::shared_ptr<const Buffer> datagram, const udp::endpoint &endpoint, Handler handler) {
+        auto buffer = boost::asio::buffer(*datagram);
+        async_send(buffer, endpoint, [datagram = std::move(datagram), handler = std::move(handler)](
+                                         boost::system::error_code e, std::size_t bytes) { handler(e, bytes); });
+    }
+
+    // completion token versions, so coroutines can co_await the transport
+    template <typename CompletionToken>
+    auto async_receive_from(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, CompletionToken &&token) {
+        return boost::asio::async_initiate<CompletionToken, void(boost::system::error_code, std::size_t)>(
+            [this](auto handler, boost::asio::mutable_buffer buffer, udp::endpoint *endpoint) {
+                async_receive(buffer, *endpoint, wrap(std::move(handler)));
+            },
+            token, buffer, &endpoint);
+    }
+
+    template <typename CompletionToken>
+    auto async_send_to(boost::asio::const_buffer buffer, const udp::endpoint &endpoint, CompletionToken &&token) {
+        return boost::asio::async_initiate<CompletionToken, void(boost::system::error_code, std::size_t)>(
+            [this](auto handler, boost::asio::const_buffer buffer, udp::endpoint endpoint) {
+                async_send(buffer, endpoint, wrap(std::move(handler)));
+            },
+            token, buffer, endpoint);
+    }
+
+private:
+    // completion handlers may be move only, std::function wants to copy
+    template <typename CompletionHandler>
+    static Handler wrap(CompletionHandler handler) {
+        auto handler_ptr = std::make_shared<CompletionHandler>(std::move(handler));
+        return [handler_ptr](boost::system::error_code e, std::size_t bytes) {
+            (*handler_ptr)(e, bytes);
+        };
+    }
+};
+
+// Tuning of a udp socket.
+struct SocketOptions {
+    // SO_RCVBUF and SO_SNDBUF in bytes, 0 keeps the system default. Sizes
+    // beyond net.core.rmem_max and wmem_max need CAP_NET_ADMIN.
+    int receive_buffer = 0;
+    int send_buffer = 0;
+
+    // Spin on non-blocking receives instead of sleeping in the reactor until a
+    // datagram arrives, which saves the wakeup on every packet. The thread
+    // running the io_context never sleeps then, give it a core of its own.
+    bool spin = false;
+
+    // SO_BUSY_POLL, microseconds the kernel polls the device queue for a
+    // receive before giving up, 0 to leave it off
+    int busy_poll = 0;
+
+    // Send large datagrams with MSG_ZEROCOPY, the device reads them from our
+    // pages instead of the kernel copying them, see UdpTransport.
+    bool zerocopy = false;
+};
+
+class UdpTransport : public DatagramTransport {
+public:
+    UdpTransport(boost::asio::io_context &io_context, const udp::endpoint &endpoint)
+        : socket_(io_context, endpoint.protocol()) {
+        socket_.bind(endpoint);
+        // every datagram received carries the drop counter of the socket
+        int on = 1;
+        ::setsockopt(socket_.native_handle(), SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+    }
+
+    udp::socket &socket() {
+        return socket_;
+    }
+
+    // call on the thread of the io_context, return false if an option was refused
+    bool set_options(const SocketOptions &options) {
+        options_ = options;
+        int fd = socket_.native_handle();
+        bool ok = true;
+        // the force variants ignore the system limits if we are allowed to
+        if (options.receive_buffer > 0 &&
+            ::setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &options.receive_buffer, sizeof(int)) != 0)
+            ok &= ::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options.receive_buffer, sizeof(int)) == 0;
+        if (options.send_buffer > 0 &&
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &options.send_buffer, sizeof(int)) != 0)
+            ok &= ::setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options.send_buffer, sizeof(int)) == 0;
+#ifdef SO_BUSY_POLL
+        ok &= ::setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &options.busy_poll, sizeof(int)) == 0 || options.busy_poll == 0;
+#else
+        ok &= options.busy_poll == 0;
+#endif
+        // sends still in flight are tracked until they complete either way
+        int zerocopy = options.zerocopy;
+        is_zerocopy_ = ::setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &zerocopy, sizeof(int)) == 0 && options.zerocopy;
+        ok &= is_zerocopy_ == options.zerocopy;
+        // turned on again, e.g. after the route changed, probe it anew
+        probe_completed_ = 0;
+        probe_copied_ = 0;
+        return ok;
+    }
+
+    // buffer sizes granted by the kernel, which doubles the requested ones for its bookkeeping
+    int receive_buffer() {
+        return get_option(SO_RCVBUF);
+    }
+
+    int send_buffer() {
+        return get_option(SO_SNDBUF);
+    }
+
+    size_t dropped() const override {
+        return dropped_;
+    }
+
+    // zero copy sends the kernel reported done, and how many of them it copied after all
+    size_t zerocopy_completed() const {
+        return zerocopy_completed_;
+    }
+
+    size_t zerocopy_copied() const {
+        return zerocopy_copied_;
+    }
+
+    udp::endpoint local_endpoint() const override {
+        return socket_.local_endpoint();
+    }
+
+    // read right away if a datagram is waiting, otherwise wait for the reactor or spin
+    void async_receive(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, Handler handler) override {
+        boost::system::error_code e;
+        size_t bytes = receive_now(buffer, endpoint, e);
+        if (e != boost::asio::error::would_block) {
+            boost::asio::post(socket_.get_executor(), [handler = std::move(handler), e, bytes]() { handler(e, bytes); });
+            return;
+        }
+        // completions on the error queue wake up the reactor too
+        reap_zerocopy();
+
+        auto retry = [this, alive = std::weak_ptr<int>(alive_), buffer, &endpoint,
+                      handler = std::move(handler)](boost::system::error_code e = {}) mutable {
+            if (!e && alive.expired())
+                e = boost::asio::error::operation_aborted;
+            if (e)
+                handler(e, 0);
+            else
+                async_receive(buffer, endpoint, std::move(handler));
+        };
+        if (options_.spin)
+            boost::asio::post(socket_.get_executor(), std::move(retry));
+        else
+            socket_.async_wait(udp::socket::wait_read, std::move(retry));
+    }
+
+    void async_send(boost::asio::const_buffer buffer, const udp::endpoint &endpoint, Handler handler) override {
+        socket_.async_send_to(buffer, endpoint, std::move(handler));
+    }
+
+    void async_send_shared(std::shared_ptr<const Buffer> datagram, const udp::endpoint &endpoint, Handler handler) override {
+        if (is_zerocopy_ && datagram->size() >= zerocopy_min_size)
+            send_zerocopy(std::move(datagram), endpoint, std::move(handler));
+        else
+            DatagramTransport::async_send_shared(std::move(datagram), endpoint, std::move(handler));
+    }
+
+private:
+    // Below this the bookkeeping of the completions costs more than the copy.
+    // Sends that the kernel ends up copying anyway, e.g. over loopback, only
+    // cost, after zerocopy_probe sends that were all copied it is given up.
+    static constexpr size_t zerocopy_min_size = 16 << 10;
+    static constexpr size_t zerocopy_probe = 64;
+
+    // a zero copy send, the kernel may read the datagram until it completes
+    struct ZerocopySend {
+        std::shared_ptr<const Buffer> datagram;  // nullptr once completed
+    };
+
+    udp::socket socket_;
+    SocketOptions options_;
+    size_t dropped_ = 0;
+
+    bool is_zerocopy_ = false;
+    // in order of their sequence numbers, which the kernel counts per socket
+    std::deque<ZerocopySend> zerocopy_sends_;
+    uint32_t zerocopy_front_ = 0;  // sequence number of the front
+    uint32_t zerocopy_next_ = 0;
+    bool is_reaping_ = false;
+    size_t zerocopy_completed_ = 0;
+    size_t zerocopy_copied_ = 0;
+    // the same since zero copy was last turned on
+    size_t probe_completed_ = 0;
+    size_t probe_copied_ = 0;
+
+    // retries of a receive may outlive the transport
+    std::shared_ptr<int> alive_ = std::make_shared<int>();
+
+    int get_option(int name) {
+        int value = 0;
+        socklen_t length = sizeof(value);
+        ::getsockopt(socket_.native_handle(), SOL_SOCKET, name, &value, &length);
+        return value;
+    }
+
+    // recvmsg instead of receive_from, for the drop counter in the control data
+    size_t receive_now(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, boost::system::error_code &e) {
+        iovec iov{buffer.data(), buffer.size()};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(uint32_t))];
+        msghdr message{};
+        message.msg_name = endpoint.data();
+        message.msg_namelen = endpoint.capacity();
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t bytes;
+        do {
+            bytes = ::recvmsg(socket_.native_handle(), &message, MSG_DONTWAIT);
+        } while (bytes < 0 && errno == EINTR);
+        if (bytes < 0) {
+            e = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            return 0;
+        }
+
+        endpoint.resize(message.msg_namelen);
+        for (auto cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t counter;
+                std::memcpy(&counter, CMSG_DATA(cmsg), sizeof(counter));
+                dropped_ = counter;
+            }
+        }
+        return bytes;
+    }
+
+    // The datagram is queued once sendmsg returns, the handler runs then like
+    // for any send, but the device reads it from our pages later. It is kept
+    // until the completion for its sequence number shows up on the error queue.
+    void send_zerocopy(std::shared_ptr<const Buffer> datagram, udp::endpoint endpoint, Handler handler) {
+        ssize_t bytes;
+        do {
+            bytes = ::sendto(socket_.native_handle(), datagram->data(), datagram->size(), MSG_ZEROCOPY | MSG_DONTWAIT,
+                             endpoint.data(), endpoint.size());
+        } while (bytes < 0 && errno == EINTR);
+
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            socket_.async_wait(udp::socket::wait_write, [this, alive = std::weak_ptr<int>(alive_), datagram, endpoint,
+                                                         handler = std::move(handler)](boost::system::error_code e) mutable {
+                if (!e && alive.expired())
+                    e = boost::asio::error::operation_aborted;
+                if (e)
+                    handler(e, 0);
+                else
+                    send_zerocopy(std::move(datagram), endpoint, std::move(handler));
+            });
+            return;
+        }
+        // out of socket memory for the completions, this one is copied
+        if (bytes < 0 && errno == ENOBUFS) {
+            DatagramTransport::async_send_shared(std::move(datagram), endpoint, std::move(handler));
+            return;
+        }
+
+        boost::system::error_code e;
+        if (bytes < 0) {
+            e = boost::system::error_code(errno, boost::asio::error::get_system_category());
+            bytes = 0;
+        } else {
+            zerocopy_sends_.push_back({std::move(datagram)});
+            zerocopy_next_++;
+            wait_zerocopy();
+        }
+        boost::asio::post(socket_.get_executor(), [handler = std::move(handler), e, bytes]() { handler(e, bytes); });
+    }
+
+    // the reactor wakes up for the error queue while sends are in flight
+    void wait_zerocopy() {
+        if (is_reaping_ || zerocopy_sends_.empty())
+            return;
+        is_reaping_ = true;
+        socket_.async_wait(udp::socket::wait_error, [this, alive = std::weak_ptr<int>(alive_)](boost::system::error_code e) {
+            if (alive.expired())
+                return;
+            is_reaping_ = false;
+            if (e == boost::asio::error::operation_aborted)
+                return;
+            reap_zerocopy();
+            wait_zerocopy();
+        });
+    }
+
+    // completions come in ranges of sequence numbers, not necessarily in order
+    void reap_zerocopy() {
+        while (!zerocopy_sends_.empty()) {
+            alignas(cmsghdr) char control[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+            msghdr message{};
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            if (::recvmsg(socket_.native_handle(), &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+                break;
+
+            for (auto cmsg = CMSG_FIRSTHDR(&message); cmsg; cmsg = CMSG_NXTHDR(&message, cmsg)) {
+                if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                    !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+                    continue;
+                sock_extended_err error;
+                std::memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+                if (error.ee_origin == SO_EE_ORIGIN_ZEROCOPY && error.ee_errno == 0)
+                    complete_zerocopy(error.ee_info, error.ee_data, error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+            }
+        }
+
+        while (!zerocopy_sends_.empty() && !zerocopy_sends_.front().datagram) {
+            zerocopy_sends_.pop_front();
+            zerocopy_front_++;
+        }
+    }
+
+    void complete_zerocopy(uint32_t first, uint32_t last, bool copied) {
+        size_t count = 0;
+        for (uint32_t sequence = first;; sequence++) {
+            uint32_t index = sequence - zerocopy_front_;
+            if (index < zerocopy_sends_.size() && zerocopy_sends_[index].datagram) {
+                zerocopy_sends_[index].datagram.reset();
+                count++;
+            }
+            if (sequence == last)
+                break;
+        }
+
+        zerocopy_completed_ += count;
+        probe_completed_ += count;
+        if (copied) {
+            zerocopy_copied_ += count;
+            probe_copied_ += count;
+        }
+        if (is_zerocopy_ && probe_completed_ >= zerocopy_probe && probe_copied_ == probe_completed_) {
+            is_zerocopy_ = false;
+            tftp::log::info("zero copy sends of ", socket_.local_endpoint(), " are copied by the kernel, sending with copies");
+        }
+    }
+};
+
+}  // namespace tftp
+
+#endif
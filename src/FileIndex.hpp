@@ -0,0 +1,227 @@
+#ifndef FILE_INDEX_HPP
+#define FILE_INDEX_HPP
+
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __has_include(<sys/inotify.h>)
+#include <sys/inotify.h>
+#define TFTP_FILE_INDEX_HAS_INOTIFY 1
+#endif
+
+namespace tftp {
+
+// An open file descriptor shared by every transaction reading the file. Reads
+// are positional, so any number of readers can use it at once.
+class FileHandle {
+public:
+    explicit FileHandle(int fd)
+        : fd_(fd) {}
+
+    FileHandle(const FileHandle &) = delete;
+    FileHandle &operator=(const FileHandle &) = delete;
+
+    ~FileHandle() {
+        ::close(fd_);
+    }
+
+    // nullptr if the file can't be opened for reading
+    static std::shared_ptr<FileHandle> open(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        return fd < 0 ? nullptr : std::make_shared<FileHandle>(fd);
+    }
+
+    int fd() const {
+        return fd_;
+    }
+
+    // read up to size bytes at offset, less only at the end of the file
+    size_t read(uint8_t *data, size_t size, size_t offset) const {
+        size_t done = 0;
+        while (done < size) {
+            auto n = ::pread(fd_, data + done, size - done, offset + done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        return done;
+    }
+
+private:
+    int fd_;
+};
+
+// Metadata of the files served to read requests: size, mtime, whether they
+// can be read, and an open handle. Repeated requests for the same files, e.g.
+// many devices booting at once, are answered from memory. The directories of
+// indexed files are watched with inotify and any change drops their entries,
+// without inotify nothing is cached and every lookup goes to the filesystem.
+class FileIndex {
+public:
+    using Clock = std::chrono::system_clock;
+
+    struct Entry {
+        bool readable = false;  // a regular file that could be opened
+        size_t size = 0;
+        Clock::time_point mtime;
+        std::shared_ptr<FileHandle> handle;
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+
+    explicit FileIndex(boost::asio::io_context &io_context)
+        : inotify_(io_context) {
+#ifdef TFTP_FILE_INDEX_HAS_INOTIFY
+        int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd >= 0) {
+            inotify_.assign(fd);
+            boost::asio::co_spawn(io_context, watch_loop(), boost::asio::detached);
+        }
+#endif
+    }
+
+    // never nullptr, a missing file gives an entry that isn't readable
+    EntryPtr find(const std::string &filename) {
+        auto key = std::filesystem::path(filename).lexically_normal().string();
+        auto it = entries_.find(key);
+        if (it != entries_.end())
+            return it->second;
+
+        // watch before the file is read, so a change in between still drops the entry
+        bool is_watched = watch(key);
+        auto entry = load(key);
+        if (is_watched) {
+            // every cached entry may hold a descriptor, stay well below the limit
+            if (entries_.size() >= max_entries)
+                entries_.clear();
+            entries_.emplace(key, entry);
+        }
+        return entry;
+    }
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+private:
+    static const size_t max_entries = 256;
+
+    std::unordered_map<std::string, EntryPtr> entries_;
+
+    boost::asio::posix::stream_descriptor inotify_;
+    // a directory reached through different paths has a single watch
+    std::unordered_map<int, std::set<std::string>> watch_dirs_;
+    std::unordered_map<std::string, int> dir_watches_;
+
+    static EntryPtr load(const std::string &path) {
+        auto entry = std::make_shared<Entry>();
+        struct stat st;
+        if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+            return entry;
+
+        entry->handle = FileHandle::open(path);
+        entry->readable = entry->handle != nullptr;
+        entry->size = st.st_size;
+        entry->mtime = Clock::time_point(std::chrono::duration_cast<Clock::duration>(
+            std::chrono::seconds(st.st_mtim.tv_sec) + std::chrono::nanoseconds(st.st_mtim.tv_nsec)));
+        return entry;
+    }
+
+    static std::string parent_dir(const std::string &key) {
+        auto dir = std::filesystem::path(key).parent_path().string();
+        return dir.empty() ? "." : dir;
+    }
+
+    // return false if changes to the file would go unnoticed
+    bool watch(const std::string &key) {
+#ifdef TFTP_FILE_INDEX_HAS_INOTIFY
+        if (!inotify_.is_open())
+            return false;
+
+        auto dir = parent_dir(key);
+        if (dir_watches_.count(dir))
+            return true;
+
+        int wd = ::inotify_add_watch(inotify_.native_handle(), dir.c_str(),
+                                     IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+                                         IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+        if (wd < 0)
+            return false;
+        dir_watches_[dir] = wd;
+        watch_dirs_[wd].insert(dir);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+#ifdef TFTP_FILE_INDEX_HAS_INOTIFY
+    // a member, a local of the coroutine would lose its alignment in the frame
+    alignas(inotify_event) char events_[16 * 1024];
+
+    boost::asio::awaitable<void> watch_loop() {
+        for (;;) {
+            boost::system::error_code e;
+            auto bytes = co_await inotify_.async_read_some(
+                boost::asio::buffer(events_), boost::asio::redirect_error(boost::asio::use_awaitable, e));
+            if (e == boost::asio::error::operation_aborted)
+                co_return;
+            if (e)
+                continue;
+
+            for (size_t offset = 0; offset < bytes;) {
+                auto event = reinterpret_cast<const inotify_event *>(events_ + offset);
+                handle_event(*event);
+                offset += sizeof(inotify_event) + event->len;
+            }
+        }
+    }
+
+    void handle_event(const inotify_event &event) {
+        // events got lost, nothing can be trusted anymore
+        if (event.mask & IN_Q_OVERFLOW) {
+            entries_.clear();
+            return;
+        }
+
+        auto it = watch_dirs_.find(event.wd);
+        if (it == watch_dirs_.end())
+            return;
+
+        // the directory itself is gone or moved, forget everything in it
+        if (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+            for (auto &dir : it->second) {
+                std::erase_if(entries_, [&dir](auto &entry) { return parent_dir(entry.first) == dir; });
+                dir_watches_.erase(dir);
+            }
+            if (!(event.mask & IN_IGNORED))
+                ::inotify_rm_watch(inotify_.native_handle(), event.wd);
+            watch_dirs_.erase(it);
+            return;
+        }
+
+        if (event.len == 0)
+            return;
+        for (auto &dir : it->second) {
+            auto key = (std::filesystem::path(dir) / event.name).lexically_normal().string();
+            entries_.erase(key);
+        }
+    }
+#endif
+};
+
+}  // namespace tftp
+
+#endif
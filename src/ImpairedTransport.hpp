@@ -0,0 +1,191 @@
+#ifndef IMPAIRED_TRANSPORT_HPP
+#define IMPAIRED_TRANSPORT_HPP
+
+#include "DatagramTransport.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace tftp {
+
+// What the emulated network does to outgoing packets, probabilities in [0, 1].
+struct Impairment {
+    double drop = 0;
+    double duplicate = 0;
+    double reorder = 0;  // held back by reorder_delay, so later packets overtake it
+    std::chrono::milliseconds delay{0};
+    std::chrono::milliseconds jitter{0};  // uniform in [0, jitter), added to delay
+    std::chrono::milliseconds reorder_delay{1};
+    double rate = 0;                 // bytes/s of the emulated link, 0 for unlimited
+    size_t queue_limit = 256 << 10;  // bytes the link may buffer, tail drop beyond
+    uint64_t seed = 0;
+
+    bool is_enabled() const {
+        return drop > 0 || duplicate > 0 || reorder > 0 || delay.count() > 0 || jitter.count() > 0 || rate > 0;
+    }
+};
+
+struct ImpairmentStats {
+    size_t packets = 0;  // handed to the transport
+    size_t dropped = 0;  // random loss and link queue overflow
+    size_t duplicated = 0;
+    size_t reordered = 0;
+};
+
+// Emulates a lossy, slow link on the egress of another transport, like netem
+// does in the kernel. Decisions come from a seeded generator, so the same
+// seed and the same packet sequence give the same losses. Without impairment
+// packets go straight through.
+class ImpairedTransport : public DatagramTransport {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    ImpairedTransport(boost::asio::io_context &io_context, std::unique_ptr<DatagramTransport> next)
+        : next_(std::move(next)), timer_(io_context) {}
+
+    void set_impairment(const Impairment &impairment) {
+        impairment_ = impairment;
+        random_.seed(impairment.seed);
+        link_free_ = Clock::time_point::min();
+    }
+
+    const Impairment &impairment() const {
+        return impairment_;
+    }
+
+    const ImpairmentStats &stats() const {
+        return stats_;
+    }
+
+    udp::endpoint local_endpoint() const override {
+        return next_->local_endpoint();
+    }
+
+    size_t dropped() const override {
+        return next_->dropped();
+    }
+
+    void async_receive(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, Handler handler) override {
+        next_->async_receive(buffer, endpoint, std::move(handler));
+    }
+
+    void async_send(boost::asio::const_buffer buffer, const udp::endpoint &endpoint, Handler handler) override {
+        if (!impairment_.is_enabled()) {
+            next_->async_send(buffer, endpoint, std::move(handler));
+            return;
+        }
+
+        // accepted like by a socket, what happens next is up to the link
+        ++stats_.packets;
+        boost::asio::post(timer_.get_executor(), [handler = std::move(handler), size = buffer.size()] {
+            handler(boost::system::error_code(), size);
+        });
+
+        if (chance(impairment_.drop)) {
+            ++stats_.dropped;
+            return;
+        }
+
+        auto now = Clock::now();
+        auto arrival = now;
+        if (impairment_.rate > 0) {
+            // serialize onto the link, drop when its queue is full
+            link_free_ = std::max(link_free_, now);
+            auto backlog = std::chrono::duration<double>(link_free_ - now).count() * impairment_.rate;
+            if (backlog + buffer.size() > impairment_.queue_limit) {
+                ++stats_.dropped;
+                return;
+            }
+            link_free_ += std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(buffer.size() / impairment_.rate));
+            arrival = link_free_;
+        }
+        arrival += impairment_.delay + random_jitter();
+        if (chance(impairment_.reorder)) {
+            ++stats_.reordered;
+            arrival += impairment_.reorder_delay;
+        }
+
+        auto data = static_cast<const uint8_t *>(buffer.data());
+        auto packet = std::make_shared<Packet>(Packet{endpoint, std::vector<uint8_t>(data, data + buffer.size())});
+        schedule(arrival, packet);
+        if (chance(impairment_.duplicate)) {
+            ++stats_.duplicated;
+            schedule(arrival + random_jitter(), packet);
+        }
+    }
+
+    // impaired packets are copied anyway, the rest may go out without copies
+    void async_send_shared(std::shared_ptr<const Buffer> datagram, const udp::endpoint &endpoint, Handler handler) override {
+        if (impairment_.is_enabled())
+            DatagramTransport::async_send_shared(std::move(datagram), endpoint, std::move(handler));
+        else
+            next_->async_send_shared(std::move(datagram), endpoint, std::move(handler));
+    }
+
+private:
+    struct Packet {
+        udp::endpoint endpoint;
+        std::vector<uint8_t> data;
+    };
+
+    std::unique_ptr<DatagramTransport> next_;
+    Impairment impairment_;
+    ImpairmentStats stats_;
+    std::mt19937_64 random_;
+
+    Clock::time_point link_free_ = Clock::time_point::min();  // when the emulated link is idle again
+
+    // packets in flight by the time they leave
+    std::multimap<Clock::time_point, std::shared_ptr<Packet>> pending_;
+    boost::asio::steady_timer timer_;
+    Clock::time_point timer_deadline_ = Clock::time_point::max();
+
+    bool chance(double probability) {
+        return probability > 0 && std::uniform_real_distribution<double>(0, 1)(random_) < probability;
+    }
+
+    Clock::duration random_jitter() {
+        if (impairment_.jitter.count() <= 0)
+            return Clock::duration::zero();
+        auto jitter = std::chrono::duration_cast<Clock::duration>(impairment_.jitter).count();
+        return Clock::duration(std::uniform_int_distribution<Clock::rep>(0, jitter - 1)(random_));
+    }
+
+    void schedule(Clock::time_point when, std::shared_ptr<Packet> packet) {
+        pending_.emplace(when, std::move(packet));
+        arm_timer(pending_.begin()->first);
+    }
+
+    void arm_timer(Clock::time_point deadline) {
+        if (deadline >= timer_deadline_)
+            return;
+        timer_deadline_ = deadline;
+        timer_.expires_at(deadline);
+        timer_.async_wait([this](boost::system::error_code e) {
+            if (e)
+                return;
+            timer_deadline_ = Clock::time_point::max();
+            release();
+        });
+    }
+
+    void release() {
+        auto now = Clock::now();
+        while (!pending_.empty() && pending_.begin()->first <= now) {
+            auto packet = std::move(pending_.begin()->second);
+            pending_.erase(pending_.begin());
+            // the packet keeps itself alive until the real send completed
+            next_->async_send(boost::asio::buffer(packet->data), packet->endpoint,
+                              [packet](boost::system::error_code, std::size_t) {});
+        }
+        if (!pending_.empty())
+            arm_timer(pending_.begin()->first);
+    }
+};
+
+}  // namespace tftp
+
+#endif
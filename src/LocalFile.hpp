@@ -0,0 +1,72 @@
+#ifndef LOCAL_FILE_HPP
+#define LOCAL_FILE_HPP
+
+#include <boost/asio.hpp>
+#include <cstdio>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "FileIndex.hpp"
+
+namespace tftp {
+
+// The open file a sender reads from, handed to a receiver on the same host
+// with the non-standard option "local". The receiver opens it again through
+// /proc/<pid>/fd/<fd> of the sender and copies it, the session only carries
+// an empty block 0 and its ack. Device and inode make sure it is the file
+// the sender meant, and not a file of another process with the same pid in
+// another pid namespace. Only a read request asks for it, with "0", and the
+// oack answers with "pid:fd:dev:ino": the client opens the descriptor with
+// its own rights. A server would open whatever a client named with its own.
+struct LocalFile {
+    pid_t pid = 0;
+    int fd = -1;
+    dev_t dev = 0;
+    ino_t ino = 0;
+
+    // nullopt unless fd is a regular file
+    static std::optional<LocalFile> of(int fd) {
+        struct stat st;
+        if (fd < 0 || ::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+            return std::nullopt;
+        return LocalFile{::getpid(), fd, st.st_dev, st.st_ino};
+    }
+
+    std::string to_string() const {
+        return std::to_string(pid) + ":" + std::to_string(fd) + ":" + std::to_string(dev) + ":" + std::to_string(ino);
+    }
+
+    static std::optional<LocalFile> parse(const std::string &value) {
+        unsigned long pid = 0, dev = 0, ino = 0;
+        int fd = -1, consumed = 0;
+        if (std::sscanf(value.c_str(), "%lu:%d:%lu:%lu%n", &pid, &fd, &dev, &ino, &consumed) != 4 ||
+            consumed != (int)value.size() || pid == 0 || fd < 0)
+            return std::nullopt;
+        return LocalFile{(pid_t)pid, fd, (dev_t)dev, (ino_t)ino};
+    }
+
+    // nullptr if the file can't be opened, e.g. the sender runs as another
+    // user, or it isn't the same file anymore
+    std::shared_ptr<FileHandle> open() const {
+        auto file = FileHandle::open("/proc/" + std::to_string(pid) + "/fd/" + std::to_string(fd));
+        struct stat st;
+        if (!file || ::fstat(file->fd(), &st) != 0 || st.st_dev != dev || st.st_ino != ino)
+            return nullptr;
+        return file;
+    }
+
+    // only a peer on loopback shares our filesystem and processes
+    static bool is_local_peer(const boost::asio::ip::address &address) {
+        if (address.is_v6() && address.to_v6().is_v4_mapped())
+            return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6()).is_loopback();
+        return address.is_loopback();
+    }
+};
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,241 @@
+#ifndef LOG_HPP
+#define LOG_HPP
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+// Levels below this are compiled out, 0 trace, 1 debug, 2 info, 3 warn, 4 error
+#ifndef TFTP_LOG_LEVEL
+#define TFTP_LOG_LEVEL 2
+#endif
+
+namespace tftp::log {
+
+enum class Level { trace, debug, info, warn, error, off };
+
+inline constexpr Level compiled_level = static_cast<Level>(TFTP_LOG_LEVEL);
+
+// Lines go to standard error through a background thread, so the threads
+// logging never wait for the terminal. Each thread appends to a buffer of
+// its own, the writer collects the buffers in batches. Lines of one thread
+// keep their order, lines of different threads may interleave by batch.
+// Standard output is left to the data, e.g. a file fetched to a pipe.
+class Logger {
+public:
+    static Logger &instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    Logger(const Logger &) = delete;
+    Logger &operator=(const Logger &) = delete;
+
+    ~Logger() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            is_stopping_ = true;
+        }
+        wakeup_.notify_one();
+        writer_.join();
+    }
+
+    // lines below the level are dropped, the compiled level still applies
+    void set_level(Level level) {
+        level_.store(level, std::memory_order_relaxed);
+    }
+
+    // where the lines go from the next batch on, standard error by default
+    void set_output(int fd) {
+        fd_.store(fd, std::memory_order_relaxed);
+    }
+
+    bool is_enabled(Level level) const {
+        return level >= level_.load(std::memory_order_relaxed);
+    }
+
+    void write(Level level, std::string_view message) {
+        auto &buffer = thread_buffer();
+        bool was_empty;
+        {
+            std::lock_guard<std::mutex> lock(buffer.mutex);
+            was_empty = buffer.lines.empty();
+            if (level != Level::info) {
+                buffer.lines += prefix(level);
+            }
+            buffer.lines += message;
+            buffer.lines += '\n';
+        }
+
+        // the writer only needs waking for a batch that just started
+        if (was_empty && !is_pending_.exchange(true)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            wakeup_.notify_one();
+        }
+    }
+
+    // write out everything logged so far, e.g. before the process exits
+    void flush() {
+        drain();
+    }
+
+private:
+    struct ThreadBuffer {
+        std::mutex mutex;
+        std::string lines;
+    };
+
+    // while the writer is busy or just wrote, lines collect for the next batch
+    static constexpr std::chrono::milliseconds batch_interval{10};
+
+    std::atomic<Level> level_{Level::info};
+    std::atomic<int> fd_{STDERR_FILENO};
+    std::atomic<bool> is_pending_{false};
+
+    std::mutex mutex_;
+    std::condition_variable wakeup_;
+    bool is_stopping_ = false;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers_;
+
+    // one batch at a time, from the writer or a flush
+    std::mutex drain_mutex_;
+    std::string batch_;
+
+    std::thread writer_;
+
+    Logger()
+        : writer_([this]() { run(); }) {}
+
+    ThreadBuffer &thread_buffer() {
+        thread_local std::shared_ptr<ThreadBuffer> buffer;
+        if (!buffer) {
+            buffer = std::make_shared<ThreadBuffer>();
+            std::lock_guard<std::mutex> lock(mutex_);
+            buffers_.push_back(buffer);
+        }
+        return *buffer;
+    }
+
+    static std::string_view prefix(Level level) {
+        switch (level) {
+        case Level::trace:
+            return "[trace] ";
+        case Level::debug:
+            return "[debug] ";
+        case Level::warn:
+            return "[warn] ";
+        case Level::error:
+            return "[error] ";
+        default:
+            return "";
+        }
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            wakeup_.wait(lock, [this]() { return is_pending_.load() || is_stopping_; });
+            bool is_stopping = is_stopping_;
+            lock.unlock();
+
+            drain();
+            if (is_stopping)
+                return;
+
+            lock.lock();
+            wakeup_.wait_for(lock, batch_interval, [this]() { return is_stopping_; });
+        }
+    }
+
+    void drain() {
+        std::lock_guard<std::mutex> drain_lock(drain_mutex_);
+        is_pending_.store(false);
+
+        std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            // buffers of threads that ended are only held here
+            std::erase_if(buffers_, [](auto &buffer) {
+                std::lock_guard<std::mutex> lock(buffer->mutex);
+                return buffer.use_count() == 1 && buffer->lines.empty();
+            });
+            buffers = buffers_;
+        }
+
+        batch_.clear();
+        for (auto &buffer : buffers) {
+            std::lock_guard<std::mutex> lock(buffer->mutex);
+            batch_ += buffer->lines;
+            buffer->lines.clear();
+        }
+
+        int fd = fd_.load(std::memory_order_relaxed);
+        const char *data = batch_.data();
+        size_t size = batch_.size();
+        while (size > 0) {
+            auto n = ::write(fd, data, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            data += n;
+            size -= n;
+        }
+    }
+};
+
+// Format the arguments with operator<< into one line. Below the compiled
+// level a call is removed entirely, below the runtime level it costs a load.
+template <Level level, typename... Args>
+void write(const Args &...args) {
+    if constexpr (level >= compiled_level && level != Level::off) {
+        auto &logger = Logger::instance();
+        if (!logger.is_enabled(level))
+            return;
+
+        thread_local std::ostringstream stream;
+        stream.str({});
+        stream.clear();
+        (stream << ... << args);
+        logger.write(level, stream.view());
+    }
+}
+
+template <typename... Args>
+void trace(const Args &...args) {
+    write<Level::trace>(args...);
+}
+
+template <typename... Args>
+void debug(const Args &...args) {
+    write<Level::debug>(args...);
+}
+
+template <typename... Args>
+void info(const Args &...args) {
+    write<Level::info>(args...);
+}
+
+template <typename... Args>
+void warn(const Args &...args) {
+    write<Level::warn>(args...);
+}
+
+template <typename... Args>
+void error(const Args &...args) {
+    write<Level::error>(args...);
+}
+
+}  // namespace tftp::log
+
+#endif
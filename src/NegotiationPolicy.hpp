@@ -0,0 +1,368 @@
+#ifndef NEGOTIATION_POLICY_HPP
+#define NEGOTIATION_POLICY_HPP
+
+#include <algorithm>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "Clock.hpp"
+#include "TftpPacketBuilder.hpp"
+
+namespace tftp {
+
+// The options of transfers with the peers of one subnet: what requests of
+// ours ask for, and the most requests from there are granted.
+struct OptionPolicy {
+    uint16_t blksize = 1024;
+    uint16_t max_blksize = max_block_size;
+    uint16_t window = default_window_size;
+    // every block of the window is held until acked, don't let a peer ask for thousands
+    uint16_t max_window = default_window_size;
+    // seconds, option "timeout" of RFC 2349
+    unsigned timeout = default_timeout;
+    unsigned max_timeout = 255;
+    // try other block and window sizes now and then, and ask for the best
+    bool learn = false;
+    // share of the bandwidth of each transfer while others wait to send too
+    unsigned weight = 1;
+};
+
+// Picks the options per peer address from a table of subnets, the longest
+// matching prefix wins, peers outside of all of them get the defaults. The
+// table is read from a file with a line per subnet:
+//
+//     # prefix        option value...
+//     default         blksize 1024 window 64
+//     10.0.0.0/8      blksize 8192 window 256 learn on
+//     fd00:1::/32     blksize 1428 max_blksize 1428 timeout 3
+//     192.168.7.0/24  weight 4
+//
+// A subnet that learns measures the throughput of the transfers we start
+// with each block and window size, and mostly asks for the best of them.
+// Every explore_interval-th transfer tries a neighbour of the best instead,
+// twice or half the block or window size, so the choice climbs towards what
+// the path carries best and follows it when the path changes.
+//
+// May be used from any thread, rules are set on the thread of the caller.
+class NegotiationPolicy {
+public:
+    using Address = boost::asio::ip::address;
+    using Clock = tftp::Clock;
+
+    struct Rule {
+        Address network = boost::asio::ip::address_v6();
+        unsigned prefix_length = 0;  // 0 matches every address
+        OptionPolicy options;
+
+        std::string prefix() const {
+            return prefix_length == 0 ? "default" : network.to_string() + "/" + std::to_string(prefix_length);
+        }
+    };
+
+    // the block and window size a transfer ran with
+    struct Setting {
+        uint16_t blksize = block_size;
+        uint16_t window = 1;
+
+        auto operator<=>(const Setting &) const = default;
+    };
+
+    // transfers shorter than this mostly measure the round trip of the request
+    static constexpr size_t min_sample_bytes = 256 << 10;
+    static constexpr size_t explore_interval = 8;
+
+    // throws std::invalid_argument naming the line that is wrong
+    static std::vector<Rule> parse(std::istream &in) {
+        std::vector<Rule> rules;
+        std::string line;
+        for (size_t number = 1; std::getline(in, line); number++) {
+            line = line.substr(0, line.find('#'));
+            std::istringstream fields(line);
+            std::string prefix;
+            if (!(fields >> prefix))
+                continue;
+
+            auto error = [number](const std::string &what) {
+                return std::invalid_argument("line " + std::to_string(number) + ": " + what);
+            };
+            Rule rule;
+            if (!parse_prefix(prefix, rule))
+                throw error("bad prefix " + prefix);
+
+            std::string key, value;
+            std::set<std::string> keys;
+            while (fields >> key) {
+                if (!(fields >> value))
+                    throw error("missing value of " + key);
+                if (!set_option(rule.options, key, value))
+                    throw error("bad option " + key + " " + value);
+                keys.insert(key);
+            }
+
+            // a cap alone lowers the built in default along with it
+            auto &o = rule.options;
+            if (!keys.count("blksize"))
+                o.blksize = std::min(o.blksize, o.max_blksize);
+            if (!keys.count("window"))
+                o.window = std::min(o.window, o.max_window);
+            // and a larger window of our own is granted to the peers as well
+            if (!keys.count("max_window"))
+                o.max_window = std::max(o.max_window, o.window);
+            if (!keys.count("timeout"))
+                o.timeout = std::min(o.timeout, o.max_timeout);
+            if (o.blksize > o.max_blksize || o.window > o.max_window || o.timeout > o.max_timeout)
+                throw error("default beyond its cap");
+            rules.push_back(rule);
+        }
+        return rules;
+    }
+
+    static std::vector<Rule> load(const std::string &path) {
+        std::ifstream in(path);
+        if (!in)
+            throw std::invalid_argument("cannot open " + path);
+        return parse(in);
+    }
+
+    // replace the table, what was learned about subnets still in it is kept
+    void set_rules(std::vector<Rule> rules) {
+        std::stable_sort(rules.begin(), rules.end(),
+                         [](const Rule &a, const Rule &b) { return a.prefix_length > b.prefix_length; });
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        rules_ = std::move(rules);
+        std::erase_if(learned_, [this](auto &entry) {
+            return std::none_of(rules_.begin(), rules_.end(), [&](const Rule &rule) { return rule.prefix() == entry.first; });
+        });
+    }
+
+    std::vector<Rule> rules() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return rules_;
+    }
+
+    OptionPolicy find(const Address &address) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto rule = match(address);
+        return rule ? rule->options : OptionPolicy();
+    }
+
+    // the block and window size a request to the address asks for
+    Setting propose(const Address &address) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto rule = match(address);
+        auto options = rule ? rule->options : OptionPolicy();
+        Setting configured{options.blksize, options.window};
+        if (!options.learn)
+            return configured;
+
+        auto &learned = learned_[rule->prefix()];
+        auto best = learned.best(options).value_or(configured);
+        if (++learned.proposals % explore_interval != 0)
+            return best;
+
+        // the next neighbour of the best that is within the caps
+        for (size_t i = 0; i < 4; i++) {
+            auto candidate = neighbour(best, learned.neighbour++ % 4, options);
+            if (candidate != best)
+                return candidate;
+        }
+        return best;
+    }
+
+    // a transfer we started is done, learn from its throughput
+    void record(const Address &address, const Setting &setting, size_t bytes, Clock::duration elapsed) {
+        if (bytes < min_sample_bytes || elapsed <= Clock::duration::zero())
+            return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto rule = match(address);
+        if (!rule || !rule->options.learn)
+            return;
+
+        double throughput = bytes / std::chrono::duration<double>(elapsed).count();
+        auto &sample = learned_[rule->prefix()].samples[setting];
+        sample.throughput = sample.transfers == 0 ? throughput : (1 - ewma_weight) * sample.throughput + ewma_weight * throughput;
+        sample.transfers++;
+    }
+
+    // the table and what was learned, a line per subnet
+    std::string describe() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream out;
+        auto rules = rules_.empty() ? std::vector<Rule>{Rule()} : rules_;
+        for (auto &rule : rules) {
+            auto &o = rule.options;
+            if (&rule != &rules.front())
+                out << "\n";
+            out << rule.prefix() << " blksize " << o.blksize << " max_blksize " << o.max_blksize << " window "
+                << o.window << " max_window " << o.max_window << " timeout " << o.timeout << " max_timeout "
+                << o.max_timeout << " learn " << (o.learn ? "on" : "off") << " weight " << o.weight;
+            auto it = learned_.find(rule.prefix());
+            if (it != learned_.end()) {
+                for (auto &[setting, sample] : it->second.samples) {
+                    out << "\n    blksize " << setting.blksize << " window " << setting.window << ": "
+                        << (size_t)sample.throughput << " bytes/s over " << sample.transfers << " transfers";
+                }
+            }
+        }
+        return out.str();
+    }
+
+private:
+    static constexpr double ewma_weight = 0.25;
+
+    struct Sample {
+        double throughput = 0;  // bytes/s, moving average
+        size_t transfers = 0;
+    };
+
+    struct Learned {
+        std::map<Setting, Sample> samples;
+        size_t proposals = 0;
+        size_t neighbour = 0;
+
+        // the fastest setting measured that the caps still allow
+        std::optional<Setting> best(const OptionPolicy &options) const {
+            std::optional<Setting> best;
+            double throughput = 0;
+            for (auto &[setting, sample] : samples) {
+                if (setting.blksize <= options.max_blksize && setting.window <= options.max_window &&
+                    sample.throughput > throughput) {
+                    best = setting;
+                    throughput = sample.throughput;
+                }
+            }
+            return best;
+        }
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<Rule> rules_;  // longest prefix first
+    std::map<std::string, Learned> learned_;
+
+    static bool parse_prefix(const std::string &prefix, Rule &rule) {
+        if (prefix == "default")
+            return true;
+        auto slash = prefix.find('/');
+        boost::system::error_code e;
+        rule.network = boost::asio::ip::make_address(prefix.substr(0, slash), e);
+        if (e)
+            return false;
+        unsigned bits = rule.network.is_v4() ? 32 : 128;
+        rule.prefix_length = bits;
+        if (slash != std::string::npos) {
+            try {
+                rule.prefix_length = std::stoul(prefix.substr(slash + 1));
+            } catch (std::logic_error &) {
+                return false;
+            }
+        }
+        return rule.prefix_length <= bits;
+    }
+
+    static bool set_option(OptionPolicy &options, const std::string &key, const std::string &value) {
+        if (key == "learn") {
+            options.learn = value == "on";
+            return value == "on" || value == "off";
+        }
+
+        unsigned long number;
+        try {
+            number = std::stoul(value);
+        } catch (std::logic_error &) {
+            return false;
+        }
+        if (key == "blksize" || key == "max_blksize") {
+            if (number < min_block_size || number > max_block_size)
+                return false;
+            (key == "blksize" ? options.blksize : options.max_blksize) = number;
+        } else if (key == "window" || key == "max_window") {
+            if (number < min_window_size || number > max_window_size)
+                return false;
+            (key == "window" ? options.window : options.max_window) = number;
+        } else if (key == "timeout" || key == "max_timeout") {
+            // RFC 2349 allows 1 to 255 seconds
+            if (number < 1 || number > 255)
+                return false;
+            (key == "timeout" ? options.timeout : options.max_timeout) = number;
+        } else if (key == "weight") {
+            if (number < 1 || number > 1000)
+                return false;
+            options.weight = number;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // peers of an ipv6 socket show ipv4 addresses mapped into ipv6
+    static Address unmapped(const Address &address) {
+        if (address.is_v6() && address.to_v6().is_v4_mapped())
+            return boost::asio::ip::make_address_v4(boost::asio::ip::v4_mapped, address.to_v6());
+        return address;
+    }
+
+    static bool contains(const Rule &rule, const Address &address) {
+        if (rule.prefix_length == 0)
+            return true;
+        if (rule.network.is_v4() != address.is_v4())
+            return false;
+
+        std::vector<uint8_t> network, bytes;
+        if (address.is_v4()) {
+            auto a = rule.network.to_v4().to_bytes(), b = address.to_v4().to_bytes();
+            network.assign(a.begin(), a.end());
+            bytes.assign(b.begin(), b.end());
+        } else {
+            auto a = rule.network.to_v6().to_bytes(), b = address.to_v6().to_bytes();
+            network.assign(a.begin(), a.end());
+            bytes.assign(b.begin(), b.end());
+        }
+        unsigned whole = rule.prefix_length / 8, rest = rule.prefix_length % 8;
+        if (!std::equal(network.begin(), network.begin() + whole, bytes.begin()))
+            return false;
+        uint8_t mask = rest == 0 ? 0 : (uint8_t)(0xff << (8 - rest));
+        return rest == 0 || (network[whole] & mask) == (bytes[whole] & mask);
+    }
+
+    const Rule *match(const Address &address) const {
+        auto peer = unmapped(address);
+        for (auto &rule : rules_) {
+            if (contains(rule, peer))
+                return &rule;
+        }
+        return nullptr;
+    }
+
+    static Setting neighbour(Setting setting, size_t direction, const OptionPolicy &options) {
+        switch (direction) {
+        case 0:
+            setting.blksize = std::min<size_t>(setting.blksize * 2, options.max_blksize);
+            break;
+        case 1:
+            setting.blksize = std::max<size_t>(setting.blksize / 2, min_block_size);
+            break;
+        case 2:
+            setting.window = std::min<size_t>(setting.window * 2, options.max_window);
+            break;
+        default:
+            setting.window = std::max<size_t>(setting.window / 2, min_window_size);
+            break;
+        }
+        return setting;
+    }
+};
+
+}  // namespace tftp
+
+#endif
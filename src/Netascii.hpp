@@ -0,0 +1,154 @@
+#ifndef NETASCII_HPP
+#define NETASCII_HPP
+
+#include <cstdint>
+#include <cstring>
+
+#include "TftpPacketBuilder.hpp"
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define TFTP_NETASCII_HAS_SIMD 1
+#endif
+
+namespace tftp {
+
+// Position of the first CR or LF in [data, data + size), size if there is none.
+// Text is mostly long runs without line ends, so scan 32 or 16 bytes at once.
+class NewlineScanner {
+public:
+    static size_t find(const uint8_t *data, size_t size) {
+#ifdef TFTP_NETASCII_HAS_SIMD
+        static const bool has_avx2 = __builtin_cpu_supports("avx2");
+        if (has_avx2)
+            return find_avx2(data, size);
+        return find_sse2(data, size);
+#else
+        return find_sw(data, size, 0);
+#endif
+    }
+
+    // the ways find scans, the plain loop goes on from pos
+    static size_t find_sw(const uint8_t *data, size_t size, size_t pos) {
+        while (pos < size && data[pos] != '\r' && data[pos] != '\n')
+            pos++;
+        return pos;
+    }
+
+#ifdef TFTP_NETASCII_HAS_SIMD
+    static size_t find_sse2(const uint8_t *data, size_t size) {
+        const __m128i cr = _mm_set1_epi8('\r');
+        const __m128i lf = _mm_set1_epi8('\n');
+        size_t pos = 0;
+        for (; pos + 16 <= size; pos += 16) {
+            __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+            int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, cr), _mm_cmpeq_epi8(chunk, lf)));
+            if (mask)
+                return pos + __builtin_ctz(mask);
+        }
+        return find_sw(data, size, pos);
+    }
+
+    __attribute__((target("avx2"))) static size_t find_avx2(const uint8_t *data, size_t size) {
+        const __m256i cr = _mm256_set1_epi8('\r');
+        const __m256i lf = _mm256_set1_epi8('\n');
+        size_t pos = 0;
+        for (; pos + 32 <= size; pos += 32) {
+            __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + pos));
+            unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, cr), _mm256_cmpeq_epi8(chunk, lf)));
+            if (mask)
+                return pos + __builtin_ctz(mask);
+        }
+        return find_sw(data, size, pos);
+    }
+#endif
+};
+
+// Local text to netascii (RFC 764): LF becomes CR LF, a bare CR becomes
+// CR NUL. Every byte translates on its own, so chunks of any size can be
+// encoded one after another.
+class NetasciiEncoder {
+public:
+    void encode(const uint8_t *data, size_t size, Buffer &out) {
+        // worst case every byte doubles
+        size_t length = out.size();
+        out.resize(length + 2 * size);
+        uint8_t *dst = out.data() + length;
+
+        while (size > 0) {
+            size_t run = NewlineScanner::find(data, size);
+            std::memcpy(dst, data, run);
+            dst += run;
+            if (run == size)
+                break;
+
+            *dst++ = '\r';
+            *dst++ = data[run] == '\n' ? '\n' : '\0';
+            data += run + 1;
+            size -= run + 1;
+        }
+        out.resize(dst - out.data());
+    }
+};
+
+// Netascii back to local text: CR LF becomes LF, CR NUL becomes CR. A CR may
+// end one block and its partner start the next, so that CR is held back.
+class NetasciiDecoder {
+public:
+    void decode(const uint8_t *data, size_t size, Buffer &out) {
+        size_t length = out.size();
+        out.resize(length + size + 1);
+        uint8_t *dst = out.data() + length;
+        const uint8_t *end = data + size;
+
+        if (pending_cr_ && data < end) {
+            pending_cr_ = false;
+            dst = translate(data, dst);
+        }
+
+        while (data < end) {
+            auto cr = static_cast<const uint8_t *>(std::memchr(data, '\r', end - data));
+            size_t run = (cr ? cr : end) - data;
+            std::memcpy(dst, data, run);
+            dst += run;
+            data += run;
+            if (!cr)
+                break;
+
+            if (++data == end) {
+                pending_cr_ = true;
+                break;
+            }
+            dst = translate(data, dst);
+        }
+        out.resize(dst - out.data());
+    }
+
+    // the transfer ended, a dangling CR is kept as it is
+    void finish(Buffer &out) {
+        if (pending_cr_)
+            out.push_back('\r');
+        pending_cr_ = false;
+    }
+
+private:
+    bool pending_cr_ = false;
+
+    // data points behind a CR, malformed pairs keep the CR and the byte after it
+    static uint8_t *translate(const uint8_t *&data, uint8_t *dst) {
+        if (*data == '\n') {
+            *dst++ = '\n';
+            data++;
+        } else if (*data == '\0') {
+            *dst++ = '\r';
+            data++;
+        } else {
+            *dst++ = '\r';
+        }
+        return dst;
+    }
+};
+
+}  // namespace tftp
+
+#endif
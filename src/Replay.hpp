@@ -0,0 +1,257 @@
+#ifndef REPLAY_HPP
+#define REPLAY_HPP
+
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <deque>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "Capture.hpp"
+#include "Clock.hpp"
+#include "Crc32c.hpp"
+#include "TftpParser.hpp"
+#include "TftpPeer.hpp"
+
+namespace tftp {
+
+// What a peer sent during a replay, the same capture must give the same.
+struct ReplayOutput {
+    size_t datagrams = 0;
+    size_t bytes = 0;
+    Crc32c fingerprint;  // of every datagram sent and where to, in order
+};
+
+// Stands in for a socket while a capture is replayed: the datagrams come from
+// the capture, those sent go nowhere but into the output.
+class ReplayTransport : public DatagramTransport {
+public:
+    ReplayTransport(boost::asio::io_context &io_context, udp::endpoint local, ReplayOutput &output)
+        : io_context_(io_context), local_(local), output_(output) {}
+
+    // the record must stay valid until the peer received it
+    void deliver(const CaptureRecord &record) {
+        queue_.push_back(&record);
+        complete();
+    }
+
+    udp::endpoint local_endpoint() const override {
+        return local_;
+    }
+
+    void async_receive(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, Handler handler) override {
+        pending_.emplace(Pending{buffer, &endpoint, std::move(handler)});
+        complete();
+    }
+
+    void async_send(boost::asio::const_buffer buffer, const udp::endpoint &endpoint, Handler handler) override {
+        auto address = endpoint.address().to_v6().to_bytes();
+        uint8_t port[2] = {(uint8_t)(endpoint.port() >> 8), (uint8_t)endpoint.port()};
+        output_.fingerprint.update(address.data(), address.size());
+        output_.fingerprint.update(port, sizeof(port));
+        output_.fingerprint.update((const uint8_t *)buffer.data(), buffer.size());
+        output_.datagrams++;
+        output_.bytes += buffer.size();
+        boost::asio::post(io_context_, [handler = std::move(handler), size = buffer.size()]() { handler({}, size); });
+    }
+
+private:
+    struct Pending {
+        boost::asio::mutable_buffer buffer;
+        udp::endpoint *endpoint;
+        Handler handler;
+    };
+
+    boost::asio::io_context &io_context_;
+    udp::endpoint local_;
+    ReplayOutput &output_;
+    std::deque<const CaptureRecord *> queue_;
+    std::optional<Pending> pending_;
+
+    void complete() {
+        if (!pending_ || queue_.empty())
+            return;
+        auto record = queue_.front();
+        queue_.pop_front();
+        auto pending = std::move(*pending_);
+        pending_.reset();
+
+        size_t size = std::min(record->datagram.size(), pending.buffer.size());
+        std::memcpy(pending.buffer.data(), record->datagram.data(), size);
+        *pending.endpoint = record->endpoint;
+        boost::asio::post(io_context_, [handler = std::move(pending.handler), size]() { handler({}, size); });
+    }
+};
+
+struct ReplayResult {
+    size_t received = 0;  // datagrams of the capture
+    size_t sent = 0;
+    size_t sent_bytes = 0;
+    std::string fingerprint;  // crc32c of the datagrams sent, see ReplayOutput
+
+    // the virtual time the replay covered, and the cpu time it really took
+    Clock::duration elapsed{};
+    std::chrono::nanoseconds cpu_time{};
+
+    std::chrono::nanoseconds cpu_time_per_datagram() const {
+        return received == 0 ? std::chrono::nanoseconds::zero() : cpu_time / (int64_t)received;
+    }
+};
+
+// A new directory under the temporary directory, removed along with
+// everything in it when it goes out of scope.
+class ScratchDirectory {
+public:
+    ScratchDirectory() {
+        auto pattern = (std::filesystem::temp_directory_path() / "tftp-replay-XXXXXX").string();
+        if (!::mkdtemp(pattern.data()))
+            throw std::invalid_argument("no scratch directory in " + std::filesystem::temp_directory_path().string());
+        path_ = pattern;
+    }
+
+    ScratchDirectory(const ScratchDirectory &) = delete;
+    ScratchDirectory &operator=(const ScratchDirectory &) = delete;
+
+    ~ScratchDirectory() {
+        std::error_code e;
+        std::filesystem::remove_all(path_, e);
+    }
+
+    const std::string &path() const {
+        return path_;
+    }
+
+private:
+    std::string path_;
+};
+
+// Copy the files the requests of a capture name from the directory from to
+// the directory to, those that exist. Written files are copied too, a
+// transfer with option "delta" starts from the old file.
+inline void copy_requested_files(const std::vector<CaptureRecord> &records, const std::string &from, const std::string &to) {
+    for (auto &record : records) {
+        if (record.transport != CaptureRecord::Transport::requests)
+            continue;
+
+        std::string filename;
+        try {
+            Buffer datagram = record.datagram;
+            Parser parser(datagram);
+            if (parser.is_rrq())
+                filename = parser.parser_rrq().filename();
+            else if (parser.is_wrq())
+                filename = parser.parser_wrq().filename();
+        } catch (std::invalid_argument &) {
+            continue;
+        }
+
+        // the same names the peer accepts with a root, see TftpPeer::set_root
+        auto name = std::filesystem::path(filename).relative_path().lexically_normal();
+        if (name.empty() || *name.begin() == "..")
+            continue;
+        auto source = std::filesystem::path(from) / name;
+        auto target = std::filesystem::path(to) / name;
+        std::error_code e;
+        if (!std::filesystem::is_regular_file(source, e) || std::filesystem::exists(target, e))
+            continue;
+        std::filesystem::create_directories(target.parent_path(), e);
+        std::filesystem::copy_file(source, target, e);
+    }
+}
+
+// Feed a capture to a peer of its own, on a VirtualClock and without a
+// network. Each datagram arrives at the virtual time it was captured, the
+// timers of the peer in between fire at their deadlines, so retransmissions
+// and timeouts happen as if the time had really passed, however fast the
+// replay runs. After the last datagram the clock moves on until every
+// session is over, or for linger at most.
+//
+// The peer runs in a ScratchDirectory, the files the requests of the capture
+// name are copied there from the directory files first. What it receives is
+// stored there and dropped with it, files is never written. Work the peer
+// hands to its worker threads is waited for before the next datagram, as if
+// it took no time. Option "local" isn't offered. Replies to transfers the
+// capturing peer started itself are fed to the peer too, but find no session
+// waiting for them.
+//
+// Given the same capture and files, the peer sends the same datagrams, so
+// the fingerprint of a replay tells a change of behaviour, and the cpu time
+// per datagram is the cost of the handlers without the kernel.
+inline ReplayResult replay(const std::vector<CaptureRecord> &records, const std::string &files,
+                           Clock::duration linger = std::chrono::seconds(60)) {
+    ScratchDirectory root;
+    copy_requested_files(records, files, root.path());
+
+    VirtualClock clock;
+    auto started = clock.now();
+
+    boost::asio::io_context io_context;
+    auto work = boost::asio::make_work_guard(io_context);
+    ReplayOutput output;
+    auto transport_cmd = std::make_unique<ReplayTransport>(io_context, udp::endpoint(udp::v6(), default_port), output);
+    auto transport_data = std::make_unique<ReplayTransport>(io_context, udp::endpoint(udp::v6(), 0), output);
+    auto cmd = transport_cmd.get();
+    auto data = transport_data.get();
+    auto peer = std::make_unique<TftpPeer>(io_context, std::move(transport_cmd), std::move(transport_data));
+    peer->set_root(root.path());
+    // the readers of the capture are gone, and the oack would carry our pid
+    peer->set_local_copies(false);
+    auto &wheel = boost::asio::use_service<TimingWheel>(io_context);
+
+    // run what is ready, and wait for the workers, the virtual time stands still
+    auto settle = [&]() {
+        io_context.poll();
+        while (peer->pending_work() > 0) {
+            io_context.run_one();
+            io_context.poll();
+        }
+    };
+    settle();
+
+    // the timers due until then fire each at its own deadline
+    auto advance = [&](Clock::time_point until) {
+        while (wheel.next_wakeup() <= until) {
+            clock.set(wheel.next_wakeup());
+            wheel.poll();
+            settle();
+        }
+        clock.set(until);
+        settle();
+    };
+
+    timespec cpu_started, cpu_stopped;
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_started);
+    for (auto &record : records) {
+        advance(started + record.time);
+        (record.transport == CaptureRecord::Transport::requests ? cmd : data)->deliver(record);
+        settle();
+    }
+    auto end = clock.now() + linger;
+    while (wheel.size() > 0 && wheel.next_wakeup() <= end)
+        advance(wheel.next_wakeup());
+    ::clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_stopped);
+
+    ReplayResult result;
+    result.received = records.size();
+    result.sent = output.datagrams;
+    result.sent_bytes = output.bytes;
+    result.fingerprint = output.fingerprint.hex_digest();
+    result.elapsed = clock.now() - started;
+    result.cpu_time = std::chrono::seconds(cpu_stopped.tv_sec - cpu_started.tv_sec) +
+                      std::chrono::nanoseconds(cpu_stopped.tv_nsec - cpu_started.tv_nsec);
+
+    // the peer goes first, its coroutines are cleaned up along with the io_context
+    peer.reset();
+    return result;
+}
+
+}  // namespace tftp
+
+#endif
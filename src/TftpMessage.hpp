@@ -56,12 +56,21 @@ private:
 
 class DataMessage {
 public:
-    static Buffer serialize(const uint16_t block, std::vector<uint8_t> data) {
+    static Buffer serialize(const uint16_t block, const std::vector<uint8_t> &data) {
         PacketBuilder builder;
         builder << opcode_data << block << data;
         return builder.get_packet();
     }
 
+    // fill in the first data_header_size bytes of a datagram whose data was
+    // read in behind them, so the data isn't copied once more
+    static void serialize_header(const uint16_t block, Buffer &datagram) {
+        datagram[0] = opcode_data >> 8;
+        datagram[1] = opcode_data & 0xff;
+        datagram[2] = block >> 8;
+        datagram[3] = block & 0xff;
+    }
+
     const uint16_t block() const { return block_; }
     const std::vector<uint8_t> &data() const { return data_; }
 
@@ -139,5 +148,28 @@ private:
     Options options_;
 };
 
+// The crc32c of blocks the receiver has from before, for option "delta":
+//
+//     opcode 7 | u32 index of the first block | u32 hash... (big endian)
+class HashMessage {
+public:
+    static Buffer serialize(uint32_t first, const uint32_t *hashes, size_t count) {
+        PacketBuilder builder;
+        builder << opcode_hash << (uint16_t)(first >> 16) << (uint16_t)first;
+        for (size_t i = 0; i < count; i++)
+            builder << (uint16_t)(hashes[i] >> 16) << (uint16_t)hashes[i];
+        return builder.get_packet();
+    }
+
+    uint32_t first() const { return first_; }
+    const std::vector<uint32_t> &hashes() const { return hashes_; }
+
+private:
+    friend class Parser;
+
+    uint32_t first_;
+    std::vector<uint32_t> hashes_;
+};
+
 }  // namespace tftp
 #endif
\ No newline at end of file
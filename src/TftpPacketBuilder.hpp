@@ -13,12 +13,44 @@ static const size_t block_size = 512;
 static const size_t max_block_size = 65464;
 static const size_t min_block_size = 8;
 
+static const uint16_t default_window_size = 64;
+static const uint16_t min_window_size = 1;
+// an ack carries a 16 bit block number, the window must stay well below half
+// of that range so an ack is never mistaken for one of a block long gone
+static const uint16_t max_window_size = 16384;
+
+static const size_t max_retransmit = 8;
+static const unsigned int default_timeout = 1;  // seconds
+
+static const char *const checksum_crc32c = "crc32c";
+
+// opcode and block number in front of the data of a DATA packet
+static const size_t data_header_size = 4;
+
+// with option "delta" every data block starts with its index in the file, the
+// blocks the receiver has already are left out
+static const size_t delta_index_size = 4;
+
+// the file data in a block of option "delta", the index and the data together
+// fill a block, the datagrams are no larger than without the option
+inline size_t delta_data_size(size_t block_size) {
+    return block_size - delta_index_size;
+}
+
+// a striped transfer splits a file into stripes of at least this size, sent at
+// once over at most max_streams sessions, the default per source limit of the
+// admission control
+static const size_t min_stripe_size = 1 << 20;
+static const size_t max_streams = 16;
+
 static const uint16_t opcode_rrq = 1;
 static const uint16_t opcode_wrq = 2;
 static const uint16_t opcode_data = 3;
 static const uint16_t opcode_ack = 4;
 static const uint16_t opcode_error = 5;
 static const uint16_t opcode_oack = 6;
+// not in any RFC, the block hashes of option "delta"
+static const uint16_t opcode_hash = 7;
 
 enum class Mode { netascii,
                   octet,
@@ -103,6 +103,7 @@ public:
     bool is_ack() { return opcode_ == opcode_ack; }
     bool is_error() { return opcode_ == opcode_error; }
     bool is_oack() { return opcode_ == opcode_oack; }
+    bool is_hash() { return opcode_ == opcode_hash; }
 
     ReadRequest parser_rrq() {
         if (!is_rrq())
@@ -196,6 +197,24 @@ public:
         }
         return oack; 
     }
+
+    HashMessage parser_hash() {
+        if (!is_hash())
+            throw std::invalid_argument("invalid packet format");
+
+        HashMessage message;
+        uint16_t high, low;
+        std::vector<uint8_t> hashes;
+        if (!((*this) >> high >> low >> hashes) || hashes.size() % 4 != 0)
+            throw std::invalid_argument("invalid packet format");
+
+        message.first_ = ((uint32_t)high << 16) | low;
+        for (size_t i = 0; i < hashes.size(); i += 4) {
+            message.hashes_.push_back(((uint32_t)hashes[i] << 24) | ((uint32_t)hashes[i + 1] << 16) |
+                                      ((uint32_t)hashes[i + 2] << 8) | hashes[i + 3]);
+        }
+        return message;
+    }
 };
 
 } // namespace tftp
@@ -1,466 +1,1723 @@
 #ifndef TFTP_PEER_HPP
 #define TFTP_PEER_HPP
 
+#include <utility>
+
 #include <algorithm>
+#include <cstdio>
 #include <boost/array.hpp>
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
+#include <deque>
 #include <filesystem>
 #include <fstream>
-
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <variant>
+
+#include "AdmissionControl.hpp"
+#include "BandwidthScheduler.hpp"
+#include "ByteRange.hpp"
+#include "Channel.hpp"
+#include "Clock.hpp"
+#include "DatagramTransport.hpp"
+#include "FileIndex.hpp"
+#include "LocalFile.hpp"
+#include "Log.hpp"
+#include "NegotiationPolicy.hpp"
 #include "TftpMessage.hpp"
 #include "TftpParser.hpp"
 #include "TftpTransaction.hpp"
+#include "TransferResult.hpp"
 
+using boost::asio::awaitable;
 using boost::asio::io_context;
+using boost::asio::use_awaitable;
 using boost::asio::ip::udp;
 
-void dump(const tftp::Buffer &buffer) {
-    std::cout << "size: " << buffer.size() << std::endl;
-
-    std::cout << "data: ";
-    for (auto &c : buffer) {
-        if (isprint(c))
-            std::cout << c;
-        else
-            std::cout << '.';
-    }
-    std::cout << std::endl;
-
-    std::cout << std::hex;
-    std::cout << "hex: ";
+// a malformed packet, printable bytes and hex
+inline void dump(const tftp::Buffer &buffer) {
+    std::string text, hex;
+    char digits[4];
     for (auto &c : buffer) {
-        std::cout << (int)c << ' ';
+        text += isprint(c) ? (char)c : '.';
+        std::snprintf(digits, sizeof(digits), "%x ", c);
+        hex += digits;
     }
-    std::cout << std::endl;
-    std::cout << std::dec;
-};
+    tftp::log::debug("size: ", buffer.size());
+    tftp::log::debug("data: ", text);
+    tftp::log::debug("hex: ", hex);
+}
 
 class TftpPeer {
 public:
     TftpPeer(io_context &io_context, unsigned short port)
+        : TftpPeer(io_context,
+                   std::make_unique<tftp::UdpTransport>(io_context, udp::endpoint(udp::v6(), port)),
+                   std::make_unique<tftp::UdpTransport>(io_context, udp::endpoint(udp::v6(), 0))) {}
+
+    // requests arrive on the cmd transport, everything else uses the data transport
+    TftpPeer(io_context &io_context, std::unique_ptr<tftp::DatagramTransport> transport_cmd,
+             std::unique_ptr<tftp::DatagramTransport> transport_data)
         : io_context_(io_context),
-          socket_cmd_(io_context, udp::v6()),
-          socket_data_(io_context, udp::v6()) {
-        socket_cmd_.bind(udp::endpoint(udp::v6(), port));
-        socket_data_.bind(udp::endpoint(udp::v6(), 0));
-        std::cout << "socket cmd bind to " << socket_cmd_.local_endpoint() << std::endl;
-        std::cout << "socket data bind to " << socket_data_.local_endpoint() << std::endl;
+          scheduler_(io_context),
+          file_index_(io_context),
+          transport_cmd_(std::move(transport_cmd)),
+          transport_data_(std::move(transport_data)) {
+        tftp::log::info("socket cmd bind to ", transport_cmd_->local_endpoint());
+        tftp::log::info("socket data bind to ", transport_data_->local_endpoint());
+
+        boost::asio::co_spawn(io_context_, receive_request_loop(), boost::asio::detached);
+        boost::asio::co_spawn(io_context_, receive_data_loop(), boost::asio::detached);
+    }
 
-        start_receive_request();
-        start_receive_data();
+    // A session still running waits in its channel, which holds the coroutine
+    // that holds the session. Dropping the waiters hands the coroutines to the
+    // io_context, they are destroyed with it.
+    ~TftpPeer() {
+        for (auto map : {&send_session_map_, &recv_session_map_})
+            for (auto &[endpoint, session] : *map)
+                session->channel.cancel();
+        for (auto map : {&pre_send_session_map_, &pre_recv_session_map_})
+            for (auto &[address, session] : *map)
+                session->channel.cancel();
     }
 
-    void start_write_transaction(std::string filename, udp::endpoint endpoint) {
-        std::cout << "send write request " << filename << " " << endpoint << std::endl;
+    udp::endpoint local_endpoint() const {
+        return transport_cmd_->local_endpoint();
+    }
 
-        // set options
-        tftp::WriteRequest::Options request_options;
-        auto size = std::to_string(std::filesystem::file_size(filename));
-        request_options["tsize"] = size;
-        request_options["blksize"] = "1024";
+    // Send a local file to the peer, stored there as remote_name. May be called
+    // from any thread, the token decides how the tftp::TransferResult is
+    // delivered: a callback, boost::asio::use_future, use_awaitable...
+    template <typename CompletionToken>
+    auto async_write_file(std::string local_path, std::string remote_name, udp::endpoint endpoint, CompletionToken &&token) {
+        return async_write_file(std::move(local_path), std::move(remote_name), endpoint, tftp::default_mode,
+                                std::forward<CompletionToken>(token));
+    }
 
-        // registe a send transaction
-        auto trans = new tftp::SendTransaction(filename);
-        pre_send_trans_map_[endpoint.address()] = trans;
-        pre_send_options_map_[endpoint.address()] = request_options;
+    // mode netascii translates line ends of text files on the fly
+    template <typename CompletionToken>
+    auto async_write_file(std::string local_path, std::string remote_name, udp::endpoint endpoint, tftp::Mode mode,
+                          CompletionToken &&token) {
+        return async_write(tftp::FileSource::open(local_path), std::move(remote_name), endpoint, mode,
+                           std::forward<CompletionToken>(token));
+    }
 
-        // send write request
-        auto packet = tftp::WriteRequest::serialize("re_" + filename, tftp::default_mode, request_options);
-        socket_data_.send_to(boost::asio::buffer(packet), endpoint);
+    // Send whatever the source delivers, e.g. a pipe or a generator. Without
+    // a known size no "tsize" is announced, the data is streamed through.
+    template <typename CompletionToken>
+    auto async_write(std::unique_ptr<tftp::DataSource> source, std::string remote_name, udp::endpoint endpoint,
+                     tftp::Mode mode, CompletionToken &&token) {
+        return boost::asio::async_initiate<CompletionToken, void(tftp::TransferResult)>(
+            [this, mode](auto handler, std::unique_ptr<tftp::DataSource> source, std::string remote_name,
+                         udp::endpoint endpoint) {
+                auto complete = make_completion(std::move(handler));
+                boost::asio::post(io_context_, [this, complete, source = std::move(source), remote_name, endpoint, mode]() mutable {
+                    begin_write(complete, std::move(source), remote_name, endpoint, mode, "");
+                });
+            },
+            token, std::move(source), std::move(remote_name), endpoint);
     }
 
-    void start_read_transaction(std::string filename, udp::endpoint endpoint) {
-        std::cout << "send read request " << filename << " " << endpoint << std::endl;
+    // Fetch remote_name from the peer into a local file.
+    template <typename CompletionToken>
+    auto async_read_file(std::string remote_name, std::string local_path, udp::endpoint endpoint, CompletionToken &&token) {
+        return async_read_file(std::move(remote_name), std::move(local_path), endpoint, tftp::default_mode,
+                               std::forward<CompletionToken>(token));
+    }
 
-        // set options
-        tftp::ReadRequest::Options request_options;
-        request_options["tsize"] = "";
-        request_options["blksize"] = "1024";
+    template <typename CompletionToken>
+    auto async_read_file(std::string remote_name, std::string local_path, udp::endpoint endpoint, tftp::Mode mode,
+                         CompletionToken &&token) {
+        // an earlier copy of the file is updated, only the blocks that changed are sent
+        auto sink = mode == tftp::Mode::octet ? tftp::FileSink::open_update(local_path, durability())
+                                              : tftp::FileSink::open(local_path, durability());
+        return async_read(remote_name, std::move(sink), endpoint, mode, std::forward<CompletionToken>(token));
+    }
 
-        // registe a recv transaction
-        auto trans = new tftp::RecvTransaction("re_" + filename);
-        pre_recv_trans_map_[endpoint.address()] = trans;
-        pre_recv_options_map_[endpoint.address()] = request_options;
+    // Fetch remote_name into any sink, e.g. memory or standard output.
+    template <typename CompletionToken>
+    auto async_read(std::string remote_name, std::unique_ptr<tftp::DataSink> sink, udp::endpoint endpoint,
+                    tftp::Mode mode, CompletionToken &&token) {
+        return boost::asio::async_initiate<CompletionToken, void(tftp::TransferResult)>(
+            [this, mode](auto handler, std::string remote_name, std::unique_ptr<tftp::DataSink> sink,
+                         udp::endpoint endpoint) {
+                auto complete = make_completion(std::move(handler));
+                boost::asio::post(io_context_, [this, complete, remote_name, sink = std::move(sink), endpoint, mode]() mutable {
+                    begin_read(complete, remote_name, std::move(sink), endpoint, mode, "");
+                });
+            },
+            token, std::move(remote_name), std::move(sink), endpoint);
+    }
+
+    // Send a local file over up to streams sessions at once, each carrying one
+    // byte range of it, which the peer writes into place. Each session has a
+    // window and congestion control of its own, so a single file gets the
+    // throughput of several transfers. The file is written in place on the
+    // peer, an interrupted transfer leaves it incomplete. Stripes are at least
+    // tftp::min_stripe_size, a small file goes in fewer streams.
+    template <typename CompletionToken>
+    auto async_write_file_striped(std::string local_path, std::string remote_name, udp::endpoint endpoint,
+                                  size_t streams, CompletionToken &&token) {
+        return boost::asio::async_initiate<CompletionToken, void(tftp::TransferResult)>(
+            [this, streams](auto handler, std::string local_path, std::string remote_name, udp::endpoint endpoint) {
+                auto complete = make_completion(std::move(handler));
+                boost::asio::post(io_context_, [this, complete, local_path, remote_name, endpoint, streams]() {
+                    auto file = tftp::FileHandle::open(local_path);
+                    struct stat st;
+                    if (!file || ::fstat(file->fd(), &st) != 0)
+                        return fail(complete, "cannot open data source");
+
+                    size_t size = st.st_size;
+                    size_t count = std::clamp<size_t>(std::min(streams, size / tftp::min_stripe_size), 1, tftp::max_streams);
+                    auto striped = std::make_shared<Striped>(complete, count);
+                    for (size_t i = 0; i < count; i++) {
+                        auto range = tftp::ByteRange::stripe(i, count, size);
+                        begin_write(stripe_completion(striped), std::make_unique<tftp::FileSource>(file, range.length, range.offset),
+                                    remote_name, endpoint, tftp::Mode::octet, range.to_string());
+                    }
+                });
+            },
+            token, std::move(local_path), std::move(remote_name), endpoint);
+    }
+
+    // Fetch remote_name over up to streams sessions at once, the peer splits
+    // it into as many byte ranges, which are written into place in one local
+    // file sized up front. See async_write_file_striped.
+    template <typename CompletionToken>
+    auto async_read_file_striped(std::string remote_name, std::string local_path, udp::endpoint endpoint,
+                                 size_t streams, CompletionToken &&token) {
+        return boost::asio::async_initiate<CompletionToken, void(tftp::TransferResult)>(
+            [this, streams](auto handler, std::string remote_name, std::string local_path, udp::endpoint endpoint) {
+                auto complete = make_completion(std::move(handler));
+                boost::asio::post(io_context_, [this, complete, remote_name, local_path, endpoint, streams]() {
+                    size_t count = std::clamp<size_t>(streams, 1, tftp::max_streams);
+                    auto striped = std::make_shared<Striped>(complete, count);
+                    for (size_t i = 0; i < count; i++) {
+                        begin_read(stripe_completion(striped), remote_name, tftp::FileSink::open_stripe(local_path, durability()),
+                                   endpoint, tftp::Mode::octet, tftp::ByteRange::stripe_request(i, count));
+                    }
+                });
+            },
+            token, std::move(remote_name), std::move(local_path), endpoint);
+    }
+
+    // netascii can't be split into byte ranges, it always goes in one stream
+    void start_write_transaction(std::string filename, udp::endpoint endpoint, tftp::Mode mode = tftp::default_mode,
+                                 size_t streams = 1) {
+        tftp::log::info("send write request ", filename, " ", endpoint);
+        auto print = [filename](tftp::TransferResult result) { print_result(filename, result); };
+        if (streams > 1 && mode == tftp::Mode::octet)
+            async_write_file_striped(filename, "re_" + filename, endpoint, streams, print);
+        else
+            async_write_file(filename, "re_" + filename, endpoint, mode, print);
+    }
+
+    // the file is stored as local_path, "re_" and its name by default, "-" is
+    // standard output
+    void start_read_transaction(std::string filename, udp::endpoint endpoint, tftp::Mode mode = tftp::default_mode,
+                                size_t streams = 1, std::string local_path = "") {
+        tftp::log::info("send read request ", filename, " ", endpoint);
+        auto print = [filename](tftp::TransferResult result) { print_result(filename, result); };
+        if (local_path.empty())
+            local_path = "re_" + filename;
+        if (local_path == "-")
+            async_read(filename, tftp::PipeSink::standard_output(), endpoint, mode, print);
+        else if (streams > 1 && mode == tftp::Mode::octet)
+            async_read_file_striped(filename, local_path, endpoint, streams, print);
+        else
+            async_read_file(filename, local_path, endpoint, mode, print);
+    }
+
+    // limit the aggregate send rate of all transactions, bytes/s, 0 for unlimited
+    void set_global_rate(double rate) {
+        boost::asio::post(io_context_, [this, rate]() { scheduler_.set_global_rate(rate); });
+    }
+
+    // limit the send rate of each transaction, bytes/s, 0 for unlimited
+    void set_session_rate(double rate) {
+        boost::asio::post(io_context_, [this, rate]() { scheduler_.set_session_rate(rate); });
+    }
 
-        // send read request
-        auto packet = tftp::ReadRequest::serialize(filename);
-        socket_data_.send_to(boost::asio::buffer(packet), endpoint);
+    // how received files reach the disk, for transfers started afterwards
+    void set_durability(const tftp::Durability &durability) {
+        std::lock_guard<std::mutex> lock(durability_mutex_);
+        durability_ = durability;
+    }
+
+    tftp::Durability durability() const {
+        std::lock_guard<std::mutex> lock(durability_mutex_);
+        return durability_;
+    }
+
+    // how many requests from the network may be served at once, see tftp::AdmissionControl
+    void set_admission_limits(const tftp::AdmissionControl::Limits &limits) {
+        boost::asio::post(io_context_, [this, limits]() { admission_.set_limits(limits); });
+    }
+
+    // the options negotiated with each subnet, see tftp::NegotiationPolicy.
+    // Transfers already running keep theirs.
+    void set_negotiation_policy(std::vector<tftp::NegotiationPolicy::Rule> rules) {
+        policy_->set_rules(std::move(rules));
+    }
+
+    std::string describe_negotiation_policy() const {
+        return policy_->describe();
+    }
+
+    // Opens the data socket of a stream of a striped transfer, on the thread
+    // of the io_context, e.g. with the impairment and socket options of the
+    // shared one. A plain udp socket by default. Set it before the first
+    // striped transfer.
+    void set_stream_transport(std::function<std::unique_ptr<tftp::DatagramTransport>()> open) {
+        open_stream_transport_ = std::move(open);
+    }
+
+    // The directory the files named by requests from the network are read
+    // from and written to, the working directory by default. With a root a
+    // name can't reach out of it. Set it before the first request.
+    void set_root(std::string root) {
+        root_ = std::move(root);
+    }
+
+    // whether readers on the same host are offered option "local", on by default
+    void set_local_copies(bool enabled) {
+        is_local_enabled_ = enabled;
+    }
+
+    // work handed to the worker threads that the io_context hasn't got back yet
+    size_t pending_work() const {
+        return pending_work_;
     }
 
 private:
+    using Clock = tftp::Clock;
+
+    // a parsed packet on its way from the data socket to a transaction
+    struct Message {
+        udp::endpoint endpoint;
+        std::variant<tftp::DataMessage, tftp::AckMessage, tftp::OptionAckMessage, tftp::ErrorResponse,
+                     tftp::HashMessage> packet;
+    };
+
+    struct StreamSocket;
+
+    // every transaction runs as one coroutine that awaits its packets and
+    // timeouts on the channel, nothing else touches the transaction
+    struct Session {
+        explicit Session(io_context &io_context)
+            : channel(io_context) {}
+
+        tftp::Channel<Message> channel;
+        udp::endpoint endpoint;
+
+        std::unique_ptr<tftp::SendTransaction> send;
+        std::unique_ptr<tftp::RecvTransaction> recv;
+
+        // retransmission deadline of the sender, max while no block is outstanding
+        Clock::time_point deadline = Clock::time_point::max();
+
+        // finished and only waiting for retransmissions, a new request may replace it
+        bool is_dallying = false;
+        bool is_closed = false;
+        bool is_reported = false;
+        // started by a request from the network, holds a slot of the admission control
+        bool is_admitted = false;
+        // started by a request of ours, the next one queued for the peer waits for it
+        bool is_requested = false;
+
+        // a stream of a striped transfer of ours has a data socket of its
+        // own, nullptr on the shared one
+        StreamSocket *stream = nullptr;
+
+        // option "range" of a stripe: requested or announced by the client,
+        // announced by the server of a read request. Empty for a whole file.
+        std::string range;
+
+        // waiting for a request to be answered, or for the next block
+        Clock::duration timeout = std::chrono::seconds(tftp::default_timeout);
+
+        // granted to a request of ours, the policy learns how fast it was
+        std::optional<tftp::NegotiationPolicy::Setting> setting;
+
+        // outcome reported to the caller of the async api when the session closes
+        Clock::time_point started = Clock::now();
+        tftp::TransferResult result;
+        std::function<void(tftp::TransferResult)> complete;
+    };
+    using SessionPtr = std::shared_ptr<Session>;
+
+    // Sessions between two peers are told apart by their ports, so each
+    // stream of a striped transfer of ours sends and receives on a socket of
+    // its own, which only carries that session. Otherwise it is a session
+    // like any other, paced by the same scheduler. Kept for the next stream
+    // once the session closed, like the shared socket it lives as long as
+    // the peer, handlers of the transport may still be pending.
+    struct StreamSocket {
+        std::unique_ptr<tftp::DatagramTransport> transport;
+        tftp::Buffer buffer;
+        udp::endpoint endpoint;
+        // the stream using it, and where its request went
+        SessionPtr session;
+        udp::endpoint requested;
+    };
+
+    // the streams of one striped transfer, reported as one result
+    struct Striped {
+        Striped(std::function<void(tftp::TransferResult)> complete, size_t streams)
+            : complete(std::move(complete)), remaining(streams) {}
+
+        std::function<void(tftp::TransferResult)> complete;
+        size_t remaining;
+        bool is_verified = true;
+        Clock::time_point started = Clock::now();
+        tftp::TransferResult result;
+    };
+    using StripedPtr = std::shared_ptr<Striped>;
+
     io_context &io_context_;
 
-    std::map<udp::endpoint, tftp::SendTransaction *> send_trans_map_;
-    std::map<udp::endpoint, tftp::RecvTransaction *> recv_trans_map_;
+    // file work too slow for the io thread: the copy of option "local", the
+    // hashes of option "delta"
+    std::shared_ptr<boost::asio::thread_pool> workers_ = std::make_shared<boost::asio::thread_pool>(2);
+    size_t pending_work_ = 0;
+
+    // see set_root
+    std::string root_;
+    bool is_local_enabled_ = true;
 
-    std::map<boost::asio::ip::address, tftp::SendTransaction *> pre_send_trans_map_;
-    std::map<boost::asio::ip::address, tftp::RecvTransaction *> pre_recv_trans_map_;
+    tftp::BandwidthScheduler<Session *> scheduler_;
 
-    std::map<boost::asio::ip::address, tftp::OptionAckMessage::Options> pre_send_options_map_;
-    std::map<boost::asio::ip::address, tftp::OptionAckMessage::Options> pre_recv_options_map_;
+    // files served to read requests
+    tftp::FileIndex file_index_;
 
-    udp::socket socket_cmd_;
+    // limits the sessions started by requests from the network
+    tftp::AdmissionControl admission_;
+
+    // options per subnet
+    std::shared_ptr<tftp::NegotiationPolicy> policy_ = std::make_shared<tftp::NegotiationPolicy>();
+
+    // read when a file sink is opened, which may happen on the caller's thread
+    mutable std::mutex durability_mutex_;
+    tftp::Durability durability_;
+
+    std::map<udp::endpoint, SessionPtr> send_session_map_;
+    std::map<udp::endpoint, SessionPtr> recv_session_map_;
+
+    // sessions waiting for the first reply, the port of the peer is not known yet
+    std::map<boost::asio::ip::address, SessionPtr> pre_send_session_map_;
+    std::map<boost::asio::ip::address, SessionPtr> pre_recv_session_map_;
+
+    // the requests of ours waiting for the running one to the same peer, a
+    // peer is in the map while one runs
+    using RequestQueue = std::map<boost::asio::ip::address, std::deque<std::function<void()>>>;
+    RequestQueue send_requests_;
+    RequestQueue recv_requests_;
+
+    std::unique_ptr<tftp::DatagramTransport> transport_cmd_;
     udp::endpoint endpoint_cmd_;
     tftp::Buffer buffer_cmd_;
 
-    udp::socket socket_data_;
+    std::unique_ptr<tftp::DatagramTransport> transport_data_;
     udp::endpoint endpoint_data_;
     tftp::Buffer buffer_data_;
+    size_t dropped_reported_ = 0;
+
+    // the sockets of the streams of striped transfers, see StreamSocket
+    std::vector<std::unique_ptr<StreamSocket>> stream_sockets_;
+    std::function<std::unique_ptr<tftp::DatagramTransport>()> open_stream_transport_ = [this]() {
+        return std::make_unique<tftp::UdpTransport>(io_context_, udp::endpoint(udp::v6(), 0));
+    };
+
+    template <typename Map, typename Key>
+    static SessionPtr find_session(Map &map, const Key &key) {
+        auto it = map.find(key);
+        return it == map.end() ? nullptr : it->second;
+    }
 
-    void start_receive_request() {
-        buffer_cmd_.resize(65535);
-
-        socket_cmd_.async_receive_from(
-            boost::asio::buffer(buffer_cmd_, 65535), endpoint_cmd_,
-            [this](boost::system::error_code e, std::size_t bytes_recvd) {
-                if (!e && bytes_recvd > 0) {
-                    buffer_cmd_.resize(bytes_recvd);
-                    tftp::Parser parser(buffer_cmd_);
-
-                    try {
-                        if (parser.is_wrq()) {
-                            write_request_handle(parser.parser_wrq(), endpoint_cmd_);
-                        } else if (parser.is_rrq()) {
-                            read_request_handle(parser.parser_rrq(), endpoint_cmd_);
-                        }
-                    } catch (std::invalid_argument &e) {
-                        std::cout << "wrong format" << std::endl;
-                        dump(buffer_cmd_);
-                    }
-                }
-            });
+    template <typename Map, typename Key>
+    static void erase_session(Map &map, const Key &key, const SessionPtr &session) {
+        auto it = map.find(key);
+        if (it != map.end() && it->second == session)
+            map.erase(it);
     }
 
-    void start_receive_data() {
-        buffer_data_.resize(65535);
-
-        socket_data_.async_receive_from(
-            boost::asio::buffer(buffer_data_, 65535), endpoint_data_,
-            [this](boost::system::error_code e, std::size_t bytes_recvd) {
-                if (!e && bytes_recvd > 0) {
-                    buffer_data_.resize(bytes_recvd);
-                    tftp::Parser parser(buffer_data_);
-
-                    try {
-                        if (parser.is_oack()) {
-                            option_ack_message_handle(parser.parser_oack(), endpoint_data_);
-                        } else if (parser.is_data()) {
-                            data_message_handle(parser.parser_data(), endpoint_data_);
-                        } else if (parser.is_ack()) {
-                            ack_message_handle(parser.parser_ack(), endpoint_data_);
-                        } else if (parser.is_error()) {
-                            error_response_handle(parser.parser_error(), endpoint_data_);
-                        }
-                    } catch (std::invalid_argument &e) {
-                        std::cout << "wrong format" << std::endl;
-                        dump(buffer_data_);
-                    }
-                }
+    // the handler runs on its own executor, whatever thread completes the transfer
+    template <typename Handler>
+    std::function<void(tftp::TransferResult)> make_completion(Handler handler) {
+        auto executor = boost::asio::get_associated_executor(handler, io_context_.get_executor());
+        auto handler_ptr = std::make_shared<Handler>(std::move(handler));
+        return [executor, handler_ptr](tftp::TransferResult result) {
+            boost::asio::post(executor, [handler_ptr, result]() mutable {
+                (*handler_ptr)(std::move(result));
             });
+        };
     }
 
-    void write_request_handle(tftp::WriteRequest request, udp::endpoint endpoint) {
-        // std::cout << "receive: [write request] filename:" << request.filename() << " size:" << request.options().at("tsize") << std::endl;
-
-        if (!recv_trans_map_.count(endpoint) && !pre_recv_trans_map_.count(endpoint.address())) {
-            auto trans = new tftp::RecvTransaction(request.filename());
-            recv_trans_map_[endpoint] = trans;
-
-            // process options
-            auto &request_options = request.options();
-            tftp::OptionAckMessage::Options return_oack;
-            if (request_options.count("tsize")) {
-                size_t size = std::stoi(request_options.at("tsize"));
-                if (trans->set_option_tsize(size))
-                    return_oack["tsize"] = request_options.at("tsize");
-            } else if (request_options.count("blksize")) {
-                uint16_t blksize = std::stoi(request_options.at("blksizke"));
-                if (trans->set_option_blksize(blksize))
-                    return_oack["blksize"] = request_options.at("blksize");
+    std::function<void(tftp::TransferResult)> stripe_completion(StripedPtr striped) {
+        return [this, striped](tftp::TransferResult result) { finish_stripe(striped, result); };
+    }
+
+    void finish_stripe(const StripedPtr &striped, const tftp::TransferResult &stripe) {
+        auto &result = striped->result;
+        result.bytes += stripe.bytes;
+        result.retransmissions += stripe.retransmissions;
+        result.duplicates += stripe.duplicates;
+        result.stale += stripe.stale;
+        striped->is_verified &= stripe.checksum_verified;
+        if (!stripe.success && result.error.empty())
+            result.error = stripe.error;
+        if (--striped->remaining > 0)
+            return;
+
+        // every stream verified its own range, there is no digest of the whole file
+        result.success = result.error.empty();
+        result.checksum_verified = result.success && striped->is_verified;
+        result.elapsed = Clock::now() - striped->started;
+        striped->complete(result);
+    }
+
+    // On the thread of the io_context, range is empty unless this is a stripe.
+    // Our other sessions share the data port, so the peer tells two of them
+    // in the same direction apart by nothing, and the reply to a request is
+    // matched by address only. Requests to a peer that has one running
+    // already wait in a queue until it is done. A stripe starts right away
+    // on a socket of its own.
+    void begin_write(std::function<void(tftp::TransferResult)> complete, std::unique_ptr<tftp::DataSource> source,
+                     std::string remote_name, udp::endpoint endpoint, tftp::Mode mode, std::string range) {
+        if (!source)
+            return fail(complete, "cannot open data source");
+
+        auto queued = std::make_shared<std::unique_ptr<tftp::DataSource>>(std::move(source));
+        auto start = [=, this]() {
+            auto session = std::make_shared<Session>(io_context_);
+            session->endpoint = endpoint;
+            session->complete = complete;
+            session->range = range;
+            session->send = std::make_unique<tftp::SendTransaction>(std::move(*queued));
+            session->send->set_mode(mode);
+            if (range.empty()) {
+                session->is_requested = true;
+                pre_send_session_map_[endpoint.address()] = session;
+            } else {
+                open_stream(session);
             }
+            spawn(session, write_transaction(session, remote_name, endpoint, mode));
+        };
+        if (range.empty())
+            enqueue_request(send_requests_, endpoint.address(), start);
+        else
+            start();
+    }
 
-            // construct reply packet
-            tftp::Buffer packet;
-            if (request_options.empty()) {
-                // std::cout << "send: [ack] block:" << 0 << std::endl;
-                packet = tftp::AckMessage::serialize(0);
+    void begin_read(std::function<void(tftp::TransferResult)> complete, std::string remote_name,
+                    std::unique_ptr<tftp::DataSink> sink, udp::endpoint endpoint, tftp::Mode mode, std::string range) {
+        if (!sink)
+            return fail(complete, "cannot open data sink");
+
+        auto queued = std::make_shared<std::unique_ptr<tftp::DataSink>>(std::move(sink));
+        auto start = [=, this]() {
+            auto session = std::make_shared<Session>(io_context_);
+            session->endpoint = endpoint;
+            session->complete = complete;
+            session->range = range;
+            session->recv = std::make_unique<tftp::RecvTransaction>(remote_name, std::move(*queued));
+            session->recv->set_mode(mode);
+            if (range.empty()) {
+                session->is_requested = true;
+                pre_recv_session_map_[endpoint.address()] = session;
             } else {
-                // std::cout << "send: [oack]" <<  std::endl;
-                packet = tftp::OptionAckMessage::serialize(request_options);
+                open_stream(session);
             }
+            spawn(session, read_transaction(session, remote_name, endpoint, mode));
+        };
+        if (range.empty())
+            enqueue_request(recv_requests_, endpoint.address(), start);
+        else
+            start();
+    }
 
-            // send reply packet
-            socket_data_.async_send_to(
-                boost::asio::buffer(packet), endpoint,
-                [this, endpoint](boost::system::error_code e, std::size_t bytes_recvd) {
-                    if (e) {
-                        delete recv_trans_map_[endpoint];
-                        recv_trans_map_.erase(endpoint);
-                    }
-                });
+    // give the session a socket of its own, an idle one or a new one
+    void open_stream(const SessionPtr &session) {
+        auto it = std::find_if(stream_sockets_.begin(), stream_sockets_.end(),
+                               [](auto &stream) { return !stream->session; });
+        StreamSocket *stream;
+        if (it != stream_sockets_.end()) {
+            stream = it->get();
+        } else {
+            stream = stream_sockets_.emplace_back(std::make_unique<StreamSocket>()).get();
+            stream->transport = open_stream_transport_();
+            tftp::log::debug("socket stream bind to ", stream->transport->local_endpoint());
+            boost::asio::co_spawn(io_context_, receive_stream_loop(*stream), boost::asio::detached);
         }
+        stream->session = session;
+        stream->requested = session->endpoint;
+        session->stream = stream;
+    }
 
-        start_receive_request();
+    // the socket a session sends on
+    tftp::DatagramTransport &transport(const SessionPtr &session) {
+        return session->stream ? *session->stream->transport : *transport_data_;
     }
 
-    void read_request_handle(tftp::ReadRequest request, udp::endpoint endpoint) {
-        // std::cout << "receive: [read request] filename:" << request.filename() << std::endl;
-
-        if (!send_trans_map_.count(endpoint) && !pre_send_trans_map_.count(endpoint.address())) {
-            auto trans = new tftp::SendTransaction(request.filename());
-            send_trans_map_[endpoint] = trans;
-
-            // process options
-            auto &request_options = request.options();
-            tftp::OptionAckMessage::Options return_oack;
-            if (request_options.count("tsize")) {
-                size_t size = std::stoi(request_options.at("tsize"));
-                if (size == 0) {
-                    auto new_size = std::to_string(std::filesystem::file_size(request.filename()));
-                    return_oack["tsize"] = new_size;
+    // start the request now if the peer has none of ours running, later otherwise
+    void enqueue_request(RequestQueue &requests, const boost::asio::ip::address &address, std::function<void()> start) {
+        auto it = requests.find(address);
+        if (it != requests.end()) {
+            it->second.push_back(std::move(start));
+            return;
+        }
+        requests[address];
+        start();
+    }
+
+    // our session with the peer is done, start the next request waiting for it
+    void dequeue_request(RequestQueue &requests, const boost::asio::ip::address &address) {
+        auto it = requests.find(address);
+        if (it == requests.end())
+            return;
+        if (it->second.empty()) {
+            requests.erase(it);
+            return;
+        }
+        boost::asio::post(io_context_, std::move(it->second.front()));
+        it->second.pop_front();
+    }
+
+    static void fail(const std::function<void(tftp::TransferResult)> &complete, std::string error) {
+        tftp::TransferResult result;
+        result.error = std::move(error);
+        complete(std::move(result));
+    }
+
+    static void print_result(const std::string &filename, const tftp::TransferResult &result) {
+        if (result.success) {
+            tftp::log::info("transfer finished ", filename, " ", result.bytes, " bytes ",
+                            (size_t)result.speed(), " bytes/s ",
+                            std::chrono::duration_cast<std::chrono::milliseconds>(result.elapsed).count(), " ms ",
+                            result.retransmissions, " retransmissions ",
+                            result.duplicates, " duplicates ", result.stale, " stale ",
+                            result.skipped, " skipped");
+        } else {
+            tftp::log::warn("transfer failed ", filename, ": ", result.error);
+        }
+    }
+
+    void spawn(SessionPtr session, awaitable<void> transaction) {
+        boost::asio::co_spawn(io_context_, std::move(transaction), [this, session](std::exception_ptr e) {
+            if (e) {
+                try {
+                    std::rethrow_exception(e);
+                } catch (std::exception &e) {
+                    tftp::log::error("transaction failed: ", e.what());
+                    session->result.success = false;
+                    session->result.error = e.what();
                 }
-            } else if (request_options.count("blksize")) {
-                uint16_t blksize = std::stoi(request_options.at("blksizke"));
-                if (trans->set_option_blksize(blksize))
-                    return_oack["blksize"] = request_options.at("blksize");
             }
+            close_session(session);
+        });
+    }
 
-            // construct reply packet
-            tftp::Buffer packet;
-            if (request_options.empty()) {
-                // std::cout << "send: [data] block:" << 0 << std::endl;
-                auto data_block = trans->get_next_block();
-                packet = tftp::DataMessage::serialize(0, data_block);
-            } else {
-                // std::cout << "send: [oack]" <<  std::endl;
-                packet = tftp::OptionAckMessage::serialize(request_options);
-            }
+    void close_session(const SessionPtr &session) {
+        if (session->is_closed)
+            return;
+        session->is_closed = true;
+        report_result(session);
+
+        scheduler_.remove(session.get());
+        erase_session(send_session_map_, session->endpoint, session);
+        erase_session(recv_session_map_, session->endpoint, session);
+        erase_session(pre_send_session_map_, session->endpoint.address(), session);
+        erase_session(pre_recv_session_map_, session->endpoint.address(), session);
+
+        if (session->is_admitted)
+            release_admission(session->endpoint);
+        if (session->stream)
+            session->stream->session = nullptr;
+        report_drops();
+    }
 
-            // send reply packet
-            socket_data_.async_send_to(
-                boost::asio::buffer(packet), endpoint,
-                [this, endpoint](boost::system::error_code e, std::size_t bytes_recvd) {
-                    if (e) {
-                        delete send_trans_map_[endpoint];
-                        send_trans_map_.erase(endpoint);
-                    } else {
-                        auto trans = send_trans_map_.at(endpoint);
-                        trans->confirm_sended();
-                    }
+    // The outcome goes to the caller once. A receiver that lingers for a
+    // retransmitted last block reports it as that block is acked, not a
+    // timeout later when the session closes.
+    void report_result(const SessionPtr &session) {
+        if (session->is_reported)
+            return;
+        session->is_reported = true;
+
+        auto &result = session->result;
+        result.elapsed = Clock::now() - session->started;
+        if (session->send) {
+            result.bytes = session->send->bytes_transferred();
+            result.retransmissions = session->send->retransmissions();
+            result.duplicates = session->send->duplicate_acks();
+            result.stale = session->send->stale_acks();
+            result.skipped = session->send->skipped_blocks();
+            if (session->send->has_checksum_option())
+                result.checksum = session->send->checksum();
+        } else if (session->recv) {
+            result.bytes = session->recv->bytes_transferred();
+            result.duplicates = session->recv->duplicate_blocks();
+            result.stale = session->recv->stale_blocks();
+            if (session->recv->has_checksum_option())
+                result.checksum = session->recv->checksum();
+        }
+        if (session->complete)
+            session->complete(result);
+        if (result.success && session->setting)
+            policy_->record(session->endpoint.address(), *session->setting, result.bytes, result.elapsed);
+        if (session->is_requested)
+            dequeue_request(session->send ? send_requests_ : recv_requests_, session->endpoint.address());
+    }
+
+    // the receive buffer overflowed since the last transfer, packets were lost before we saw them
+    void report_drops() {
+        auto dropped = transport_data_->dropped();
+        for (auto &stream : stream_sockets_)
+            dropped += stream->transport->dropped();
+        if (dropped > dropped_reported_)
+            tftp::log::warn("receive buffer overflow, ", dropped - dropped_reported_, " datagrams dropped");
+        dropped_reported_ = dropped;
+    }
+
+    // start the session now or from the backlog, tell the client to come back later otherwise
+    void admit(const udp::endpoint &endpoint, std::function<void()> start) {
+        switch (admission_.admit(endpoint, start)) {
+        case tftp::AdmissionControl::Admission::accepted:
+            start();
+            break;
+        case tftp::AdmissionControl::Admission::queued:
+            break;
+        case tftp::AdmissionControl::Admission::refused:
+            send_error(endpoint, 0, "Server busy, try again later.");
+            break;
+        }
+    }
+
+    // hand the slot of a session to the next request waiting in the backlog
+    void release_admission(const udp::endpoint &endpoint) {
+        if (auto start = admission_.release(endpoint))
+            boost::asio::post(io_context_, std::move(start));
+    }
+
+    // errors outside of a session are sent once and forgotten
+    void send_error(const udp::endpoint &endpoint, uint16_t code, const std::string &message) {
+        auto packet = std::make_shared<tftp::Buffer>(tftp::ErrorResponse::serialize(code, message));
+        transport_data_->async_send_to(boost::asio::buffer(*packet), endpoint,
+                                       [packet](boost::system::error_code, std::size_t) {});
+    }
+
+    static void set_peer_error(const SessionPtr &session, const Message &message) {
+        if (auto error = std::get_if<tftp::ErrorResponse>(&message.packet)) {
+            session->result.error = "peer error " + std::to_string(error->error_code()) + " " + error->error_msg();
+        } else {
+            session->result.error = "unexpected packet";
+        }
+    }
+
+    awaitable<void> send_packet(const SessionPtr &session, const tftp::Buffer &packet) {
+        co_await transport(session).async_send_to(boost::asio::buffer(packet), session->endpoint, use_awaitable);
+    }
+
+    // wait for the next packet of the session, nothing once the deadline
+    // passed. Block hashes are handed to the sender on the way.
+    awaitable<std::optional<Message>> receive(SessionPtr session, Clock::time_point deadline) {
+        for (;;) {
+            auto message = co_await session->channel.receive(deadline);
+            if (message && add_hashes(session, *message))
+                continue;
+            if (message || Clock::now() >= deadline)
+                co_return message;
+        }
+    }
+
+    // return true if the message carried block hashes for option "delta"
+    static bool add_hashes(const SessionPtr &session, const Message &message) {
+        auto hashes = std::get_if<tftp::HashMessage>(&message.packet);
+        if (hashes && session->send)
+            session->send->add_hashes(hashes->first(), hashes->hashes());
+        return hashes;
+    }
+
+    // The hashes of the blocks the receiver has go out ahead of its reply to
+    // the request, so the sender knows them before it reads the first block.
+    // Each is no larger than a data datagram, a lost one only costs the
+    // blocks it covers. They are paced by the scheduler like data blocks,
+    // the reply waits until the last of them is sent.
+    awaitable<void> send_hashes(SessionPtr session) {
+        auto trans = session->recv.get();
+        auto &hashes = trans->delta_hashes();
+        size_t count = std::max<size_t>(1, (trans->block_size() - 2) / 4);
+        auto unsent = std::make_shared<size_t>(0);
+        for (size_t first = 0; first < hashes.size(); first += count) {
+            auto packet = std::make_shared<const tftp::Buffer>(
+                tftp::HashMessage::serialize(first, hashes.data() + first, std::min(count, hashes.size() - first)));
+            *unsent += 1;
+            scheduler_.submit(session.get(), packet->size(), [this, session, packet, unsent]() {
+                transport(session).async_send_shared(packet, session->endpoint,
+                                                     [session, unsent](boost::system::error_code, std::size_t) {
+                                                         *unsent -= 1;
+                                                         session->channel.notify();
+                                                     });
+            });
+        }
+        // packets of the peer that come in meanwhile are for the caller, queued again in order
+        std::vector<Message> held;
+        while (*unsent > 0) {
+            if (auto message = co_await session->channel.receive(Clock::time_point::max()))
+                held.push_back(std::move(*message));
+        }
+        for (auto &message : held)
+            session->channel.push(std::move(message));
+        tftp::log::debug("sent ", hashes.size(), " block hashes of ", trans->name());
+    }
+
+    // Run work on a worker thread, the coroutine resumes on the io_context
+    // once it is done. Pass a named work: gcc 12 destroys a lambda that is a
+    // temporary of the co_await expression twice.
+    template <typename Work>
+    auto on_worker(const Work &work) {
+        return boost::asio::async_initiate<const boost::asio::use_awaitable_t<> &, void()>(
+            [this, work](auto handler) {
+                pending_work_++;
+                boost::asio::post(*workers_, [this, work, handler = std::move(handler)]() mutable {
+                    work();
+                    boost::asio::post(io_context_, [this, handler = std::move(handler)]() mutable {
+                        pending_work_--;
+                        std::move(handler)();
+                    });
                 });
+            },
+            use_awaitable);
+    }
+
+    // The received data goes to its sink. Durability waits for the disk, a
+    // sink that does so is committed on a worker, the io thread goes on.
+    awaitable<void> commit_received(SessionPtr session) {
+        if (session->recv->is_commit_blocking()) {
+            auto commit = [session]() { session->recv->commit(); };
+            co_await on_worker(commit);
+        } else {
+            session->recv->commit();
         }
+    }
 
-        start_receive_request();
+    // Option "local": the file is copied on a worker, the io thread goes on
+    // with the other sessions. Meanwhile block 0 is acked again on each
+    // timeout and each time the sender resends it, so it doesn't give up.
+    awaitable<void> copy_local_file(SessionPtr session) {
+        auto copied = std::make_shared<bool>(false);
+        auto keepalive = tftp::AckMessage::serialize(session->recv->next_block());
+        pending_work_++;
+        boost::asio::post(*workers_, [this, session, copied]() {
+            session->recv->copy_local_file();
+            boost::asio::post(io_context_, [this, session, copied]() {
+                pending_work_--;
+                *copied = true;
+                session->channel.notify();
+            });
+        });
+
+        while (!*copied) {
+            auto message = co_await session->channel.receive(Clock::now() + session->timeout);
+            if (!*copied && (!message || std::holds_alternative<tftp::DataMessage>(message->packet)))
+                co_await send_packet(session, keepalive);
+        }
     }
 
-    void ack_message_handle(tftp::AckMessage ack, udp::endpoint endpoint) {
-        // std::cout << "receive: [ack] block:" << ack.block() << std::endl;
+    // send a request or oack to the endpoint of the session and wait for the
+    // answer, resend it on timeout
+    awaitable<std::optional<Message>> exchange(SessionPtr session, tftp::Buffer packet) {
+        for (size_t retries = 0; retries <= tftp::max_retransmit; retries++) {
+            co_await send_packet(session, packet);
+            auto message = co_await receive(session, Clock::now() + session->timeout);
+            if (message)
+                co_return message;
+        }
+        co_return std::nullopt;
+    }
 
-        if (ack.block() == 0) {
-            if (pre_send_trans_map_.count(endpoint.address())) {
-                send_trans_map_[endpoint] = pre_send_trans_map_[endpoint.address()];
-                pre_send_trans_map_.erase(endpoint.address());
-                pre_send_options_map_.erase(endpoint.address());
+    awaitable<void> receive_request_loop() {
+        for (;;) {
+            buffer_cmd_.resize(65535);
+
+            boost::system::error_code e;
+            auto bytes_recvd = co_await transport_cmd_->async_receive_from(
+                boost::asio::buffer(buffer_cmd_, 65535), endpoint_cmd_,
+                boost::asio::redirect_error(use_awaitable, e));
+            if (e == boost::asio::error::operation_aborted)
+                co_return;
+            if (e || bytes_recvd == 0)
+                continue;
+
+            // floods are dropped before they cost anything
+            if (!admission_.allow_request(endpoint_cmd_.address()))
+                continue;
+
+            buffer_cmd_.resize(bytes_recvd);
+            tftp::Parser parser(buffer_cmd_);
+
+            try {
+                if (parser.is_wrq()) {
+                    write_request_handle(parser.parser_wrq(), endpoint_cmd_);
+                } else if (parser.is_rrq()) {
+                    read_request_handle(parser.parser_rrq(), endpoint_cmd_);
+                }
+            } catch (std::invalid_argument &e) {
+                tftp::log::warn("wrong format");
+                dump(buffer_cmd_);
             }
         }
+    }
 
-        if (send_trans_map_.count(endpoint)) {
-            auto trans = send_trans_map_.at(endpoint);
-            if (trans->confirm_ack(ack.block())) {
-                if (trans->is_finished()) {
-                    delete send_trans_map_[endpoint];
-                    send_trans_map_.erase(endpoint);
-                    return;
+    awaitable<void> receive_data_loop() {
+        for (;;) {
+            buffer_data_.resize(65535);
+
+            boost::system::error_code e;
+            auto bytes_recvd = co_await transport_data_->async_receive_from(
+                boost::asio::buffer(buffer_data_, 65535), endpoint_data_,
+                boost::asio::redirect_error(use_awaitable, e));
+            if (e == boost::asio::error::operation_aborted)
+                co_return;
+            if (e || bytes_recvd == 0)
+                continue;
+
+            buffer_data_.resize(bytes_recvd);
+            tftp::Parser parser(buffer_data_);
+
+            try {
+                if (parser.is_oack()) {
+                    dispatch(parser.parser_oack(), endpoint_data_);
+                } else if (parser.is_data()) {
+                    dispatch(parser.parser_data(), endpoint_data_);
+                } else if (parser.is_ack()) {
+                    dispatch(parser.parser_ack(), endpoint_data_);
+                } else if (parser.is_error()) {
+                    dispatch(parser.parser_error(), endpoint_data_);
+                } else if (parser.is_hash()) {
+                    dispatch(parser.parser_hash(), endpoint_data_);
                 }
+            } catch (std::invalid_argument &e) {
+                tftp::log::warn("wrong format");
+                dump(buffer_data_);
+            }
+        }
+    }
 
-                auto buffer = trans->get_next_block();
-                auto packet = tftp::DataMessage::serialize(ack.block(), buffer);
-
-                // std::cout << "send: [data] block:" << ack.block() << std::endl;
-                socket_data_.async_send_to(
-                    boost::asio::buffer(packet), endpoint,
-                    [this, endpoint](boost::system::error_code e, std::size_t bytes_recvd) {
-                        if (e) {
-                            delete send_trans_map_[endpoint];
-                            send_trans_map_.erase(endpoint);
-                        } else {
-                            auto trans = send_trans_map_.at(endpoint);
-                            trans->confirm_sended();
-                        }
-                    });
+    awaitable<void> receive_stream_loop(StreamSocket &stream) {
+        for (;;) {
+            stream.buffer.resize(65535);
+
+            boost::system::error_code e;
+            auto bytes_recvd = co_await stream.transport->async_receive_from(
+                boost::asio::buffer(stream.buffer, 65535), stream.endpoint,
+                boost::asio::redirect_error(use_awaitable, e));
+            if (e == boost::asio::error::operation_aborted)
+                co_return;
+            if (e || bytes_recvd == 0)
+                continue;
+
+            stream.buffer.resize(bytes_recvd);
+            tftp::Parser parser(stream.buffer);
+
+            try {
+                if (parser.is_oack()) {
+                    dispatch(stream, parser.parser_oack());
+                } else if (parser.is_data()) {
+                    dispatch(stream, parser.parser_data());
+                } else if (parser.is_ack()) {
+                    dispatch(stream, parser.parser_ack());
+                } else if (parser.is_error()) {
+                    dispatch(stream, parser.parser_error());
+                } else if (parser.is_hash()) {
+                    dispatch(stream, parser.parser_hash());
+                }
+            } catch (std::invalid_argument &e) {
+                tftp::log::warn("wrong format");
+                dump(stream.buffer);
             }
         }
+    }
 
-        start_receive_data();
+    // Everything on the socket of a stream is for its session, once the
+    // request is answered from the port of the peer the session knows. Until
+    // then only what may answer it, from any port, as with the shared socket.
+    template <typename Packet>
+    void dispatch(StreamSocket &stream, Packet packet) {
+        auto &session = stream.session;
+        if (!session || stream.endpoint.address() != session->endpoint.address())
+            return;
+        if (stream.endpoint != session->endpoint && (session->endpoint != stream.requested || !is_reply(*session, packet)))
+            return;
+        if constexpr (std::is_same_v<Packet, tftp::ErrorResponse>)
+            tftp::log::warn("receive error ", packet.error_code(), " ", packet.error_msg(), " from ", stream.endpoint);
+        session->channel.push({stream.endpoint, std::move(packet)});
     }
 
-    void data_message_handle(tftp::DataMessage data, udp::endpoint endpoint) {
-        // std::cout << "receive: [data] block:" << data.block() << std::endl;
+    static bool is_reply(const Session &session, const tftp::AckMessage &ack) {
+        return session.send && ack.block() == 0;
+    }
+
+    static bool is_reply(const Session &session, const tftp::DataMessage &data) {
+        return session.recv && data.block() == 0;
+    }
+
+    static bool is_reply(const Session &session, const tftp::HashMessage &) {
+        return (bool)session.send;
+    }
+
+    static bool is_reply(const Session &, const tftp::OptionAckMessage &message) {
+        return !is_digest(message);
+    }
+
+    static bool is_reply(const Session &, const tftp::ErrorResponse &) {
+        return true;
+    }
+
+    // acks go to senders and data to receivers, block 0 may be the first reply to a request
+    void dispatch(tftp::AckMessage ack, udp::endpoint endpoint) {
+        SessionPtr session;
+        if (ack.block() == 0)
+            session = find_session(pre_send_session_map_, endpoint.address());
+        if (!session)
+            session = find_session(send_session_map_, endpoint);
+        if (session)
+            session->channel.push({endpoint, std::move(ack)});
+    }
+
+    void dispatch(tftp::DataMessage data, udp::endpoint endpoint) {
+        SessionPtr session;
+        if (data.block() == 0)
+            session = find_session(pre_recv_session_map_, endpoint.address());
+        if (!session)
+            session = find_session(recv_session_map_, endpoint);
+        if (session)
+            session->channel.push({endpoint, std::move(data)});
+    }
+
+    // block hashes go to senders, they may come ahead of the reply to our write request
+    void dispatch(tftp::HashMessage message, udp::endpoint endpoint) {
+        auto session = find_session(pre_send_session_map_, endpoint.address());
+        if (!session)
+            session = find_session(send_session_map_, endpoint);
+        if (session)
+            session->channel.push({endpoint, std::move(message)});
+    }
+
+    // an oack with only a digest follows the last block, or confirms it
+    static bool is_digest(const tftp::OptionAckMessage &message) {
+        auto &options = message.options();
+        return options.size() == 1 && options.count("checksum") && options.at("checksum") != tftp::checksum_crc32c;
+    }
+
+    // an oack answers a request, or carries the digest after the last block
+    void dispatch(tftp::OptionAckMessage message, udp::endpoint endpoint) {
+        SessionPtr session;
+        if (is_digest(message)) {
+            session = find_session(recv_session_map_, endpoint);
+            if (!session || !session->recv->is_finished())
+                session = find_session(send_session_map_, endpoint);
+        } else {
+            session = find_session(pre_send_session_map_, endpoint.address());
+            if (!session)
+                session = find_session(pre_recv_session_map_, endpoint.address());
+        }
+        if (session)
+            session->channel.push({endpoint, std::move(message)});
+    }
+
+    void dispatch(tftp::ErrorResponse response, udp::endpoint endpoint) {
+        tftp::log::warn("receive error ", response.error_code(), " ", response.error_msg(), " from ", endpoint);
+
+        for (auto session : {find_session(send_session_map_, endpoint),
+                             find_session(recv_session_map_, endpoint),
+                             find_session(pre_send_session_map_, endpoint.address()),
+                             find_session(pre_recv_session_map_, endpoint.address())}) {
+            if (session)
+                session->channel.push({endpoint, response});
+        }
+    }
+
+    // where the file a request names is, nullopt if it is outside the root
+    std::optional<std::string> served_path(const std::string &filename) const {
+        if (root_.empty())
+            return filename;
+        auto path = std::filesystem::path(filename).relative_path().lexically_normal();
+        if (path.empty() || *path.begin() == "..")
+            return std::nullopt;
+        return (std::filesystem::path(root_) / path).string();
+    }
+
+    void write_request_handle(tftp::WriteRequest request, udp::endpoint endpoint) {
+        tftp::log::debug("receive: [write request] filename:", request.filename(), " from ", endpoint);
+
+        auto existing = find_session(recv_session_map_, endpoint);
+        if ((existing && !existing->is_dallying) || pre_recv_session_map_.count(endpoint.address()))
+            return;
+
+        admit(endpoint, [this, request, endpoint]() { start_write_session(request, endpoint); });
+    }
+
+    void start_write_session(tftp::WriteRequest request, udp::endpoint endpoint) {
+        // stripes of a file are written into place side by side
+        bool is_stripe = request.options().count("range");
+        if (is_stripe && request.mode() != tftp::Mode::octet) {
+            send_error(endpoint, 8, "Option negotiation failed.");
+            release_admission(endpoint);
+            return;
+        }
+        // with option "delta" the file is updated, it can't be truncated up front
+        bool is_delta = request.options().count("delta") && request.mode() == tftp::Mode::octet;
+        auto path = served_path(request.filename());
+        std::unique_ptr<tftp::FileSink> sink;
+        if (path)
+            sink = is_stripe  ? tftp::FileSink::open_stripe(*path, durability())
+                   : is_delta ? tftp::FileSink::open_update(*path, durability())
+                              : tftp::FileSink::open(*path, durability());
+        if (!sink) {
+            send_error(endpoint, 2, "Access violation.");
+            release_admission(endpoint);
+            return;
+        }
+
+        auto session = std::make_shared<Session>(io_context_);
+        session->endpoint = endpoint;
+        session->is_admitted = true;
+        apply_policy(session, endpoint);
+        session->recv = std::make_unique<tftp::RecvTransaction>(request.filename(), std::move(sink));
+        recv_session_map_[endpoint] = session;
+        spawn(session, serve_write_request(session, std::move(request)));
+    }
 
-        if (data.block() == 0) {
-            if (pre_recv_trans_map_.count(endpoint.address())) {
-                recv_trans_map_[endpoint] = pre_recv_trans_map_[endpoint.address()];
-                pre_recv_trans_map_.erase(endpoint.address());
-                pre_recv_options_map_.erase(endpoint.address());
+    void read_request_handle(tftp::ReadRequest request, udp::endpoint endpoint) {
+        tftp::log::debug("receive: [read request] filename:", request.filename(), " from ", endpoint);
+
+        auto existing = find_session(send_session_map_, endpoint);
+        if ((existing && !existing->is_dallying) || pre_send_session_map_.count(endpoint.address()))
+            return;
+
+        auto path = served_path(request.filename());
+        if (!path || !file_index_.find(*path)->readable) {
+            send_error(endpoint, 1, "File not found.");
+            return;
+        }
+
+        admit(endpoint, [this, request, endpoint]() { start_read_session(request, endpoint); });
+    }
+
+    void start_read_session(tftp::ReadRequest request, udp::endpoint endpoint) {
+        // the file may have changed while the request was waiting in the backlog
+        auto path = served_path(request.filename());
+        auto file = path ? file_index_.find(*path) : nullptr;
+        if (!file || !file->readable) {
+            send_error(endpoint, 1, "File not found.");
+            release_admission(endpoint);
+            return;
+        }
+
+        // a stripe of the file, the client asks for one of count parts
+        auto range = tftp::ByteRange{0, file->size, file->size};
+        if (request.options().count("range")) {
+            auto stripe = tftp::ByteRange::parse_stripe_request(request.options().at("range"));
+            if (!stripe || request.mode() != tftp::Mode::octet) {
+                send_error(endpoint, 8, "Option negotiation failed.");
+                release_admission(endpoint);
+                return;
             }
+            range = tftp::ByteRange::stripe(stripe->first, stripe->second, file->size);
         }
 
-        if (recv_trans_map_.count(endpoint)) {
-            auto trans = recv_trans_map_.at(endpoint);
-            if (trans->receive_data(data)) {
-                if (trans->is_finished()) {
-                    delete recv_trans_map_[endpoint];
-                    recv_trans_map_.erase(endpoint);
-                } else {
-                    // // control transmit speed, used for test
-                    // boost::asio::deadline_timer t(io_context_, boost::posix_time::milliseconds(5));
-                    // t.wait();
-
-                    auto packet = tftp::AckMessage::serialize(data.block() + 1);
-
-                    // std::cout << "send: [ack] block:" << data.block() + 1 << std::endl;
-                    socket_data_.async_send_to(
-                        boost::asio::buffer(packet), endpoint,
-                        [this, endpoint](boost::system::error_code e, std::size_t bytes_recvd) {
-                            if (e) {
-                                delete recv_trans_map_[endpoint];
-                                recv_trans_map_.erase(endpoint);
-                            }
-                        });
-                }
+        auto session = std::make_shared<Session>(io_context_);
+        session->endpoint = endpoint;
+        session->is_admitted = true;
+        apply_policy(session, endpoint);
+        if (request.options().count("range"))
+            session->range = range.to_string();
+        session->send = std::make_unique<tftp::SendTransaction>(
+            std::make_unique<tftp::FileSource>(file->handle, range.length, range.offset));
+        send_session_map_[endpoint] = session;
+        spawn(session, serve_read_request(session, std::move(request)));
+    }
+
+    awaitable<void> write_transaction(SessionPtr session, std::string remote_name, udp::endpoint endpoint, tftp::Mode mode) {
+        auto trans = session->send.get();
+
+        // set options, the netascii size is only known after translation
+        tftp::WriteRequest::Options request_options;
+        if (mode != tftp::Mode::netascii && trans->size())
+            request_options["tsize"] = std::to_string(*trans->size());
+        request_policy_options(session, endpoint, request_options);
+        request_options["checksum"] = tftp::checksum_crc32c;
+        if (!session->range.empty())
+            request_options["range"] = session->range;
+        else if (mode == tftp::Mode::octet && trans->size())
+            request_options["delta"] = tftp::checksum_crc32c;
+
+        // send write request, the reply comes from the data port of the peer
+        session->endpoint = endpoint;
+        auto packet = tftp::WriteRequest::serialize(remote_name, mode, request_options);
+        auto reply = co_await exchange(session, packet);
+        erase_session(pre_send_session_map_, endpoint.address(), session);
+        if (!reply) {
+            session->result.error = "no reply";
+            co_return;
+        }
+
+        session->endpoint = reply->endpoint;
+        if (!session->stream)
+            send_session_map_[session->endpoint] = session;
+
+        if (auto oack = std::get_if<tftp::OptionAckMessage>(&reply->packet)) {
+            if (!apply_options(*trans, request_options, oack->options())) {
+                session->result.error = "option negotiation failed";
+                auto packet = tftp::ErrorResponse::serialize(8, "Option negotiation failed.");
+                co_await send_packet(session, packet);
+                co_return;
             }
+        } else if (!std::holds_alternative<tftp::AckMessage>(reply->packet)) {
+            set_peer_error(session, *reply);
+            co_return;
+        } else if (!session->range.empty()) {
+            // the peer ignored the range, it would take the stripe for the whole file
+            session->result.error = "option negotiation failed";
+            auto packet = tftp::ErrorResponse::serialize(8, "Option negotiation failed.");
+            co_await send_packet(session, packet);
+            co_return;
         }
-        start_receive_data();
+
+        session->setting = granted_setting(*reply);
+        co_await send_blocks(session);
     }
 
-    void error_response_handle(tftp::ErrorResponse response, udp::endpoint endpoint) {
-        bool pre_send_check = false, pre_recv_check = false,
-             send_check = false, recv_check = false;
+    awaitable<void> read_transaction(SessionPtr session, std::string filename, udp::endpoint endpoint, tftp::Mode mode) {
+        auto trans = session->recv.get();
+
+        // a reader that can't open the file of option "local" asks again without it
+        bool ask_local = session->range.empty() && mode == tftp::Mode::octet &&
+                         tftp::LocalFile::is_local_peer(endpoint.address());
+        for (;;) {
+            // set options
+            tftp::ReadRequest::Options request_options;
+            request_options["tsize"] = "0";
+            request_policy_options(session, endpoint, request_options);
+            request_options["checksum"] = tftp::checksum_crc32c;
+            if (!session->range.empty())
+                request_options["range"] = session->range;
+            else if (trans->can_update())
+                request_options["delta"] = tftp::checksum_crc32c;
+            if (ask_local)
+                request_options["local"] = "0";
+
+            // send read request, the reply comes from the data port of the peer
+            session->endpoint = endpoint;
+            auto packet = tftp::ReadRequest::serialize(filename, mode, request_options);
+            auto reply = co_await exchange(session, packet);
+            erase_session(pre_recv_session_map_, endpoint.address(), session);
+            if (!reply) {
+                session->result.error = "no reply";
+                co_return;
+            }
 
-        switch (response.error_code()) {
-        case 0:  // Not defined.
-            break;
-        case 1:  // File not found.
-            pre_recv_check = true;
-            break;
-        case 2:  // Access violation.
-            pre_recv_check = pre_send_check = true;
-            break;
-        case 3:  // Disk full or allocation exceeded.
-            recv_check = send_check = true;
-            break;
-        case 4:  // Illegal TFTP operation.
-            recv_check = send_check = true;
-            break;
-        case 5:  // Unknown transfer ID.
-            break;
-        case 6:  // File already exists.
-            pre_send_check = true;
-            break;
-        case 7:  // No such user.
-            break;
-        default:
-            break;
+            session->endpoint = reply->endpoint;
+            if (!session->stream)
+                recv_session_map_[session->endpoint] = session;
+
+            if (auto oack = std::get_if<tftp::OptionAckMessage>(&reply->packet)) {
+                if (!apply_options(*trans, request_options, oack->options())) {
+                    session->result.error = "option negotiation failed";
+                    auto packet = tftp::ErrorResponse::serialize(8, "Option negotiation failed.");
+                    co_await send_packet(session, packet);
+                    co_return;
+                }
+                // the sender would only send an empty block 0, turn the oack
+                // down as RFC 2347 has it and read the file over the network
+                if (ask_local && oack->options().count("local") && !trans->is_local()) {
+                    tftp::log::debug("cannot open ", filename, " of the sender, reading it without option local");
+                    auto packet = tftp::ErrorResponse::serialize(8, "Option negotiation failed.");
+                    co_await send_packet(session, packet);
+                    erase_session(recv_session_map_, session->endpoint, session);
+                    pre_recv_session_map_[endpoint.address()] = session;
+                    ask_local = false;
+                    continue;
+                }
+                // acknowledge the oack, the sender then starts with block 0
+                session->setting = granted_setting(*reply);
+                if (trans->is_delta()) {
+                    auto hash = [session]() { session->recv->hash_previous(); };
+                    co_await on_worker(hash);
+                    if (!trans->is_delta()) {
+                        session->result.error = "option negotiation failed";
+                        auto packet = tftp::ErrorResponse::serialize(8, "Option negotiation failed.");
+                        co_await send_packet(session, packet);
+                        co_return;
+                    }
+                    co_await send_hashes(session);
+                }
+                co_await receive_blocks(session, tftp::AckMessage::serialize(0), std::nullopt);
+            } else if (std::holds_alternative<tftp::DataMessage>(reply->packet) && session->range.empty()) {
+                session->setting = granted_setting(*reply);
+                co_await receive_blocks(session, {}, std::move(reply));
+            } else if (std::holds_alternative<tftp::DataMessage>(reply->packet)) {
+                // the peer ignored the range and sends the whole file
+                session->result.error = "option negotiation failed";
+                auto packet = tftp::ErrorResponse::serialize(8, "Option negotiation failed.");
+                co_await send_packet(session, packet);
+            } else {
+                set_peer_error(session, *reply);
+            }
+            co_return;
         }
+    }
 
-        if (pre_recv_check) {
-            delete pre_recv_trans_map_[endpoint.address()];
-            pre_recv_trans_map_.erase(endpoint.address());
+    awaitable<void> serve_write_request(SessionPtr session, tftp::WriteRequest request) {
+        auto trans = session->recv.get();
+        trans->set_mode(request.mode());
+
+        // process options
+        auto &request_options = request.options();
+        tftp::OptionAckMessage::Options return_oack;
+        if (request_options.count("tsize")) {
+            size_t size = std::stoull(request_options.at("tsize"));
+            if (trans->set_option_tsize(size))
+                return_oack["tsize"] = request_options.at("tsize");
+        }
+        if (request_options.count("range")) {
+            auto range = tftp::ByteRange::parse(request_options.at("range"));
+            if (!range || !trans->set_option_range(*range)) {
+                auto packet = tftp::ErrorResponse::serialize(8, "Option negotiation failed.");
+                co_await send_packet(session, packet);
+                co_return;
+            }
+            return_oack["range"] = request_options.at("range");
+        }
+        accept_options(*trans, session, request_options, return_oack);
+        if (trans->is_delta()) {
+            auto hash = [session]() { session->recv->hash_previous(); };
+            co_await on_worker(hash);
+            if (trans->is_delta())
+                co_await send_hashes(session);
+            else
+                return_oack.erase("delta");
         }
 
-        if (pre_send_check) {
-            delete pre_send_trans_map_[endpoint.address()];
-            pre_send_trans_map_.erase(endpoint.address());
+        // reply with ack 0, or with an oack
+        if (return_oack.empty()) {
+            tftp::log::trace("send: [ack] block:", 0);
+            co_await receive_blocks(session, tftp::AckMessage::serialize(0), std::nullopt);
+        } else {
+            tftp::log::trace("send: [oack]");
+            co_await receive_blocks(session, tftp::OptionAckMessage::serialize(return_oack), std::nullopt);
+        }
+    }
+
+    awaitable<void> serve_read_request(SessionPtr session, tftp::ReadRequest request) {
+        auto trans = session->send.get();
+        trans->set_mode(request.mode());
+
+        // process options, the netascii size is only known after translation
+        auto &request_options = request.options();
+        tftp::OptionAckMessage::Options return_oack;
+        if (request_options.count("tsize") && request.mode() != tftp::Mode::netascii && trans->size()) {
+            size_t size = std::stoull(request_options.at("tsize"));
+            if (size == 0)
+                return_oack["tsize"] = std::to_string(*trans->size());
+        }
+        if (!session->range.empty())
+            return_oack["range"] = session->range;
+        accept_options(*trans, session, request_options, return_oack);
+
+        // send the first blocks right away, or send an oack and wait for ack 0
+        if (!return_oack.empty()) {
+            tftp::log::trace("send: [oack]");
+            auto reply = co_await exchange(session, tftp::OptionAckMessage::serialize(return_oack));
+            if (!reply) {
+                session->result.error = "no reply";
+                co_return;
+            }
+            if (!std::holds_alternative<tftp::AckMessage>(reply->packet)) {
+                set_peer_error(session, *reply);
+                co_return;
+            }
         }
 
-        if (recv_check) {
-            delete recv_trans_map_[endpoint];
-            recv_trans_map_.erase(endpoint);
+        co_await send_blocks(session);
+    }
+
+    // ask for the block and window size the policy proposes for the peer, and its timeout
+    void request_policy_options(const SessionPtr &session, const udp::endpoint &endpoint,
+                                tftp::OptionAckMessage::Options &request_options) {
+        auto policy = policy_->find(endpoint.address());
+        auto setting = policy_->propose(endpoint.address());
+        request_options["blksize"] = std::to_string(setting.blksize);
+        request_options["windowsize"] = std::to_string(setting.window);
+        request_options["timeout"] = std::to_string(policy.timeout);
+        apply_policy(session, endpoint);
+        if (session->send)
+            session->send->set_option_timeout(policy.timeout);
+    }
+
+    // the timeout of the subnet of the peer, and its share of the bandwidth
+    void apply_policy(const SessionPtr &session, const udp::endpoint &endpoint) {
+        auto policy = policy_->find(endpoint.address());
+        session->timeout = std::chrono::seconds(policy.timeout);
+        scheduler_.set_session_weight(session.get(), policy.weight);
+    }
+
+    // the block and window size of a reply to our request, those of RFC 1350 without an oack
+    static tftp::NegotiationPolicy::Setting granted_setting(const Message &reply) {
+        tftp::NegotiationPolicy::Setting setting;
+        if (auto oack = std::get_if<tftp::OptionAckMessage>(&reply.packet)) {
+            auto &options = oack->options();
+            if (options.count("blksize"))
+                setting.blksize = std::stoi(options.at("blksize"));
+            if (options.count("windowsize"))
+                setting.window = std::stoi(options.at("windowsize"));
         }
+        return setting;
+    }
 
-        if (send_check) {
-            delete send_trans_map_[endpoint];
-            send_trans_map_.erase(endpoint);
+    // options both directions negotiate the same way, within the caps of the
+    // policy for the subnet of the peer
+    template <typename Transaction>
+    void accept_options(Transaction &trans, const SessionPtr &session, const tftp::OptionAckMessage::Options &request_options,
+                        tftp::OptionAckMessage::Options &return_oack) {
+        auto policy = policy_->find(session->endpoint.address());
+        // smaller block and window sizes than requested may be granted, larger ones not
+        if (request_options.count("blksize")) {
+            uint16_t blksize = std::min<unsigned long>(std::stoul(request_options.at("blksize")), policy.max_blksize);
+            if (trans.set_option_blksize(blksize))
+                return_oack["blksize"] = std::to_string(blksize);
+        }
+        if (request_options.count("windowsize")) {
+            uint16_t windowsize = std::min<unsigned long>(std::stoul(request_options.at("windowsize")), policy.max_window);
+            if (trans.set_option_windowsize(windowsize))
+                return_oack["windowsize"] = std::to_string(windowsize);
+        }
+        // the timeout is granted as requested or not at all (RFC 2349)
+        if (request_options.count("timeout")) {
+            unsigned long timeout = std::stoul(request_options.at("timeout"));
+            if (timeout <= policy.max_timeout && trans.set_option_timeout(timeout)) {
+                return_oack["timeout"] = request_options.at("timeout");
+                session->timeout = std::chrono::seconds(timeout);
+            }
+        }
+        // a reader on the same host copies the file from our descriptor, not
+        // for stripes. It makes checksum and delta moot. Never for a write
+        // request: we would open a descriptor named by the client with our
+        // own rights.
+        if constexpr (std::is_same_v<Transaction, tftp::SendTransaction>) {
+            if (is_local_enabled_ && request_options.count("local") && !request_options.count("range") &&
+                tftp::LocalFile::is_local_peer(session->endpoint.address())) {
+                auto local = trans.local_file();
+                if (local && request_options.at("local") == "0" && trans.set_option_local())
+                    return_oack["local"] = local->to_string();
+            }
+        }
+        if (request_options.count("checksum") && !trans.is_local()) {
+            if (trans.set_option_checksum(request_options.at("checksum")))
+                return_oack["checksum"] = request_options.at("checksum");
+        }
+        // after the block size and checksum it depends on, not for stripes
+        if (request_options.count("delta") && !request_options.count("range") && !trans.is_local()) {
+            if (trans.set_option_delta(request_options.at("delta")))
+                return_oack["delta"] = request_options.at("delta");
         }
     }
 
-    void option_ack_message_handle(tftp::OptionAckMessage message, udp::endpoint endpoint) {
-        if (pre_send_trans_map_.count(endpoint.address())) {
-            auto trans = pre_send_trans_map_.at(endpoint.address());
+    // return false if the oack grants more than was requested
+    template <typename Transaction>
+    bool apply_options(Transaction &trans, const tftp::OptionAckMessage::Options &request_options,
+                       const tftp::OptionAckMessage::Options &reply_options) {
+        if (request_options.count("blksize") && reply_options.count("blksize")) {
+            uint16_t request_blksize = std::stoi(request_options.at("blksize"));
+            uint16_t reply_blksize = std::stoi(reply_options.at("blksize"));
+            if (reply_blksize > request_blksize || reply_blksize < tftp::min_block_size)
+                return false;
+            trans.set_option_blksize(reply_blksize);
+        }
 
-            auto &request_options = pre_send_options_map_.at(endpoint.address());
-            auto &reply_options = message.options();
+        if (request_options.count("windowsize") && reply_options.count("windowsize")) {
+            uint16_t request_windowsize = std::stoi(request_options.at("windowsize"));
+            uint16_t reply_windowsize = std::stoi(reply_options.at("windowsize"));
+            if (reply_windowsize > request_windowsize || reply_windowsize < tftp::min_window_size)
+                return false;
+            trans.set_option_windowsize(reply_windowsize);
+        }
 
-            if (request_options.count("blksize") && reply_options.count("blksize")) {
-                uint16_t request_blksize = std::stoi(request_options.at("blksize"));
-                uint16_t reply_blksize = std::stoi(reply_options.at("blksize"));
-                if (reply_blksize > request_blksize || reply_blksize < tftp::min_block_size) {
-                    start_receive_data();
-                    return;
-                }
-                trans->set_option_blksize(reply_blksize);
+        if constexpr (std::is_same_v<Transaction, tftp::RecvTransaction>) {
+            if (request_options.count("tsize") && reply_options.count("tsize")) {
+                size_t reply_tsize = std::stoull(reply_options.at("tsize"));
+                trans.set_option_tsize(reply_tsize);
             }
+        }
 
-            send_trans_map_[endpoint] = trans;
-            pre_send_trans_map_.erase(endpoint.address());
-            pre_send_options_map_.erase(endpoint.address());
-
-            auto data_block = trans->get_next_block();
-            auto packet = tftp::DataMessage::serialize(0, data_block);
-            socket_data_.async_send_to(
-                boost::asio::buffer(packet), endpoint,
-                [this, endpoint](boost::system::error_code e, std::size_t bytes_recvd) {
-                    if (e) {
-                        delete send_trans_map_[endpoint];
-                        send_trans_map_.erase(endpoint);
-                    } else {
-                        auto trans = send_trans_map_.at(endpoint);
-                        trans->confirm_sended();
+        if (request_options.count("checksum") && reply_options.count("checksum")) {
+            trans.set_option_checksum(reply_options.at("checksum"));
+        }
+
+        // only a read request asks for "local", a file we can't open isn't
+        // copied, see read_transaction
+        if constexpr (std::is_same_v<Transaction, tftp::RecvTransaction>) {
+            if (request_options.count("local") && reply_options.count("local"))
+                trans.set_option_local(reply_options.at("local"));
+        }
+
+        if (request_options.count("delta") && reply_options.count("delta") &&
+            !trans.set_option_delta(reply_options.at("delta")))
+            return false;
+
+        if (reply_options.count("timeout") &&
+            (!request_options.count("timeout") || reply_options.at("timeout") != request_options.at("timeout")))
+            return false;
+
+        // a stripe must be granted as requested, or as the reader asked for it
+        if (request_options.count("range")) {
+            if (!reply_options.count("range"))
+                return false;
+            if constexpr (std::is_same_v<Transaction, tftp::RecvTransaction>) {
+                auto range = tftp::ByteRange::parse(reply_options.at("range"));
+                if (!range || !trans.set_option_range(*range))
+                    return false;
+            } else if (reply_options.at("range") != request_options.at("range")) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // data blocks are paced by the scheduler, the transport holds on to the
+    // packet as long as it needs it, which may be beyond the send completing
+    void send_data_message(SessionPtr session, uint16_t block, std::shared_ptr<const tftp::Buffer> packet) {
+        scheduler_.submit(session.get(), packet->size(), [this, session, block, packet]() {
+            transport(session).async_send_shared(
+                packet, session->endpoint,
+                [this, session, block](boost::system::error_code e, std::size_t) {
+                    if (session->is_closed)
+                        return;
+                    // a block that failed to go out is lost like one dropped on the way, the
+                    // retransmission timer resends it, and gives up if the socket keeps failing
+                    if (!e)
+                        session->send->confirm_sended(block);
+
+                    // start the retransmission timer unless it is running already
+                    if (session->deadline == Clock::time_point::max()) {
+                        session->deadline = Clock::now() + session->send->retransmit_timeout();
+                        session->channel.notify();
                     }
                 });
+        });
+    }
 
-        } else if (pre_recv_options_map_.count(endpoint.address())) {
-            auto trans = pre_recv_trans_map_.at(endpoint.address());
+    awaitable<void> send_blocks(SessionPtr session) {
+        auto trans = session->send.get();
 
-            auto &request_options = pre_recv_options_map_.at(endpoint.address());
-            auto &reply_options = message.options();
+        // a pipe that ran dry wakes us up once its producer delivered more
+        trans->on_source_available([&io_context = io_context_, weak = std::weak_ptr<Session>(session)]() {
+            boost::asio::post(io_context, [weak]() {
+                if (auto session = weak.lock())
+                    session->channel.notify();
+            });
+        });
+
+        while (!trans->is_finished()) {
+            // a duplicated ack alone never causes a resend, blocks only go out
+            // again after a gap reported by the receiver or a timeout
+            while (trans->has_next_block()) {
+                auto block = trans->next_block();
+                send_data_message(session, block, trans->get_next_block());
+            }
 
-            if (request_options.count("blksize") && reply_options.count("blksize")) {
-                uint16_t request_blksize = std::stoi(request_options.at("blksize"));
-                uint16_t reply_blksize = std::stoi(reply_options.at("blksize"));
-                if (reply_blksize > request_blksize || reply_blksize < tftp::min_block_size) {
-                    start_receive_data();
-                    return;
+            // the search for a changed block of option "delta" reads a slice
+            // of the file at a time, other sessions get their turn between
+            std::optional<Message> message;
+            if (trans->is_scanning()) {
+                trans->scan_changed_blocks();
+                co_await boost::asio::post(io_context_, use_awaitable);
+                message = session->channel.try_receive();
+                if (!message && Clock::now() < session->deadline)
+                    continue;
+            } else {
+                message = co_await session->channel.receive(session->deadline);
+            }
+            if (!message) {
+                // woken up to pick up a new deadline
+                if (Clock::now() < session->deadline)
+                    continue;
+
+                if (!trans->timeout()) {
+                    tftp::log::warn("transaction timeout ", session->endpoint);
+                    session->result.error = "timeout";
+                    co_return;
                 }
-                trans->set_option_blksize(reply_blksize);
+
+                // go back to the oldest unacked block, blocks still waiting to be paced are stale
+                scheduler_.cancel(session.get());
+                session->deadline = Clock::now() + trans->retransmit_timeout();
+                continue;
             }
 
-            if (request_options.count("tsize") && reply_options.count("tsize")) {
-                uint16_t request_tsize = std::stoi(request_options.at("tsize"));
-                uint16_t reply_tsize = std::stoi(reply_options.at("tsize"));
-                trans->set_option_tsize(reply_tsize);
+            if (auto ack = std::get_if<tftp::AckMessage>(&message->packet)) {
+                tftp::log::trace("receive: [ack] block:", ack->block());
+                if (trans->confirm_ack(ack->block())) {
+                    session->deadline = trans->has_unacked_block() ? Clock::now() + trans->retransmit_timeout()
+                                                                   : Clock::time_point::max();
+                } else if (trans->fast_retransmit()) {
+                    // back to the gap, blocks still waiting to be paced are stale
+                    tftp::log::debug("fast retransmit ", session->endpoint, " block ", ack->block());
+                    scheduler_.cancel(session.get());
+                    session->deadline = Clock::now() + trans->retransmit_timeout();
+                }
+            } else if (std::holds_alternative<tftp::ErrorResponse>(message->packet)) {
+                set_peer_error(session, *message);
+                co_return;
+            } else {
+                // hashes that came after the oack, the blocks not read yet still gain
+                add_hashes(session, *message);
+            }
+        }
+
+        session->result.success = true;
+        if (!trans->has_checksum_option())
+            co_return;
+
+        // announce the digest of the whole file to the receiver, and again
+        // when the last ack shows up once more because the digest got lost.
+        // The receiver acks every duplicate of the last window, so answer
+        // once per retransmission timeout and not to each of those acks.
+        tftp::OptionAckMessage::Options digest;
+        digest["checksum"] = trans->checksum();
+        auto packet = tftp::OptionAckMessage::serialize(digest);
+        co_await send_packet(session, packet);
+        auto digest_sended = Clock::now();
+
+        session->is_dallying = true;
+        while (auto message = co_await receive(session, Clock::now() + session->timeout)) {
+            if (auto ack = std::get_if<tftp::AckMessage>(&message->packet)) {
+                trans->confirm_ack(ack->block());
+                if (Clock::now() - digest_sended >= trans->retransmit_timeout()) {
+                    co_await send_packet(session, packet);
+                    digest_sended = Clock::now();
+                }
+            } else if (auto oack = std::get_if<tftp::OptionAckMessage>(&message->packet)) {
+                // the receiver echoes the digest once it matched
+                if (oack->options().at("checksum") == trans->checksum()) {
+                    session->result.checksum_verified = true;
+                    co_return;
+                }
+            } else if (std::holds_alternative<tftp::ErrorResponse>(message->packet)) {
+                // the receiver rejected the digest
+                session->result.success = false;
+                set_peer_error(session, *message);
+                co_return;
+            }
+        }
+    }
+
+    // receive blocks until the last one, the latest reply is resent whenever the sender is silent
+    awaitable<void> receive_blocks(SessionPtr session, tftp::Buffer reply, std::optional<Message> message) {
+        auto trans = session->recv.get();
+
+        if (!reply.empty())
+            co_await send_packet(session, reply);
+
+        size_t retries = 0;
+        for (;;) {
+            if (!message) {
+                message = co_await receive(session, Clock::now() + session->timeout);
             }
 
-            recv_trans_map_[endpoint] = trans;
-            pre_recv_trans_map_.erase(endpoint.address());
-            pre_recv_options_map_.erase(endpoint.address());
-
-            auto packet = tftp::OptionAckMessage::serialize(request_options);
-            socket_data_.async_send_to(
-                boost::asio::buffer(packet), endpoint,
-                [this, endpoint](boost::system::error_code e, std::size_t bytes_recvd) {
-                    if (e) {
-                        delete send_trans_map_[endpoint];
-                        send_trans_map_.erase(endpoint);
+            if (!message) {
+                // the last block is acked, nothing more to come
+                if (session->is_dallying)
+                    co_return;
+
+                if (++retries > tftp::max_retransmit) {
+                    tftp::log::warn("transaction timeout ", session->endpoint);
+                    session->result.error = "timeout";
+                    co_return;
+                }
+                if (!reply.empty())
+                    co_await send_packet(session, reply);
+                continue;
+            }
+            retries = 0;
+
+            if (auto data = std::get_if<tftp::DataMessage>(&message->packet)) {
+                tftp::log::trace("receive: [data] block:", data->block());
+                if (trans->is_local() && data->block() == trans->next_block())
+                    co_await copy_local_file(session);
+                if (trans->receive_data(*data)) {
+                    if (trans->is_finished() && trans->is_delta()) {
+                        auto finish = [session]() { session->recv->end_delta(); };
+                        co_await on_worker(finish);
+                    }
+                    if (trans->is_commit_pending())
+                        co_await commit_received(session);
+                    if (trans->is_sink_failed()) {
+                        session->result.error = "cannot store data";
+                        auto packet = tftp::ErrorResponse::serialize(3, "Disk full or allocation exceeded.");
+                        co_await send_packet(session, packet);
+                        co_return;
+                    }
+
+                    // the last block is acked too, so the sender knows the transfer is over
+                    reply = tftp::AckMessage::serialize(trans->next_block());
+                    co_await send_packet(session, reply);
+
+                    // without option "checksum" only linger for a retransmitted last block
+                    if (trans->is_finished() && !trans->has_checksum_option()) {
+                        session->result.success = true;
+                        session->is_dallying = true;
+                        report_result(session);
+                    }
+                } else if (trans->is_illegal()) {
+                    session->result.error = "illegal block";
+                    auto packet = tftp::ErrorResponse::serialize(4, "Illegal TFTP operation.");
+                    co_await send_packet(session, packet);
+                    co_return;
+                } else {
+                    // our ack got lost or the sender timed out, or a block in
+                    // front of this one got lost: ack the expected one again
+                    co_await send_packet(session, tftp::AckMessage::serialize(trans->next_block()));
+                }
+            } else if (auto oack = std::get_if<tftp::OptionAckMessage>(&message->packet)) {
+                // digest announced by the sender after the last block
+                auto &reply_options = oack->options();
+                if (trans->is_finished() && trans->has_checksum_option() && reply_options.count("checksum")) {
+                    bool verified = trans->verify_checksum(reply_options.at("checksum"));
+                    if (verified)
+                        co_await commit_received(session);
+                    if (!verified) {
+                        tftp::log::warn("checksum mismatch ", trans->name());
+                        session->result.error = "checksum mismatch";
+                        auto packet = tftp::ErrorResponse::serialize(0, "checksum mismatch");
+                        co_await send_packet(session, packet);
+                    } else if (trans->is_sink_failed()) {
+                        // verified, but it could not be committed
+                        session->result.error = "cannot store data";
+                        auto packet = tftp::ErrorResponse::serialize(3, "Disk full or allocation exceeded.");
+                        co_await send_packet(session, packet);
                     } else {
-                        auto trans = send_trans_map_.at(endpoint);
-                        trans->confirm_sended();
+                        tftp::log::info("checksum verified ", trans->name());
+                        session->result.success = true;
+                        session->result.checksum_verified = true;
+                        co_await send_packet(session, tftp::OptionAckMessage::serialize(reply_options));
                     }
-                });
+                    co_return;
+                }
+            } else if (std::holds_alternative<tftp::ErrorResponse>(message->packet)) {
+                set_peer_error(session, *message);
+                co_return;
+            }
+
+            message.reset();
         }
-        start_receive_data();
     }
 };
 
-#endif
\ No newline at end of file
+#endif
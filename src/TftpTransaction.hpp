@@ -2,10 +2,18 @@
 #define TFTP_TRANSACTION_HPP
 
 #include <boost/asio.hpp>
+#include <algorithm>
 #include <chrono>
-#include <fstream>
-#include <iostream>
-
+#include <deque>
+#include <limits>
+
+#include "Clock.hpp"
+#include "CongestionControl.hpp"
+#include "Crc32c.hpp"
+#include "Log.hpp"
+#include "DataStream.hpp"
+#include "LocalFile.hpp"
+#include "Netascii.hpp"
 #include "SpeedMonitor.hpp"
 #include "TftpMessage.hpp"
 
@@ -14,46 +22,193 @@ namespace tftp {
 
 class SendTransaction {
 public:
-    SendTransaction(std::string filename) {
-        filename_ = filename;
-        file_.open(filename, std::ios::in | std::ios::binary | std::ios::ate);
-        size_ = file_.tellg();
-        file_.seekg(0, std::ios::beg);
+    using Clock = tftp::Clock;
 
-        block_number_ = size_ / block_size_ + 1;
-        last_block_size_ = size_ % block_size_;
-    }
+    SendTransaction(std::unique_ptr<DataSource> source)
+        : source_(std::move(source)) {}
 
-    ~SendTransaction() {
-        file_.close();
+    // size of the data to send, unknown for pipes and generators
+    std::optional<size_t> size() {
+        return source_->size();
     }
 
     bool is_finished() {
         return is_finished_;
     }
 
+    // return true if the ack confirms new blocks. Duplicated and stale acks are
+    // only counted, resending on them would start the Sorcerer's Apprentice
+    // syndrome (RFC 1123 4.2.3.1) and double every block from then on. A run
+    // of them may report a gap instead, see fast_retransmit.
     bool confirm_ack(uint16_t block) {
-        if (block_number_ == block_sended_ && block == block_sended_) {
+        // an ack carries the number of the next expected block, widen it to an index
+        size_t acked = block_acked_ + (uint16_t)(block - (uint16_t)block_acked_);
+        if (acked == block_acked_) {
+            duplicate_acks_ += 1;
+            // the receiver acks block 0 again while it copies the file
+            if (is_local_)
+                retries_ = 0;
+            else if (!unacked_.empty())
+                gap_acks_ += 1;
+            return false;
+        }
+        // older than the last one, or for blocks never sent
+        if (acked > block_acked_ + unacked_.size()) {
+            stale_acks_ += 1;
+            return false;
+        }
+
+        // karn's algorithm, retransmitted blocks give no rtt sample
+        auto &newest = unacked_[acked - block_acked_ - 1];
+        if (!newest.retransmitted && newest.sended != Clock::time_point())
+            congestion_control_.on_rtt_sample(Clock::now() - newest.sended);
+        congestion_control_.on_ack(acked - block_acked_);
+
+        for (size_t i = 0; i < acked - block_acked_; i++)
+            bytes_acked_ += unacked_[i].datagram->size() - data_header_size - (is_delta_ ? delta_index_size : 0);
+        unacked_.erase(unacked_.begin(), unacked_.begin() + (acked - block_acked_));
+        block_acked_ = acked;
+        block_next_ = std::max(block_next_, block_acked_);
+        retries_ = 0;
+        gap_acks_ = 0;
+        is_gap_resent_ = false;
+
+        if (block_acked_ == block_number_) {
             is_finished_ = true;
+            // the receiver copied the whole file, not just the empty block 0
+            if (is_local_)
+                bytes_acked_ = size().value_or(0);
         }
-        return block == block_sended_;
+        return true;
+    }
+
+    // return true if the window allows to send another block, and its data is there
+    bool has_next_block() {
+        return has_room() && (block_next_ - block_acked_ < unacked_.size() ||
+                              (is_sending_changed() ? changed_ != nullptr : is_source_ready()));
     }
 
-    Buffer get_next_block() {
-        Buffer buffer;
-        if (block_sended_ < block_number_ - 1) {
-            buffer.resize(block_size_);
-            file_.read((char *)buffer.data(), block_size_);
+    // Option "delta": the window has room for a new block, but the next one
+    // the receiver doesn't have is still to be found, see scan_changed_blocks.
+    bool is_scanning() {
+        return is_sending_changed() && !changed_ && has_room() && block_next_ - block_acked_ >= unacked_.size();
+    }
+
+    // Option "delta": read on past the blocks the receiver has, at most
+    // delta_scan_size bytes of them per call, so a long unchanged run doesn't
+    // hold up the other sessions of the io thread. Every block goes into the
+    // digest, the receiver hashes the whole file. The last block is always
+    // sent, its size tells where the file ends. Return true once the next
+    // block to send is found, it goes out with get_next_block.
+    bool scan_changed_blocks() {
+        for (size_t scanned = 0; !changed_ && scanned < delta_scan_size;) {
+            auto datagram = std::make_shared<Buffer>(data_header_size + delta_index_size);
+            read_block(*datagram, data_size());
+            auto block = datagram->data() + data_header_size + delta_index_size;
+            size_t size = datagram->size() - data_header_size - delta_index_size;
+            size_t index = delta_index_++;
+            scanned += data_size();
+            if (has_checksum_option_)
+                checksum_.update(block, size);
+
+            Crc32c crc;
+            crc.update(block, size);
+            if (size < data_size() || index >= hashes_.size() || !has_hash_[index] || crc.value() != hashes_[index]) {
+                uint8_t *header = datagram->data() + data_header_size;
+                header[0] = index >> 24;
+                header[1] = index >> 16;
+                header[2] = index >> 8;
+                header[3] = index;
+                changed_ = std::move(datagram);
+            } else {
+                skipped_blocks_ += 1;
+            }
+        }
+        return changed_ != nullptr;
+    }
+
+    // notify is called from any thread once a source that was short of data got more
+    void on_source_available(std::function<void()> notify) {
+        source_->on_available(std::move(notify));
+    }
+
+    uint16_t next_block() {
+        return (uint16_t)block_next_;
+    }
+
+    // The DATA datagram of the next block, header included. The block is read
+    // in behind the header and sent as it is, retransmissions too.
+    std::shared_ptr<const Buffer> get_next_block() {
+        size_t index = block_next_ - block_acked_;
+        block_next_ += 1;
+
+        // went back after a gap or a timeout, the block is still in memory
+        if (index < unacked_.size()) {
+            unacked_[index].retransmitted = true;
+            retransmissions_ += 1;
+            return unacked_[index].datagram;
+        }
+
+        // a short block ends the transfer, the number of blocks is only known
+        // once the file is read through. A block of option "delta" was read
+        // ahead by scan_changed_blocks.
+        auto datagram = is_sending_changed() ? std::move(changed_) : std::make_shared<Buffer>(data_header_size);
+        size_t size = 0;
+        if (is_local_) {
+            // the receiver copies the file itself, the empty block 0 is all there is
+        } else if (is_delta_) {
+            size = datagram->size() - data_header_size - delta_index_size;
         } else {
-            buffer.resize(last_block_size_);
-            file_.read((char *)buffer.data(), last_block_size_);
+            read_block(*datagram, block_size_);
+            size = datagram->size() - data_header_size;
+            if (has_checksum_option_)
+                checksum_.update(datagram->data() + data_header_size, size);
         }
-        return buffer;
+        if (size < data_size())
+            block_number_ = block_next_;
+        DataMessage::serialize_header((uint16_t)(block_next_ - 1), *datagram);
+
+        unacked_.push_back({datagram, Clock::time_point(), false});
+        return datagram;
     }
 
-    void confirm_sended() {
+    void confirm_sended(uint16_t block) {
         speed_monitor.tick();
-        block_sended_ += 1;
+
+        size_t index = (uint16_t)(block - (uint16_t)block_acked_);
+        if (index < unacked_.size())
+            unacked_[index].sended = Clock::now();
+    }
+
+    bool has_unacked_block() {
+        return block_next_ > block_acked_;
+    }
+
+    Clock::duration retransmit_timeout() {
+        return congestion_control_.rto();
+    }
+
+    // The receiver drops the blocks past a lost one and acks the block in
+    // front of the gap again for each of them. After fast_retransmit_acks of
+    // those go back to the gap and halve the window, without waiting for the
+    // timeout; a small window has fewer blocks past the gap to tell, two are
+    // enough then (RFC 5827). Once per gap: the acks of the blocks still in
+    // flight past it report the same loss again until the gap is filled.
+    bool fast_retransmit() {
+        size_t threshold = std::clamp<size_t>(unacked_.size() - 1, 2, fast_retransmit_acks);
+        if (gap_acks_ < threshold || is_gap_resent_)
+            return false;
+        is_gap_resent_ = true;
+        congestion_control_.on_fast_retransmit();
+        block_next_ = block_acked_;
+        return true;
+    }
+
+    // go back to the oldest unacked block, return false once the peer seems gone
+    bool timeout() {
+        congestion_control_.on_timeout();
+        block_next_ = block_acked_;
+        return ++retries_ <= tftp::max_retransmit;
     }
 
     // return send speed, unit bytes/s
@@ -61,68 +216,313 @@ public:
         return block_size_ * speed_monitor.speed();
     }
 
+    // bytes confirmed by the receiver, as sent on the wire
+    size_t bytes_transferred() {
+        return bytes_acked_;
+    }
+
+    size_t retransmissions() {
+        return retransmissions_;
+    }
+
+    size_t duplicate_acks() {
+        return duplicate_acks_;
+    }
+
+    size_t stale_acks() {
+        return stale_acks_;
+    }
+
+    // blocks the receiver had already, option "delta"
+    size_t skipped_blocks() {
+        return skipped_blocks_;
+    }
+
     bool set_option_blksize(uint16_t blksize) {
         if (blksize <= tftp::max_block_size && blksize >= tftp::min_block_size) {
             has_blksize_option_ = true;
             block_size_ = blksize;
+            return true;
+        } else {
+            return false;
+        }
+    }
 
-            block_number_ = size_ / block_size_ + 1;
-            last_block_size_ = size_ % block_size_;
+    bool set_option_windowsize(uint16_t windowsize) {
+        if (windowsize >= tftp::min_window_size && windowsize <= tftp::max_window_size) {
+            has_windowsize_option_ = true;
+            congestion_control_.set_max_window(windowsize);
             return true;
         } else {
             return false;
         }
     }
 
+    // seconds until the first retransmission, later ones follow the measured rtt
+    bool set_option_timeout(unsigned timeout) {
+        if (timeout < 1 || timeout > 255)
+            return false;
+        congestion_control_.set_initial_rto(std::chrono::seconds(timeout));
+        return true;
+    }
+
+    bool set_option_checksum(const std::string &algorithm) {
+        has_checksum_option_ = (algorithm == tftp::checksum_crc32c);
+        return has_checksum_option_;
+    }
+
+    bool has_checksum_option() {
+        return has_checksum_option_;
+    }
+
+    // Option "delta", after "blksize" and "checksum": the receiver sent the
+    // hashes of the blocks it has, those that still match aren't sent. A
+    // block that changed but kept its crc32c would be skipped too, which only
+    // the digest of the whole file can tell, so it goes with "checksum". The
+    // index of each block goes in front of its data, within the block size.
+    bool set_option_delta(const std::string &algorithm) {
+        if (algorithm != tftp::checksum_crc32c || !has_checksum_option_ || mode_ != Mode::octet || !size() ||
+            *size() / delta_data_size(block_size_) > UINT32_MAX)
+            return false;
+        is_delta_ = true;
+        return true;
+    }
+
+    // the file a receiver on the same host may copy itself, see option "local"
+    std::optional<LocalFile> local_file() {
+        if (mode_ != Mode::octet)
+            return std::nullopt;
+        return LocalFile::of(source_->file_descriptor());
+    }
+
+    // Option "local": the receiver copies the file from our descriptor, block
+    // 0 goes empty and its ack ends the transfer. The data never leaves the
+    // host, there is no digest to compare.
+    bool set_option_local() {
+        if (!local_file())
+            return false;
+        is_local_ = true;
+        has_checksum_option_ = false;
+        return true;
+    }
+
+    bool is_local() {
+        return is_local_;
+    }
+
+    // hashes may arrive ahead of the oack, before the block size is settled
+    void add_hashes(size_t first, const std::vector<uint32_t> &hashes) {
+        size_t limit = size().value_or(0) / delta_data_size(tftp::min_block_size);
+        if (first >= limit || hashes.size() > limit - first)
+            return;
+        if (hashes_.size() < first + hashes.size()) {
+            hashes_.resize(first + hashes.size());
+            has_hash_.resize(first + hashes.size());
+        }
+        std::copy(hashes.begin(), hashes.end(), hashes_.begin() + first);
+        std::fill_n(has_hash_.begin() + first, hashes.size(), true);
+    }
+
+    // netascii is translated while reading, blocks always carry wire data
+    void set_mode(Mode mode) {
+        mode_ = mode;
+    }
+
+    // digest of every block handed out by get_next_block
+    std::string checksum() {
+        return checksum_.hex_digest();
+    }
+
 private:
-    std::string filename_;
-    std::fstream file_;
+    struct Block {
+        std::shared_ptr<const Buffer> datagram;
+        Clock::time_point sended;
+        bool retransmitted;
+    };
+
+    std::unique_ptr<DataSource> source_;
+    bool is_source_end_ = false;
+    Mode mode_ = default_mode;
+
+    // netascii output not handed out yet, starts at encoded_offset_
+    NetasciiEncoder encoder_;
+    Buffer encoded_;
+    size_t encoded_offset_ = 0;
 
     bool is_finished_ = false;
 
-    size_t size_;
-    size_t last_block_size_;
-    uint16_t block_number_;
-    uint16_t block_sended_ = 0;
+    // unknown until the last block was read
+    size_t block_number_ = std::numeric_limits<size_t>::max();
+    size_t bytes_acked_ = 0;
+
+    // blocks in [block_acked_, block_next_) are outstanding, unacked_ holds
+    // every block read from file but not acked yet
+    size_t block_acked_ = 0;
+    size_t block_next_ = 0;
+    std::deque<Block> unacked_;
+    size_t retries_ = 0;
+    size_t retransmissions_ = 0;
+    size_t duplicate_acks_ = 0;
+
+    // acks of the block in front of a gap since the last new one, and
+    // whether the blocks from the gap on went out again for them
+    size_t gap_acks_ = 0;
+    bool is_gap_resent_ = false;
+
+    // like TCP, one or two may just be reordered or duplicated by the network
+    static constexpr size_t fast_retransmit_acks = 3;
+    size_t stale_acks_ = 0;
 
     SpeedMonitor speed_monitor;
+    CongestionControl congestion_control_;
+
+    // for option "delta", the hashes of the receiver by block index
+    bool is_delta_ = false;
+    std::vector<uint32_t> hashes_;
+    std::vector<bool> has_hash_;
+    size_t delta_index_ = 0;  // of the next block read
+    size_t skipped_blocks_ = 0;
+    std::shared_ptr<Buffer> changed_;  // the next block to send, read ahead by scan_changed_blocks
+
+    static const size_t delta_scan_size = 1 << 20;
+
+    // for option "local"
+    bool is_local_ = false;
+
+    static const size_t read_chunk_size = 64 * 1024;
+
+    // the window allows another block, unless the last one went out already
+    bool has_room() {
+        return block_next_ < block_number_ && block_next_ - block_acked_ < congestion_control_.window();
+    }
+
+    // option "delta" picks the blocks to send, unless "local" leaves none
+    bool is_sending_changed() {
+        return is_delta_ && !is_local_;
+    }
+
+    // the next block can be read without waiting for the producer of the source
+    bool is_source_ready() {
+        if (is_source_end_)
+            return true;
+        if (mode_ != Mode::netascii)
+            return source_->available() >= block_size_;
+        // a single chunk encodes to at least a block
+        return encoded_.size() - encoded_offset_ >= block_size_ || source_->available() >= read_chunk_size;
+    }
+
+    size_t read_source(uint8_t *data, size_t size) {
+        size_t n = source_->read(data, size);
+        is_source_end_ = n < size;
+        return n;
+    }
+
+    // the file data a whole block carries, a shorter one is the last
+    size_t data_size() {
+        return is_delta_ ? delta_data_size(block_size_) : block_size_;
+    }
+
+    // append the next size bytes of the transfer to the buffer, less at the end
+    void read_block(Buffer &buffer, size_t size) {
+        size_t offset = buffer.size();
+        if (mode_ != Mode::netascii) {
+            buffer.resize(offset + size);
+            buffer.resize(offset + read_source(buffer.data() + offset, size));
+            return;
+        }
+
+        // encode the data chunk by chunk, a line end may straddle two blocks
+        Buffer chunk;
+        while (encoded_.size() - encoded_offset_ < size && !is_source_end_) {
+            encoded_.erase(encoded_.begin(), encoded_.begin() + encoded_offset_);
+            encoded_offset_ = 0;
+
+            chunk.resize(read_chunk_size);
+            encoder_.encode(chunk.data(), read_source(chunk.data(), chunk.size()), encoded_);
+        }
+
+        size = std::min<size_t>(size, encoded_.size() - encoded_offset_);
+        buffer.insert(buffer.end(), encoded_.begin() + encoded_offset_, encoded_.begin() + encoded_offset_ + size);
+        encoded_offset_ += size;
+    }
 
     // for option "blksize"
     bool has_blksize_option_ = false;
     uint16_t block_size_ = tftp::block_size;
+
+    // for option "windowsize"
+    bool has_windowsize_option_ = false;
+
+    // for option "checksum"
+    bool has_checksum_option_ = false;
+    Crc32c checksum_;
 };
 
 class RecvTransaction {
 public:
-    RecvTransaction(std::string filename) {
-        filename_ = filename;
-        file_.open(filename, std::ios::out | std::ios::binary);
-    }
+    // the name only shows up in messages
+    RecvTransaction(std::string name, std::unique_ptr<DataSink> sink)
+        : name_(std::move(name)), sink_(std::move(sink)) {}
 
-    RecvTransaction(std::string filename, size_t size) {
-        filename_ = filename;
-        file_.open(filename, std::ios::out | std::ios::binary);
+    const std::string &name() {
+        return name_;
     }
 
-    ~RecvTransaction() {
-        file_.close();
+    // the sink refused data, the transfer can't succeed anymore
+    bool is_sink_failed() {
+        return is_sink_failed_;
     }
 
     bool is_finished() {
         return is_finished_;
     }
 
+    uint16_t next_block() {
+        return block_received_;
+    }
+
+    // return true if the block was received before, its ack may have been lost
+    bool is_duplicate(uint16_t block) {
+        return (uint16_t)(block_received_ - block - 1) < 0x8000;
+    }
+
     bool receive_data(tftp::DataMessage &data) {
         speed_monitor.tick();
 
         auto block = data.block();
         if (block != block_received_) {
+            // blocks ahead of the expected one were sent after a lost block,
+            // the ack of the expected one again tells the sender to go back
+            if (is_duplicate(block))
+                duplicate_blocks_ += 1;
+            else
+                stale_blocks_ += 1;
             return false;
+        } else if (is_local_) {
+            // copy_local_file did the work, the empty block 0 only ends the transfer
+            is_finished_ = true;
+            block_received_ += 1;
+            return true;
+        } else if (is_delta_) {
+            if (!receive_changed_block(data.data()))
+                return false;
+            block_received_ += 1;
+            return true;
         } else {
-            file_.write((char *)data.data().data(), data.data().size());
-            std::cout<<data.data().size()<<std::endl;
+            write_block(data.data());
+            bytes_received_ += data.data().size();
+            if (has_checksum_option_)
+                checksum_.update(data.data().data(), data.data().size());
+            tftp::log::trace("receive block ", block, " size ", data.data().size());
             if (data.data().size() < block_size_) {
                 is_finished_ = true;
+                if (mode_ == Mode::netascii) {
+                    decoded_.clear();
+                    decoder_.finish(decoded_);
+                    is_sink_failed_ |= !sink_->write(decoded_.data(), decoded_.size());
+                }
+                // with a checksum the data is only committed once it matched
+                is_commit_pending_ = !has_checksum_option_;
             }
 
             block_received_ += 1;
@@ -135,6 +535,19 @@ public:
         return block_size_ * speed_monitor.speed();
     }
 
+    size_t bytes_transferred() {
+        return bytes_received_;
+    }
+
+    size_t duplicate_blocks() {
+        return duplicate_blocks_;
+    }
+
+    // out of order, received before a missing block
+    size_t stale_blocks() {
+        return stale_blocks_;
+    }
+
     bool set_option_tsize(size_t size) {
         has_size_option_ = true;
         size_ = size;
@@ -151,12 +564,216 @@ public:
         }
     }
 
+    // every block is acked, the window only limits the sender
+    bool set_option_windowsize(uint16_t windowsize) {
+        if (windowsize >= tftp::min_window_size && windowsize <= tftp::max_window_size) {
+            has_windowsize_option_ = true;
+            return true;
+        } else {
+            return false;
+        }
+    }
+
+    // the sender retransmits, the wait for it is up to the session
+    bool set_option_timeout(unsigned timeout) {
+        return timeout >= 1 && timeout <= 255;
+    }
+
+    bool set_option_checksum(const std::string &algorithm) {
+        has_checksum_option_ = (algorithm == tftp::checksum_crc32c);
+        return has_checksum_option_;
+    }
+
+    bool has_checksum_option() {
+        return has_checksum_option_;
+    }
+
+    // the data is one stripe of a file, the sink places it at the offset
+    bool set_option_range(const ByteRange &range) {
+        return sink_->set_range(range);
+    }
+
+    // the sink has data from before that a transfer with option "delta" can update
+    bool can_update() {
+        return mode_ == Mode::octet && sink_->previous_size().value_or(0) > 0;
+    }
+
+    // Option "delta", after "tsize", "blksize" and "checksum": the sender
+    // skips the blocks the sink has unchanged, hash_previous must follow.
+    // Only the digest of the whole file tells a block that changed but kept
+    // its crc32c, so it goes with "checksum". The size is what the indices
+    // of the blocks are checked against. Nothing to gain without data from
+    // before.
+    bool set_option_delta(const std::string &algorithm) {
+        if (algorithm != tftp::checksum_crc32c || !has_checksum_option_ || !has_size_option_ || !can_update())
+            return false;
+        is_delta_ = true;
+        return true;
+    }
+
+    // Hash the blocks the sink has, for option "delta". Runs on a worker
+    // thread, nothing else may touch the transaction until it returns. Turns
+    // the option off again if the sink can't do it.
+    void hash_previous() {
+        auto hashes = sink_->begin_delta(delta_data_size(block_size_));
+        if (hashes && hashes->size() <= UINT32_MAX)
+            hashes_ = std::move(*hashes);
+        else
+            is_delta_ = false;
+    }
+
+    // Option "delta": the last block arrived, the unchanged blocks join the
+    // new ones and the whole file is hashed. Runs on a worker thread too.
+    void end_delta() {
+        if (!is_sink_failed_)
+            is_sink_failed_ = !sink_->end_delta(size_, checksum_);
+    }
+
+    bool is_delta() {
+        return is_delta_;
+    }
+
+    // Option "local", after "tsize": the file of a sender on the same host,
+    // copied straight from its descriptor once the empty block 0 arrives.
+    // There is no digest to compare, the copy never leaves the host.
+    bool set_option_local(const std::string &value) {
+        auto local = LocalFile::parse(value);
+        if (!local || mode_ != Mode::octet || !has_size_option_)
+            return false;
+        auto file = local->open();
+        struct stat st;
+        if (!file || ::fstat(file->fd(), &st) != 0 || (size_t)st.st_size != size_)
+            return false;
+        local_file_ = std::move(file);
+        is_local_ = true;
+        has_checksum_option_ = false;
+        return true;
+    }
+
+    bool is_local() {
+        return is_local_;
+    }
+
+    // Option "local": copy the file of the sender into the sink and commit
+    // it, before block 0 is received. Runs on a worker thread, nothing else
+    // may touch the transaction until it returns.
+    void copy_local_file() {
+        is_sink_failed_ = !sink_->copy_from(local_file_->fd(), size_);
+        if (!is_sink_failed_) {
+            bytes_received_ = size_;
+            commit();
+        }
+        tftp::log::debug("copied ", bytes_received_, " bytes of ", name_, " from the sender");
+    }
+
+    // a sender broke the protocol, e.g. a block of option "delta" out of place
+    bool is_illegal() {
+        return is_illegal_;
+    }
+
+    // crc32c of each whole block the sink had, by index
+    const std::vector<uint32_t> &delta_hashes() {
+        return hashes_;
+    }
+
+    uint16_t block_size() {
+        return block_size_;
+    }
+
+    // digest of every block received so far
+    std::string checksum() {
+        return checksum_.hex_digest();
+    }
+
+    // compare the digest announced by the sender with the received data,
+    // the data is to be committed if it matches
+    bool verify_checksum(const std::string &digest) {
+        if (digest != checksum_.hex_digest())
+            return false;
+        is_commit_pending_ = true;
+        return true;
+    }
+
+    // every block arrived, and matched the digest if there is one
+    bool is_commit_pending() {
+        return is_commit_pending_;
+    }
+
+    // the sink waits for the disk to commit, see commit
+    bool is_commit_blocking() {
+        return sink_->is_finish_blocking();
+    }
+
+    // Commit the data to the sink, made durable and renamed into place by
+    // a file sink. May run on a worker thread, nothing else may touch the
+    // transaction until it returns.
+    void commit() {
+        is_commit_pending_ = false;
+        if (!is_sink_failed_)
+            is_sink_failed_ = !sink_->finish();
+    }
+
+    // netascii blocks are translated back to local text before they are written
+    void set_mode(Mode mode) {
+        mode_ = mode;
+    }
+
 private:
-    std::string filename_;
-    std::fstream file_;
+    std::string name_;
+    std::unique_ptr<DataSink> sink_;
+    bool is_sink_failed_ = false;
+    bool is_illegal_ = false;
+    Mode mode_ = default_mode;
+
+    NetasciiDecoder decoder_;
+    Buffer decoded_;
+    bool is_commit_pending_ = false;
+
+    // A block of option "delta" goes to the offset of its index, the blocks
+    // in between are kept from before. The indices only grow, a whole block
+    // lies within the size announced by "tsize" and the short last one ends
+    // at it. False for any other block, the sender can't be trusted anymore.
+    bool receive_changed_block(const Buffer &data) {
+        size_t unit = delta_data_size(block_size_);
+        if (data.size() < delta_index_size || data.size() - delta_index_size > unit) {
+            is_illegal_ = true;
+            return false;
+        }
+        size_t index = ((size_t)data[0] << 24) | ((size_t)data[1] << 16) | ((size_t)data[2] << 8) | data[3];
+        size_t size = data.size() - delta_index_size;
+        bool is_last = size < unit;
+        if (index < delta_index_ || (is_last ? index * unit + size != size_ : index >= size_ / unit)) {
+            tftp::log::warn("block index ", index, " size ", size, " out of place in ", name_);
+            is_illegal_ = true;
+            return false;
+        }
+        delta_index_ = index + 1;
+
+        is_sink_failed_ |= !sink_->write_at(index * unit, data.data() + delta_index_size, size);
+        bytes_received_ += size;
+        tftp::log::trace("receive block index ", index, " size ", size);
+
+        // the digest is taken of the whole result by end_delta
+        if (is_last)
+            is_finished_ = true;
+        return true;
+    }
+
+    void write_block(const Buffer &data) {
+        if (mode_ != Mode::netascii) {
+            is_sink_failed_ |= !sink_->write(data.data(), data.size());
+            return;
+        }
+        decoded_.clear();
+        decoder_.decode(data.data(), data.size(), decoded_);
+        is_sink_failed_ |= !sink_->write(decoded_.data(), decoded_.size());
+    }
 
     bool is_finished_ = false;
     uint16_t block_received_ = 0;
+    size_t bytes_received_ = 0;
+    size_t duplicate_blocks_ = 0;
+    size_t stale_blocks_ = 0;
 
     SpeedMonitor speed_monitor;
 
@@ -167,6 +784,22 @@ private:
     // for option "blksize"
     bool has_blksize_option_ = false;
     uint16_t block_size_ = tftp::block_size;
+
+    // for option "windowsize"
+    bool has_windowsize_option_ = false;
+
+    // for option "checksum"
+    bool has_checksum_option_ = false;
+    Crc32c checksum_;
+
+    // for option "delta"
+    bool is_delta_ = false;
+    std::vector<uint32_t> hashes_;
+    size_t delta_index_ = 0;  // the least the next block may have
+
+    // for option "local", the file of the sender
+    bool is_local_ = false;
+    std::shared_ptr<FileHandle> local_file_;
 };
 }  // namespace tftp
 
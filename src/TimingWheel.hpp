@@ -0,0 +1,275 @@
+#ifndef TIMING_WHEEL_HPP
+#define TIMING_WHEEL_HPP
+
+#include <utility>
+
+#include <array>
+#include <boost/asio.hpp>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
+#include "Clock.hpp"
+
+namespace tftp {
+
+// The deadlines of every transaction of an io_context: retransmissions, idle
+// timeouts, pacing. A steady_timer per transaction costs a heap operation in
+// the timer queue of asio each time an ack moves its deadline, here arming,
+// moving and cancelling a deadline is O(1). Deadlines are kept in a
+// hierarchical timing wheel of 4 levels with 256 slots each, the lowest
+// level has a slot per tick of 1ms, each level above covers 256 slots of the
+// one below and is cascaded into it when the ticks reach it. The whole wheel
+// is driven by a single steady_timer, armed for the next tick with work to do.
+//
+// One wheel per io_context, created on first use.
+class TimingWheel : public boost::asio::execution_context::service {
+public:
+    using Clock = tftp::Clock;
+
+    static inline boost::asio::execution_context::id id;
+
+    static constexpr Clock::duration tick = std::chrono::milliseconds(1);
+
+    class Timer;
+
+    explicit TimingWheel(boost::asio::io_context &io_context)
+        : boost::asio::execution_context::service(io_context),
+          timer_(io_context),
+          origin_(Clock::now()) {}
+
+    // armed timers
+    size_t size() const {
+        return size_;
+    }
+
+    // when the steady_timer wakes up the wheel next, max while nothing is armed
+    Clock::time_point next_wakeup() const {
+        return wakeup_ == UINT64_MAX ? Clock::time_point::max() : origin_ + (int64_t)wakeup_ * tick;
+    }
+
+    // run the callbacks due by now. The steady_timer does it, on a virtual
+    // clock whoever moves the clock does it at next_wakeup().
+    void poll() {
+        wakeup_ = UINT64_MAX;
+        advance(current_tick());
+        arm_next();
+    }
+
+private:
+    static const unsigned slot_bits = 8;
+    static const uint64_t slots = 1 << slot_bits;
+    static const unsigned levels = 4;
+
+    // the head of a circular list of timers
+    struct Slot {
+        Timer *head = nullptr;
+    };
+
+public:
+    // A deadline, the callback runs on the io_context once it has passed,
+    // never earlier, rounded up to the next tick. The timer must not outlive its
+    // io_context.
+    class Timer {
+    public:
+        Timer(boost::asio::io_context &io_context, std::function<void()> callback)
+            : wheel_(boost::asio::use_service<TimingWheel>(io_context)), callback_(std::move(callback)) {}
+
+        Timer(const Timer &) = delete;
+        Timer &operator=(const Timer &) = delete;
+
+        ~Timer() {
+            cancel();
+        }
+
+        // replaces the previous deadline, max cancels it
+        void expires_at(Clock::time_point deadline) {
+            wheel_.schedule(*this, deadline);
+        }
+
+        void cancel() {
+            if (slot_)
+                wheel_.unlink(*this);
+            deadline_ = Clock::time_point::max();
+        }
+
+        // max unless armed
+        Clock::time_point expiry() const {
+            return deadline_;
+        }
+
+    private:
+        friend class TimingWheel;
+
+        TimingWheel &wheel_;
+        std::function<void()> callback_;
+        Clock::time_point deadline_ = Clock::time_point::max();
+        uint64_t tick_ = 0;
+        Slot *slot_ = nullptr;  // nullptr unless armed
+        Timer *prev_ = nullptr;
+        Timer *next_ = nullptr;
+    };
+
+private:
+    boost::asio::steady_timer timer_;
+    Clock::time_point origin_;
+    uint64_t now_ = 0;              // every tick up to here is done
+    uint64_t wakeup_ = UINT64_MAX;  // the tick the steady_timer is armed for
+    size_t size_ = 0;
+    std::array<std::array<Slot, slots>, levels> wheel_;
+
+    void shutdown() override {
+        // timers destroyed along with the pending handlers must not find the wheel
+        for (auto &level : wheel_) {
+            for (auto &slot : level) {
+                while (slot.head)
+                    unlink(*slot.head);
+            }
+        }
+        timer_.cancel();
+    }
+
+    uint64_t current_tick() const {
+        return (Clock::now() - origin_) / tick;
+    }
+
+    void schedule(Timer &timer, Clock::time_point deadline) {
+        if (timer.slot_)
+            unlink(timer);
+        timer.deadline_ = deadline;
+        if (deadline == Clock::time_point::max())
+            return;
+
+        // an idle wheel skips the ticks that passed meanwhile at once
+        if (size_ == 0)
+            now_ = std::max(now_, current_tick());
+
+        // rounded up, and a deadline already passed is due with the next tick
+        auto since = deadline - origin_;
+        uint64_t tick_due = since <= Clock::duration::zero() ? 0 : (since + tick - Clock::duration(1)) / tick;
+        timer.tick_ = std::max(tick_due, now_ + 1);
+        link(timer);
+        arm(timer.tick_);
+    }
+
+    // the slot of the level whose range covers the distance to the tick, the
+    // top level takes anything further away and hands it down when reached
+    Slot &slot_for(uint64_t tick) {
+        uint64_t delta = tick - now_;
+        unsigned level = 0;
+        while (level + 1 < levels && delta >= (uint64_t(1) << (slot_bits * (level + 1))))
+            level++;
+        if (level == levels - 1 && delta >= (uint64_t(1) << (slot_bits * levels)))
+            tick = now_ + (uint64_t(1) << (slot_bits * levels)) - 1;
+        return wheel_[level][(tick >> (slot_bits * level)) & (slots - 1)];
+    }
+
+    void link(Timer &timer) {
+        auto &slot = slot_for(timer.tick_);
+        timer.slot_ = &slot;
+        if (slot.head) {
+            timer.next_ = slot.head;
+            timer.prev_ = slot.head->prev_;
+            timer.prev_->next_ = &timer;
+            slot.head->prev_ = &timer;
+        } else {
+            timer.prev_ = timer.next_ = &timer;
+            slot.head = &timer;
+        }
+        size_++;
+    }
+
+    void unlink(Timer &timer) {
+        auto &slot = *timer.slot_;
+        if (timer.next_ == &timer) {
+            slot.head = nullptr;
+        } else {
+            timer.prev_->next_ = timer.next_;
+            timer.next_->prev_ = timer.prev_;
+            if (slot.head == &timer)
+                slot.head = timer.next_;
+        }
+        timer.slot_ = nullptr;
+        timer.prev_ = timer.next_ = nullptr;
+        size_--;
+    }
+
+    // take all timers out of a slot, oldest first
+    Timer *take(Slot &slot) {
+        auto head = slot.head;
+        if (!head)
+            return nullptr;
+        head->prev_->next_ = nullptr;
+        slot.head = nullptr;
+        return head;
+    }
+
+    void advance(uint64_t target) {
+        if (size_ == 0) {
+            now_ = std::max(now_, target);
+            return;
+        }
+
+        while (now_ < target) {
+            now_++;
+            // hand the slots reached by now down, the higher levels first
+            for (unsigned level = levels - 1; level > 0; level--) {
+                if ((now_ & ((uint64_t(1) << (slot_bits * level)) - 1)) == 0)
+                    cascade(wheel_[level][(now_ >> (slot_bits * level)) & (slots - 1)]);
+            }
+            expire(wheel_[0][now_ & (slots - 1)]);
+        }
+    }
+
+    void cascade(Slot &slot) {
+        for (auto timer = take(slot); timer;) {
+            auto next = timer->next_;
+            size_--;
+            timer->slot_ = nullptr;
+            timer->prev_ = timer->next_ = nullptr;
+            link(*timer);
+            timer = next;
+        }
+    }
+
+    // the callbacks may arm and cancel any timer, the due ones included
+    void expire(Slot &slot) {
+        while (slot.head) {
+            auto &timer = *slot.head;
+            unlink(timer);
+            timer.deadline_ = Clock::time_point::max();
+            timer.callback_();
+        }
+    }
+
+    // the next slot of the lowest level with timers in it, or the end of the
+    // lowest level, where the level above is cascaded
+    void arm_next() {
+        if (size_ == 0)
+            return;
+        uint64_t end = (now_ | (slots - 1)) + 1;
+        uint64_t next = end;
+        for (uint64_t tick = now_ + 1; tick < end; tick++) {
+            if (wheel_[0][tick & (slots - 1)].head) {
+                next = tick;
+                break;
+            }
+        }
+        arm(next);
+    }
+
+    void arm(uint64_t at) {
+        if (at >= wakeup_)
+            return;
+        wakeup_ = at;
+        timer_.expires_at(origin_ + at * tick);
+        timer_.async_wait([this](boost::system::error_code e) {
+            if (!e)
+                poll();
+        });
+    }
+};
+
+}  // namespace tftp
+
+#endif
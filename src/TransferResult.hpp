@@ -0,0 +1,36 @@
+#ifndef TRANSFER_RESULT_HPP
+#define TRANSFER_RESULT_HPP
+
+#include <chrono>
+#include <string>
+
+namespace tftp {
+
+// Outcome of a transfer started through the async api of TftpPeer.
+struct TransferResult {
+    bool success = false;
+    std::string error;  // why the transfer failed, empty on success
+
+    size_t bytes = 0;  // file data confirmed by the receiver
+    std::chrono::steady_clock::duration elapsed{};
+    size_t retransmissions = 0;  // blocks resent after a timeout, send side only
+
+    // received twice: acks when sending, which are dropped without an answer,
+    // and data when receiving, which is acked again in case the ack got lost
+    size_t duplicates = 0;
+    size_t stale = 0;  // outside the window, e.g. old acks or blocks after a lost one
+    size_t skipped = 0;  // blocks the receiver had already with option "delta", send side only
+
+    std::string checksum;            // crc32c digest, empty without option "checksum"
+    bool checksum_verified = false;  // the digests of both sides matched
+
+    // average speed, unit bytes/s
+    double speed() const {
+        auto seconds = std::chrono::duration<double>(elapsed).count();
+        return seconds > 0 ? bytes / seconds : 0;
+    }
+};
+
+}  // namespace tftp
+
+#endif
@@ -0,0 +1,148 @@
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "ImpairedTransport.hpp"
+#include "Log.hpp"
+#include "Replay.hpp"
+#include "TftpPeer.hpp"
+
+// Transfers between two peers on loopback through an emulated path. A client
+// writes the same file to a server for each loss rate and round trip time,
+// both directions drop and delay their packets, and reports the throughput,
+// the packets lost and the blocks resent for them. Then the round trip of a
+// block in lockstep, window 1, with the data sockets of both peers waiting
+// in the reactor and spinning on receives, each peer on an io thread of its
+// own that spins on a core of its own.
+//
+//     tftp_loss_bench [megabytes] [lockstep blocks]
+namespace {
+
+struct Result {
+    tftp::TransferResult transfer;
+    size_t data_dropped = 0;
+    size_t acks_dropped = 0;
+};
+
+std::unique_ptr<tftp::DatagramTransport> open_transport(io_context &io_context, const tftp::SocketOptions &options) {
+    auto transport = std::make_unique<tftp::UdpTransport>(io_context, udp::endpoint(udp::v6(), 0));
+    transport->set_options(options);
+    return transport;
+}
+
+std::unique_ptr<tftp::ImpairedTransport> impaired(io_context &io_context, std::unique_ptr<tftp::DatagramTransport> next,
+                                                  double loss, std::chrono::milliseconds delay, uint64_t seed) {
+    auto transport = std::make_unique<tftp::ImpairedTransport>(io_context, std::move(next));
+    tftp::Impairment impairment;
+    impairment.drop = loss;
+    impairment.delay = delay;
+    impairment.seed = seed;
+    transport->set_impairment(impairment);
+    return transport;
+}
+
+// half the round trip on the way there, half on the way back
+Result run(const std::string &dir, const tftp::Buffer &file, double loss, std::chrono::milliseconds rtt,
+           const tftp::OptionPolicy &options, const tftp::SocketOptions &socket_options = {}) {
+    // the peers log their sockets and transfers, only the results are printed
+    auto &logger = tftp::log::Logger::instance();
+    logger.set_level(tftp::log::Level::warn);
+
+    io_context server_context, client_context;
+    auto server_work = boost::asio::make_work_guard(server_context);
+    auto client_work = boost::asio::make_work_guard(client_context);
+
+    auto acks = impaired(server_context, open_transport(server_context, socket_options), loss, rtt / 2, 1);
+    auto server_data = acks.get();
+    auto server = std::make_unique<TftpPeer>(server_context, open_transport(server_context, {}), std::move(acks));
+    server->set_root(dir);
+    auto data = impaired(client_context, open_transport(client_context, socket_options), loss, rtt / 2, 2);
+    auto client_data = data.get();
+    auto client = std::make_unique<TftpPeer>(client_context, open_transport(client_context, {}), std::move(data));
+    client->set_negotiation_policy({tftp::NegotiationPolicy::Rule{boost::asio::ip::address_v6(), 0, options}});
+
+    std::thread server_thread([&server_context]() { server_context.run(); });
+    std::thread client_thread([&client_context]() { client_context.run(); });
+
+    udp::endpoint endpoint(boost::asio::ip::address_v6::loopback(), server->local_endpoint().port());
+    Result result;
+    result.transfer = client->async_write(std::make_unique<tftp::MemorySource>(file), "file.bin", endpoint,
+                                          tftp::Mode::octet, boost::asio::use_future)
+                          .get();
+
+    // the stats of a transport are read on its thread
+    result.data_dropped = boost::asio::post(client_context, boost::asio::use_future([client_data]() {
+                              return client_data->stats().dropped;
+                          })).get();
+    result.acks_dropped = boost::asio::post(server_context, boost::asio::use_future([server_data]() {
+                              return server_data->stats().dropped;
+                          })).get();
+
+    server_context.stop();
+    client_context.stop();
+    server_thread.join();
+    client_thread.join();
+    // the peers go first, their coroutines are cleaned up along with the io_contexts
+    client.reset();
+    server.reset();
+    // a file already there would go as a delta the next time
+    std::filesystem::remove(dir + "/file.bin");
+    logger.set_level(tftp::log::Level::info);
+    return result;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    size_t megabytes = argc > 1 ? std::stoul(argv[1]) : 2;
+    size_t lockstep_blocks = argc > 2 ? std::stoul(argv[2]) : 4000;
+
+    tftp::ScratchDirectory dir;
+    tftp::Buffer file(megabytes << 20);
+    std::mt19937 random(31);
+    for (auto &byte : file)
+        byte = random();
+
+    tftp::OptionPolicy windowed;
+    for (double loss : {0.0, 0.01, 0.02, 0.05}) {
+        for (auto rtt : {std::chrono::milliseconds(0), std::chrono::milliseconds(10), std::chrono::milliseconds(40)}) {
+            auto result = run(dir.path(), file, loss, rtt, windowed);
+            auto &transfer = result.transfer;
+            tftp::log::info("loss ", loss * 100, "% rtt ", rtt.count(), " ms: ",
+                            transfer.success ? "" : "failed " + transfer.error + ", ",
+                            std::chrono::duration<double>(transfer.elapsed).count(), " s ",
+                            transfer.speed() / (1 << 20), " MB/s, ", result.data_dropped, " blocks and ",
+                            result.acks_dropped, " acks lost, ", transfer.retransmissions, " blocks resent");
+        }
+    }
+
+    // each block waits for its ack, the time per block is the round trip through both peers
+    tftp::OptionPolicy lockstep;
+    lockstep.blksize = 512;
+    lockstep.window = 1;
+    tftp::Buffer small(lockstep_blocks * lockstep.blksize);
+    for (bool spin : {false, true}) {
+        // two spinning threads on one core take turns by time slice instead
+        auto cores = std::thread::hardware_concurrency();
+        if (spin && cores < 2) {
+            tftp::log::info("spin, window 1: needs a core per peer, ", cores, " here");
+            continue;
+        }
+        tftp::SocketOptions socket_options;
+        socket_options.spin = spin;
+        auto result = run(dir.path(), small, 0, std::chrono::milliseconds(0), lockstep, socket_options);
+        auto &transfer = result.transfer;
+        auto blocks = small.size() / lockstep.blksize + 1;
+        auto us = std::chrono::duration<double, std::micro>(transfer.elapsed).count() / blocks;
+        tftp::log::info(spin ? "spin" : "reactor", ", window 1: ", transfer.success ? "" : "failed " + transfer.error + ", ",
+                        us, " us per block round trip");
+    }
+    tftp::log::Logger::instance().flush();
+    return 0;
+}
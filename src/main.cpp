@@ -1,8 +1,70 @@
+#include <utility>  // asio awaitable uses std::exchange without including it
+
 #include <boost/asio.hpp>
 #include <iostream>
+#include <optional>
+
+#include <pthread.h>
 
+#include "Capture.hpp"
+#include "ImpairedTransport.hpp"
+#include "Replay.hpp"
 #include "TftpPeer.hpp"
 
+// The data sockets of the peer: the shared one, and those it opens for the
+// streams of striped transfers. Each is captured and impaired, see commands
+// "capture" and "impair", and tuned, see "socket". One opened later starts
+// out with the settings of the others. Used on the thread of the io_context.
+struct DataTransports {
+    explicit DataTransports(boost::asio::io_context &io_context)
+        : io_context(io_context) {}
+
+    std::unique_ptr<tftp::DatagramTransport> open() {
+        using boost::asio::ip::udp;
+        auto udp = std::make_unique<tftp::UdpTransport>(io_context, udp::endpoint(udp::v6(), 0));
+        if (options)
+            udp->set_options(*options);
+        sockets.push_back(udp.get());
+        auto capture = std::make_unique<tftp::CaptureTransport>(std::move(udp), tftp::CaptureRecord::Transport::data);
+        capture->set_capture(capture_writer);
+        captures.push_back(capture.get());
+        auto impaired = std::make_unique<tftp::ImpairedTransport>(io_context, std::move(capture));
+        impaired->set_impairment(impairment);
+        impaired_transports.push_back(impaired.get());
+        return impaired;
+    }
+
+    void set_impairment(const tftp::Impairment &value) {
+        impairment = value;
+        for (auto transport : impaired_transports)
+            transport->set_impairment(value);
+    }
+
+    // false if an option was refused by a socket
+    bool set_options(const tftp::SocketOptions &value) {
+        options = value;
+        bool ok = true;
+        for (auto socket : sockets)
+            ok &= socket->set_options(value);
+        return ok;
+    }
+
+    void set_capture(std::shared_ptr<tftp::CaptureWriter> writer) {
+        capture_writer = writer;
+        for (auto transport : captures)
+            transport->set_capture(writer);
+    }
+
+    boost::asio::io_context &io_context;
+    tftp::Impairment impairment;
+    std::optional<tftp::SocketOptions> options;
+    std::shared_ptr<tftp::CaptureWriter> capture_writer;
+    // the first of each is the shared socket, the peer keeps them all as long as it lives
+    std::vector<tftp::UdpTransport *> sockets;
+    std::vector<tftp::CaptureTransport *> captures;
+    std::vector<tftp::ImpairedTransport *> impaired_transports;
+};
+
 int main(int argc, char *argv[]) {
     unsigned short port = tftp::default_port;
     if (argc > 1)
@@ -10,10 +72,24 @@ int main(int argc, char *argv[]) {
 
     try {
         boost::asio::io_context io_context;
-        TftpPeer peer(io_context, port);
+
+        // the data transports can emulate a bad network, see command "impair",
+        // and all record what they receive, see command "capture"
+        using boost::asio::ip::udp;
+        DataTransports data(io_context);
+        auto capture_cmd = std::make_unique<tftp::CaptureTransport>(
+            std::make_unique<tftp::UdpTransport>(io_context, udp::endpoint(udp::v6(), port)),
+            tftp::CaptureRecord::Transport::requests);
+        auto capture_requests = capture_cmd.get();
+        TftpPeer peer(io_context, std::move(capture_cmd), data.open());
+        peer.set_stream_transport([&data]() { return data.open(); });
+        auto socket_data = data.sockets.front();
 
         std::thread t([&io_context]() { io_context.run(); });
 
+        // the file of command "policy", loaded again by "policy reload"
+        std::string policy_path;
+
         std::string line;
         while (std::getline(std::cin, line)) {
             std::istringstream cmd(line);
@@ -22,27 +98,256 @@ int main(int argc, char *argv[]) {
             cmd >> op;
 
             if (op == "send") {
-                std::string filename, dst_ip;
+                std::string filename, dst_ip, mode;
                 uint16_t dst_port;
-                cmd >> filename >> dst_ip >> dst_port;
+                size_t streams = 1;
+                cmd >> filename >> dst_ip >> dst_port >> mode >> streams;
                 boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::make_address_v6(dst_ip), dst_port);
 
-                peer.start_write_transaction(filename, endpoint);
+                peer.start_write_transaction(filename, endpoint, mode == "netascii" ? tftp::Mode::netascii : tftp::default_mode,
+                                             streams);
             } else if (op == "get") {
-                std::string filename, dst_ip;
+                // get <file> <ip> <port> [mode] [streams] [local], local "-" is standard output
+                std::string filename, dst_ip, mode, local;
                 uint16_t dst_port;
-                cmd >> filename >> dst_ip >> dst_port;
+                size_t streams = 1;
+                cmd >> filename >> dst_ip >> dst_port >> mode >> streams >> local;
                 boost::asio::ip::udp::endpoint endpoint(boost::asio::ip::make_address_v6(dst_ip), dst_port);
 
-                peer.start_read_transaction(filename, endpoint);
+                peer.start_read_transaction(filename, endpoint, mode == "netascii" ? tftp::Mode::netascii : tftp::default_mode,
+                                            streams, local);
+            } else if (op == "rate") {
+                std::string scope;
+                double rate;
+                cmd >> scope >> rate;
+
+                if (scope == "global")
+                    peer.set_global_rate(rate);
+                else if (scope == "session")
+                    peer.set_session_rate(rate);
+                else
+                    tftp::log::warn("wrong format");
+            } else if (op == "impair") {
+                // impair [drop p] [duplicate p] [reorder p] [delay ms] [jitter ms] [rate bytes/s] [queue bytes] [seed n], or impair off
+                tftp::Impairment impairment;
+                bool ok = true;
+                std::string key;
+                while (ok && cmd >> key) {
+                    if (key == "off")
+                        continue;
+
+                    double value;
+                    if (!(cmd >> value)) {
+                        ok = false;
+                    } else if (key == "drop") {
+                        impairment.drop = value;
+                    } else if (key == "duplicate") {
+                        impairment.duplicate = value;
+                    } else if (key == "reorder") {
+                        impairment.reorder = value;
+                    } else if (key == "delay") {
+                        impairment.delay = std::chrono::milliseconds((long)value);
+                    } else if (key == "jitter") {
+                        impairment.jitter = std::chrono::milliseconds((long)value);
+                    } else if (key == "rate") {
+                        impairment.rate = value;
+                    } else if (key == "queue") {
+                        impairment.queue_limit = value;
+                    } else if (key == "seed") {
+                        impairment.seed = value;
+                    } else {
+                        ok = false;
+                    }
+                }
+
+                if (ok)
+                    boost::asio::post(io_context, [&data, impairment]() { data.set_impairment(impairment); });
+                else
+                    tftp::log::warn("wrong format");
+            } else if (op == "durability") {
+                // durability none|close|batch <MB> [direct]
+                tftp::Durability durability;
+                std::string sync, option;
+                cmd >> sync;
+                if (sync == "none") {
+                    durability.sync = tftp::Durability::Sync::none;
+                } else if (sync == "close") {
+                    durability.sync = tftp::Durability::Sync::on_close;
+                } else if (sync == "batch") {
+                    size_t megabytes = 0;
+                    cmd >> megabytes;
+                    durability.sync = tftp::Durability::Sync::batched;
+                    durability.batch_bytes = megabytes << 20;
+                }
+                if (cmd >> option)
+                    durability.atomic = option != "direct";
+
+                if (sync == "none" || sync == "close" || (sync == "batch" && durability.batch_bytes > 0))
+                    peer.set_durability(durability);
+                else
+                    tftp::log::warn("wrong format");
+            } else if (op == "limit") {
+                // limit [sessions n] [per_source n] [backlog n] [rate requests/s] [burst n]
+                tftp::AdmissionControl::Limits limits;
+                bool ok = true;
+                std::string key;
+                double value;
+                while (ok && cmd >> key >> value) {
+                    if (key == "sessions")
+                        limits.max_sessions = value;
+                    else if (key == "per_source")
+                        limits.max_sessions_per_source = value;
+                    else if (key == "backlog")
+                        limits.max_backlog = value;
+                    else if (key == "rate")
+                        limits.request_rate = value;
+                    else if (key == "burst")
+                        limits.request_burst = value;
+                    else
+                        ok = false;
+                }
+
+                if (ok && cmd.eof())
+                    peer.set_admission_limits(limits);
+                else
+                    tftp::log::warn("wrong format");
+            } else if (op == "socket") {
+                // socket [rcvbuf bytes] [sndbuf bytes] [busy_poll us] [spin on|off] [zerocopy on|off] [core n], for the data sockets
+                tftp::SocketOptions options;
+                int core = -1;
+                bool ok = true;
+                std::string key, value;
+                while (ok && cmd >> key >> value) {
+                    try {
+                        if (key == "rcvbuf")
+                            options.receive_buffer = std::stoi(value);
+                        else if (key == "sndbuf")
+                            options.send_buffer = std::stoi(value);
+                        else if (key == "busy_poll")
+                            options.busy_poll = std::stoi(value);
+                        else if (key == "spin")
+                            options.spin = value == "on";
+                        else if (key == "zerocopy")
+                            options.zerocopy = value == "on";
+                        else if (key == "core")
+                            core = std::stoi(value);
+                        else
+                            ok = false;
+                    } catch (std::logic_error &) {
+                        ok = false;
+                    }
+                }
+                if (!ok || !cmd.eof()) {
+                    tftp::log::warn("wrong format");
+                    continue;
+                }
+
+                // a spinning io thread should have its core to itself
+                if (core >= 0) {
+                    cpu_set_t cpus;
+                    CPU_ZERO(&cpus);
+                    CPU_SET(core, &cpus);
+                    if (pthread_setaffinity_np(t.native_handle(), sizeof(cpus), &cpus) != 0)
+                        tftp::log::warn("cannot pin the io thread to core ", core);
+                }
+                boost::asio::post(io_context, [&data, socket_data, options]() {
+                    if (!data.set_options(options))
+                        tftp::log::warn("socket option refused");
+                    tftp::log::info("socket rcvbuf ", socket_data->receive_buffer(), " sndbuf ", socket_data->send_buffer(),
+                                    " spin ", options.spin ? "on" : "off", " zerocopy ", options.zerocopy ? "on" : "off",
+                                    ", zero copy sends so far ", socket_data->zerocopy_completed(), " of which ",
+                                    socket_data->zerocopy_copied(), " copied");
+                });
+            } else if (op == "policy") {
+                // policy load <file> | policy reload | policy show, see tftp::NegotiationPolicy
+                std::string action, path;
+                cmd >> action >> path;
+                if (action == "show") {
+                    tftp::log::info(peer.describe_negotiation_policy());
+                    continue;
+                }
+                if (action == "load" && !path.empty())
+                    policy_path = path;
+                else if (action != "reload" || policy_path.empty()) {
+                    tftp::log::warn("wrong format");
+                    continue;
+                }
+
+                try {
+                    peer.set_negotiation_policy(tftp::NegotiationPolicy::load(policy_path));
+                    tftp::log::info("policy loaded from ", policy_path);
+                } catch (std::invalid_argument &e) {
+                    tftp::log::warn("policy not loaded, ", e.what());
+                }
+            } else if (op == "capture") {
+                // capture <file> records every datagram received from now on, capture off stops
+                std::string path;
+                cmd >> path;
+                if (path.empty()) {
+                    tftp::log::warn("wrong format");
+                    continue;
+                }
+
+                std::shared_ptr<tftp::CaptureWriter> capture;
+                if (path != "off") {
+                    try {
+                        capture = std::make_shared<tftp::CaptureWriter>(path);
+                    } catch (std::invalid_argument &e) {
+                        tftp::log::warn("capture not started, ", e.what());
+                        continue;
+                    }
+                }
+                boost::asio::post(io_context, [&data, capture_requests, capture]() {
+                    capture_requests->set_capture(capture);
+                    data.set_capture(capture);
+                });
+            } else if (op == "replay") {
+                // replay <file> [files <dir>] [expect <fingerprint>], runs the capture on a peer of its own
+                std::string path, key, value, files = ".", fingerprint;
+                cmd >> path;
+                bool ok = !path.empty();
+                while (ok && cmd >> key) {
+                    ok = (key == "files" || key == "expect") && cmd >> value;
+                    (key == "files" ? files : fingerprint) = value;
+                }
+                if (!ok) {
+                    tftp::log::warn("wrong format");
+                    continue;
+                }
+
+                try {
+                    auto result = tftp::replay(tftp::read_capture(path), files);
+                    tftp::log::info("replay ", path, ": ", result.received, " datagrams received, ", result.sent,
+                                    " sent, fingerprint ", result.fingerprint, ", ",
+                                    std::chrono::duration_cast<std::chrono::milliseconds>(result.elapsed).count(),
+                                    " ms virtual, ", result.cpu_time_per_datagram().count(), " ns cpu per datagram");
+                    if (!fingerprint.empty() && fingerprint != result.fingerprint)
+                        tftp::log::warn("replay ", path, " differs, expected fingerprint ", fingerprint);
+                } catch (std::invalid_argument &e) {
+                    tftp::log::warn("replay failed, ", e.what());
+                }
+            } else if (op == "log") {
+                // log trace|debug|info|warn|error, levels below TFTP_LOG_LEVEL are compiled out
+                static const std::map<std::string, tftp::log::Level> levels = {
+                    {"trace", tftp::log::Level::trace}, {"debug", tftp::log::Level::debug},
+                    {"info", tftp::log::Level::info}, {"warn", tftp::log::Level::warn},
+                    {"error", tftp::log::Level::error},
+                };
+                std::string level;
+                cmd >> level;
+                if (levels.count(level))
+                    tftp::log::Logger::instance().set_level(levels.at(level));
+                else
+                    tftp::log::warn("wrong format");
             } else {
-                std::cout << "wrong format" << std::endl;
+                tftp::log::warn("wrong format");
             }
         }
 
         t.join();
     } catch (std::exception &e) {
-        std::cerr << e.what() << std::endl;
+        tftp::log::error(e.what());
+        tftp::log::Logger::instance().flush();
     }
 
     return 0;
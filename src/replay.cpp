@@ -0,0 +1,38 @@
+#include <utility>
+
+#include <chrono>
+#include <string>
+
+#include "Log.hpp"
+#include "Replay.hpp"
+
+// Replays a capture, see tftp::replay, and compares the fingerprint of what
+// the peer sent with the expected one. Exits with 1 if they differ, so a
+// checked in capture is a regression test, see tests/.
+//
+//     tftp_replay <capture> <files> [fingerprint]
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4) {
+        tftp::log::error("usage: ", argv[0], " <capture> <files> [fingerprint]");
+        tftp::log::Logger::instance().flush();
+        return 2;
+    }
+    std::string path = argv[1], files = argv[2], fingerprint = argc > 3 ? argv[3] : "";
+
+    int status = 0;
+    try {
+        auto result = tftp::replay(tftp::read_capture(path), files);
+        tftp::log::info("replay ", path, ": ", result.received, " datagrams received, ", result.sent, " sent, fingerprint ",
+                        result.fingerprint, ", ", std::chrono::duration_cast<std::chrono::milliseconds>(result.elapsed).count(),
+                        " ms virtual, ", result.cpu_time_per_datagram().count(), " ns cpu per datagram");
+        if (!fingerprint.empty() && fingerprint != result.fingerprint) {
+            tftp::log::error("replay ", path, " differs, expected fingerprint ", fingerprint);
+            status = 1;
+        }
+    } catch (std::invalid_argument &e) {
+        tftp::log::error("replay failed, ", e.what());
+        status = 2;
+    }
+    tftp::log::Logger::instance().flush();
+    return status;
+}
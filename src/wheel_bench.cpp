@@ -0,0 +1,140 @@
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Clock.hpp"
+#include "Log.hpp"
+#include "TimingWheel.hpp"
+
+// The deadlines of many concurrent sessions, each moved on every packet, on
+// the timing wheel and on a steady_timer per session as before it. The wheel
+// runs on a VirtualClock: each round is a millisecond in which every tenth
+// session gets a packet and moves its deadline, one session in a hundred
+// stalls and times out again and again. The steady timers only measure the
+// move, their deadlines are too far away to fire. Both cost the same per
+// move at any number of sessions if moving is O(1).
+//
+//     tftp_wheel_bench [sessions] [rounds]
+namespace {
+
+using Clock = tftp::Clock;
+using Stopwatch = std::chrono::steady_clock;
+
+struct Result {
+    size_t moves = 0;
+    size_t fired = 0;
+    Stopwatch::duration move_time{};
+    Stopwatch::duration poll_time{};  // of driving the wheel, the expired callbacks included
+
+    double ns_per_move() const {
+        return moves == 0 ? 0 : std::chrono::duration<double, std::nano>(move_time).count() / moves;
+    }
+
+    double ns_per_tick(size_t rounds) const {
+        return rounds == 0 ? 0 : std::chrono::duration<double, std::nano>(poll_time).count() / rounds;
+    }
+};
+
+// the timeout of each session, the same for both runs
+std::vector<Clock::duration> timeouts_of(size_t sessions) {
+    std::mt19937 random(39);
+    std::vector<Clock::duration> timeouts;
+    for (size_t i = 0; i < sessions; i++)
+        timeouts.push_back(std::chrono::milliseconds(100 + random() % 900));
+    return timeouts;
+}
+
+bool is_stalled(size_t session) {
+    return session % 100 == 0;
+}
+
+Result run_wheel(size_t sessions, size_t rounds) {
+    tftp::VirtualClock clock;
+    boost::asio::io_context io_context;
+    auto &wheel = boost::asio::use_service<tftp::TimingWheel>(io_context);
+    auto timeouts = timeouts_of(sessions);
+
+    Result result;
+    std::vector<std::unique_ptr<tftp::TimingWheel::Timer>> timers;
+    for (size_t i = 0; i < sessions; i++) {
+        timers.push_back(std::make_unique<tftp::TimingWheel::Timer>(io_context, [&, i]() {
+            result.fired++;
+            timers[i]->expires_at(clock.now() + timeouts[i]);
+        }));
+        timers[i]->expires_at(clock.now() + timeouts[i]);
+    }
+
+    for (size_t round = 0; round < rounds; round++) {
+        clock.set(clock.now() + std::chrono::milliseconds(1));
+
+        auto started = Stopwatch::now();
+        if (wheel.next_wakeup() <= clock.now())
+            wheel.poll();
+        io_context.poll();
+        auto polled = Stopwatch::now();
+
+        for (size_t i = round % 10; i < sessions; i += 10) {
+            if (!is_stalled(i)) {
+                timers[i]->expires_at(clock.now() + timeouts[i]);
+                result.moves++;
+            }
+        }
+        auto moved = Stopwatch::now();
+
+        result.poll_time += polled - started;
+        result.move_time += moved - polled;
+    }
+    return result;
+}
+
+Result run_steady_timers(size_t sessions, size_t rounds) {
+    static const auto far = std::chrono::hours(1);
+    boost::asio::io_context io_context;
+    auto timeouts = timeouts_of(sessions);
+
+    std::vector<std::unique_ptr<boost::asio::steady_timer>> timers;
+    for (size_t i = 0; i < sessions; i++) {
+        timers.push_back(std::make_unique<boost::asio::steady_timer>(io_context, far + timeouts[i]));
+        timers[i]->async_wait([](boost::system::error_code) {});
+    }
+
+    Result result;
+    for (size_t round = 0; round < rounds; round++) {
+        // the cancelled waits are completed by the io_context, part of the cost
+        auto started = Stopwatch::now();
+        for (size_t i = round % 10; i < sessions; i += 10) {
+            if (!is_stalled(i)) {
+                timers[i]->expires_after(far + timeouts[i]);
+                timers[i]->async_wait([](boost::system::error_code) {});
+                result.moves++;
+            }
+        }
+        io_context.poll();
+        result.move_time += Stopwatch::now() - started;
+    }
+    return result;
+}
+
+}  // namespace
+
+int main(int argc, char *argv[]) {
+    size_t sessions = argc > 1 ? std::stoul(argv[1]) : 50000;
+    size_t rounds = argc > 2 ? std::stoul(argv[2]) : 2000;
+
+    for (size_t count : {sessions / 50, sessions / 5, sessions}) {
+        if (count == 0)
+            continue;
+        auto wheel = run_wheel(count, rounds);
+        auto steady = run_steady_timers(count, rounds);
+        tftp::log::info(count, " sessions, ", rounds, " ms: wheel ", wheel.moves, " moves ", (int)wheel.ns_per_move(),
+                        " ns each, ", wheel.fired, " fired, ", (int)wheel.ns_per_tick(rounds), " ns per tick; steady_timer ",
+                        (int)steady.ns_per_move(), " ns per move");
+    }
+    tftp::log::Logger::instance().flush();
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef CHECK_HPP
+#define CHECK_HPP
+
+#include <cstdio>
+
+// The checks of the tests in this directory. A failed check is reported
+// with its place and expression and the test goes on, main returns
+// tftp::test::result() so ctest sees whether any failed.
+namespace tftp::test {
+
+inline int &failures() {
+    static int count = 0;
+    return count;
+}
+
+inline bool check(bool ok, const char *expression, const char *file, int line) {
+    if (!ok) {
+        std::fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+        failures()++;
+    }
+    return ok;
+}
+
+inline int result() {
+    if (failures() > 0)
+        std::fprintf(stderr, "%d checks failed\n", failures());
+    return failures() == 0 ? 0 : 1;
+}
+
+}  // namespace tftp::test
+
+#define CHECK(...) tftp::test::check((__VA_ARGS__), #__VA_ARGS__, __FILE__, __LINE__)
+
+#endif
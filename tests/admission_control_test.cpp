@@ -0,0 +1,98 @@
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <string>
+
+#include "AdmissionControl.hpp"
+#include "Check.hpp"
+#include "Clock.hpp"
+
+// Admission of requests on a virtual clock: the caps on all sessions and on
+// those of a source, the bounded backlog that starts queued requests as
+// sessions end unless they waited too long, and the request rate per source.
+namespace {
+
+using Clock = tftp::Clock;
+using Admission = tftp::AdmissionControl::Admission;
+using boost::asio::ip::udp;
+
+udp::endpoint endpoint(const std::string &address, unsigned short port = 1000) {
+    return udp::endpoint(boost::asio::ip::make_address(address), port);
+}
+
+}  // namespace
+
+int main() {
+    tftp::VirtualClock clock;
+    {
+        tftp::AdmissionControl admission;
+        tftp::AdmissionControl::Limits limits;
+        limits.max_sessions = 2;
+        limits.max_sessions_per_source = 1;
+        limits.max_backlog = 1;
+        admission.set_limits(limits);
+
+        std::string started;
+        auto start = [&](char name) { return [&started, name]() { started += name; }; };
+        CHECK(admission.admit(endpoint("192.0.2.1"), start('a')) == Admission::accepted);
+        // one session per source
+        CHECK(admission.admit(endpoint("192.0.2.1", 1001), start('x')) == Admission::refused);
+        CHECK(admission.admit(endpoint("192.0.2.2"), start('b')) == Admission::accepted);
+        CHECK(admission.sessions() == 2);
+
+        // full, one may wait, its retransmission takes its place
+        CHECK(admission.admit(endpoint("192.0.2.3"), start('x')) == Admission::queued);
+        CHECK(admission.admit(endpoint("192.0.2.3"), start('c')) == Admission::queued);
+        CHECK(admission.admit(endpoint("192.0.2.4"), start('x')) == Admission::refused);
+
+        // a slot freed up, the queued request gets it
+        auto next = admission.release(endpoint("192.0.2.1"));
+        CHECK(next != nullptr);
+        if (next)
+            next();
+        CHECK(started == "c");
+        CHECK(admission.sessions() == 2);
+
+        // one that waited longer than the client would is dropped
+        CHECK(admission.admit(endpoint("192.0.2.4"), start('x')) == Admission::queued);
+        clock.set(clock.now() + limits.backlog_timeout + std::chrono::seconds(1));
+        CHECK(admission.release(endpoint("192.0.2.2")) == nullptr);
+        CHECK(admission.sessions() == 1);
+        CHECK(admission.admit(endpoint("192.0.2.4"), start('d')) == Admission::accepted);
+    }
+    {
+        // 2 requests per second with a burst of 3, per source
+        tftp::AdmissionControl admission;
+        tftp::AdmissionControl::Limits limits;
+        limits.request_rate = 2;
+        limits.request_burst = 3;
+        admission.set_limits(limits);
+
+        auto now = clock.now();
+        auto flood = boost::asio::ip::make_address("198.51.100.1");
+        for (int i = 0; i < 3; i++)
+            CHECK(admission.allow_request(flood, now));
+        CHECK(!admission.allow_request(flood, now));
+        CHECK(admission.allow_request(boost::asio::ip::make_address("198.51.100.2"), now));
+        CHECK(!admission.allow_request(flood, now + std::chrono::milliseconds(400)));
+        CHECK(admission.allow_request(flood, now + std::chrono::milliseconds(500)));
+    }
+    {
+        // too many sources to remember: idle ones are forgotten, until none is
+        tftp::AdmissionControl admission;
+        tftp::AdmissionControl::Limits limits;
+        limits.max_sources = 2;
+        admission.set_limits(limits);
+
+        auto now = clock.now();
+        CHECK(admission.admit(endpoint("203.0.113.1"), nullptr, now) == Admission::accepted);
+        CHECK(admission.allow_request(boost::asio::ip::make_address("203.0.113.2"), now));
+        CHECK(!admission.allow_request(boost::asio::ip::make_address("203.0.113.3"), now));
+        // the bucket of .2 is full again after burst / rate seconds
+        auto later = now + std::chrono::seconds(3);
+        CHECK(admission.allow_request(boost::asio::ip::make_address("203.0.113.3"), later));
+        CHECK(admission.admit(endpoint("203.0.113.4"), nullptr, later) == Admission::refused);
+    }
+    return tftp::test::result();
+}
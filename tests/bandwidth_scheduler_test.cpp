@@ -0,0 +1,111 @@
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <string>
+
+#include "BandwidthScheduler.hpp"
+#include "Check.hpp"
+#include "Clock.hpp"
+#include "TimingWheel.hpp"
+
+// Pacing on a virtual clock: the token bucket lets a burst through and then
+// the rate, and the scheduler serves the sessions waiting behind the global
+// bucket in fair order, by weight, while one over its own rate lets the
+// others go first.
+namespace {
+
+using Clock = tftp::Clock;
+using std::chrono::milliseconds;
+
+struct Scheduler {
+    tftp::VirtualClock clock;
+    Clock::time_point start = clock.now();
+    boost::asio::io_context io_context;
+    tftp::TimingWheel &wheel = boost::asio::use_service<tftp::TimingWheel>(io_context);
+    tftp::BandwidthScheduler<char> scheduler{io_context};
+    std::string sent;  // the key of each packet in the order they went out
+
+    void submit(char key, size_t bytes) {
+        scheduler.submit(key, bytes, [this, key]() { sent += key; });
+    }
+
+    void run_until(Clock::duration until) {
+        while (wheel.next_wakeup() <= start + until) {
+            clock.set(wheel.next_wakeup());
+            wheel.poll();
+            io_context.poll();
+        }
+        clock.set(start + until);
+    }
+};
+
+}  // namespace
+
+int main() {
+    {
+        tftp::VirtualClock clock;
+        auto now = clock.now();
+        tftp::TokenBucket unlimited;
+        CHECK(unlimited.is_unlimited());
+        CHECK(unlimited.has_tokens(1 << 20, now));
+
+        // 1000 bytes/s with a burst of 100 bytes
+        tftp::TokenBucket bucket(1000, 100);
+        CHECK(bucket.has_tokens(100, now));
+        bucket.consume(100);
+        CHECK(!bucket.has_tokens(50, now));
+        CHECK(bucket.wait_time(50, now) == milliseconds(50));
+        CHECK(bucket.has_tokens(50, now + milliseconds(50)));
+        // never more than the burst, a larger packet waits for a full bucket and leaves it in debt
+        CHECK(bucket.wait_time(500, now + std::chrono::seconds(10)) == Clock::duration::zero());
+        bucket.consume(500);
+        CHECK(bucket.wait_time(100, now + std::chrono::seconds(10)) == milliseconds(500));
+    }
+    {
+        // equal weights alternate, whoever submitted first
+        Scheduler s;
+        s.scheduler.set_global_rate(100000);
+        for (int i = 0; i < 4; i++)
+            s.submit('a', 1000);
+        for (int i = 0; i < 4; i++)
+            s.submit('b', 1000);
+        s.run_until(std::chrono::seconds(1));
+        CHECK(s.sent == "aabababb");
+    }
+    {
+        // twice the weight, twice the packets while both wait
+        Scheduler s;
+        s.scheduler.set_global_rate(100000);
+        s.scheduler.set_session_weight('b', 2);
+        s.submit('x', 1000);  // takes the burst, the others queue behind it
+        for (int i = 0; i < 4; i++)
+            s.submit('a', 1000);
+        for (int i = 0; i < 8; i++)
+            s.submit('b', 1000);
+        s.run_until(std::chrono::seconds(1));
+        CHECK(s.sent == "xbabbabbabbab");
+    }
+    {
+        // a session over its own rate waits, the other one goes on
+        Scheduler s;
+        s.scheduler.set_session_rate(10000);
+        for (int i = 0; i < 3; i++)
+            s.submit('a', 1000);
+        s.submit('b', 50);
+        CHECK(s.sent == "ab");
+        s.run_until(milliseconds(99));
+        CHECK(s.sent == "ab");
+        s.run_until(milliseconds(100));
+        CHECK(s.sent == "aba");
+
+        // cancelled packets never go out, later ones do
+        s.scheduler.cancel('a');
+        s.run_until(std::chrono::seconds(1));
+        CHECK(s.sent == "aba");
+        s.submit('a', 10);
+        s.run_until(std::chrono::seconds(2));
+        CHECK(s.sent == "abaa");
+    }
+    return tftp::test::result();
+}
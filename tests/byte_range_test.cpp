@@ -0,0 +1,51 @@
+#include <string>
+
+#include "ByteRange.hpp"
+#include "Check.hpp"
+
+// Option "range" of striped transfers: the stripes cover the file without a
+// gap or overlap, and parsing takes exactly what to_string writes, nothing
+// that reaches past the file or has anything behind it.
+int main() {
+    for (size_t total : {0, 1, 7, 1 << 20, (1 << 20) + 3}) {
+        for (size_t count : {1, 2, 3, 16}) {
+            size_t next = 0;
+            for (size_t index = 0; index < count; index++) {
+                auto range = tftp::ByteRange::stripe(index, count, total);
+                CHECK(range.offset == next);
+                CHECK(range.total == total);
+                // the first stripes take the remainder, one byte each
+                CHECK(range.length == total / count + (index < total % count ? 1 : 0));
+                next = range.offset + range.length;
+
+                auto parsed = tftp::ByteRange::parse(range.to_string());
+                CHECK(parsed && parsed->offset == range.offset && parsed->length == range.length &&
+                      parsed->total == range.total);
+            }
+            CHECK(next == total);
+        }
+    }
+
+    auto range = tftp::ByteRange::parse("100:50/200");
+    CHECK(range && range->offset == 100 && range->length == 50 && range->total == 200);
+    CHECK(tftp::ByteRange::parse("150:50/200").has_value());
+    CHECK(tftp::ByteRange::parse("200:0/200").has_value());
+    CHECK(!tftp::ByteRange::parse("151:50/200"));
+    CHECK(!tftp::ByteRange::parse("201:0/200"));
+    // the length would wrap around in offset + length
+    CHECK(!tftp::ByteRange::parse("1:18446744073709551615/2"));
+    CHECK(!tftp::ByteRange::parse("100:50/200 "));
+    CHECK(!tftp::ByteRange::parse("100:50/200x"));
+    CHECK(!tftp::ByteRange::parse("100:50"));
+    CHECK(!tftp::ByteRange::parse(""));
+    CHECK(!tftp::ByteRange::parse("a:b/c"));
+
+    CHECK(tftp::ByteRange::stripe_request(2, 4) == "2/4");
+    auto stripe = tftp::ByteRange::parse_stripe_request("2/4");
+    CHECK(stripe && stripe->first == 2 && stripe->second == 4);
+    CHECK(!tftp::ByteRange::parse_stripe_request("4/4"));
+    CHECK(!tftp::ByteRange::parse_stripe_request("0/0"));
+    CHECK(!tftp::ByteRange::parse_stripe_request("1/4/"));
+    CHECK(!tftp::ByteRange::parse_stripe_request("1"));
+    return tftp::test::result();
+}
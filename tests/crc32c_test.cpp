@@ -0,0 +1,75 @@
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Check.hpp"
+#include "Crc32c.hpp"
+
+// The digest of option "checksum": the check values of RFC 3720 B.4, the
+// same digest however the data is split into updates, and the crc32
+// instruction agreeing with the slicing-by-8 table at every length and
+// alignment, so a receiver without SSE4.2 verifies what a sender with it
+// announced.
+namespace {
+
+uint32_t crc32c(const std::vector<uint8_t> &data) {
+    tftp::Crc32c crc;
+    crc.update(data.data(), data.size());
+    return crc.value();
+}
+
+}  // namespace
+
+int main() {
+    std::string digits = "123456789";
+    CHECK(crc32c(std::vector<uint8_t>(digits.begin(), digits.end())) == 0xE3069283);
+    CHECK(crc32c(std::vector<uint8_t>(32, 0x00)) == 0x8A9136AA);
+    CHECK(crc32c(std::vector<uint8_t>(32, 0xFF)) == 0x62A8AB43);
+    std::vector<uint8_t> ascending(32), descending(32);
+    for (int i = 0; i < 32; i++) {
+        ascending[i] = i;
+        descending[i] = 31 - i;
+    }
+    CHECK(crc32c(ascending) == 0x46DD794E);
+    CHECK(crc32c(descending) == 0x113FDB5C);
+    CHECK(crc32c({}) == 0);
+
+    tftp::Crc32c empty;
+    CHECK(empty.hex_digest() == "00000000");
+    tftp::Crc32c check;
+    check.update(reinterpret_cast<const uint8_t *>(digits.data()), digits.size());
+    CHECK(check.hex_digest() == "e3069283");
+    check.reset();
+    CHECK(check.value() == 0);
+
+    std::mt19937 random(26);
+    std::vector<uint8_t> data(70000);
+    for (auto &byte : data)
+        byte = random();
+    uint32_t whole = crc32c(data);
+
+    // blocks of any size, the odd ones leave the 8 byte steps unaligned
+    for (size_t block : {1, 3, 8, 508, 1428, 65464}) {
+        tftp::Crc32c crc;
+        for (size_t offset = 0; offset < data.size(); offset += block)
+            crc.update(data.data() + offset, std::min(block, data.size() - offset));
+        CHECK(crc.value() == whole);
+    }
+
+#ifdef TFTP_CRC32C_HAS_SSE42
+    if (__builtin_cpu_supports("sse4.2")) {
+        for (size_t size = 0; size <= 64; size++) {
+            for (size_t offset = 0; offset < 8; offset++) {
+                auto begin = data.data() + offset;
+                CHECK(tftp::Crc32c::update_hw(0xFFFFFFFF, begin, size) ==
+                      tftp::Crc32c::update_sw(0xFFFFFFFF, begin, size));
+            }
+        }
+        CHECK(tftp::Crc32c::update_hw(0xFFFFFFFF, data.data(), data.size()) ==
+              tftp::Crc32c::update_sw(0xFFFFFFFF, data.data(), data.size()));
+    }
+#endif
+    return tftp::test::result();
+}
@@ -0,0 +1,140 @@
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+
+#include "Check.hpp"
+#include "LocalFile.hpp"
+#include "Replay.hpp"
+#include "TftpParser.hpp"
+#include "TftpPeer.hpp"
+
+// Option "local" between two peers on loopback: the reader copies the file
+// from the descriptor of the sender, and when it can't open it, e.g. the
+// sender runs as another user, it reads the file over the network instead
+// of failing the transfer.
+namespace {
+
+using boost::asio::ip::udp;
+
+// The data transport of the sender. It counts the data it sends, and with
+// break_local it points the "local" of its oacks at another inode, a file
+// the reader won't accept.
+class LocalTransport : public tftp::DatagramTransport {
+public:
+    LocalTransport(std::unique_ptr<tftp::DatagramTransport> next, bool break_local)
+        : next_(std::move(next)), break_local_(break_local) {}
+
+    size_t oacks_broken = 0;
+    size_t data_bytes = 0;
+
+    udp::endpoint local_endpoint() const override {
+        return next_->local_endpoint();
+    }
+
+    void async_receive(boost::asio::mutable_buffer buffer, udp::endpoint &endpoint, Handler handler) override {
+        next_->async_receive(buffer, endpoint, std::move(handler));
+    }
+
+    void async_send(boost::asio::const_buffer buffer, const udp::endpoint &endpoint, Handler handler) override {
+        auto datagram = std::make_shared<tftp::Buffer>((const uint8_t *)buffer.data(),
+                                                       (const uint8_t *)buffer.data() + buffer.size());
+        tftp::Parser parser(*datagram);
+        if (parser.is_data()) {
+            data_bytes += datagram->size() - tftp::data_header_size;
+        } else if (parser.is_oack() && break_local_) {
+            auto options = parser.parser_oack().options();
+            auto local = options.count("local") ? tftp::LocalFile::parse(options.at("local")) : std::nullopt;
+            if (local) {
+                local->ino += 1;
+                options["local"] = local->to_string();
+                *datagram = tftp::OptionAckMessage::serialize(options);
+                oacks_broken++;
+            }
+        }
+        next_->async_send(boost::asio::buffer(*datagram), endpoint,
+                          [datagram, handler = std::move(handler)](boost::system::error_code e, std::size_t bytes) {
+                              handler(e, bytes);
+                          });
+    }
+
+private:
+    std::unique_ptr<tftp::DatagramTransport> next_;
+    bool break_local_;
+};
+
+std::string read_file(const std::string &path) {
+    std::ifstream in(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+}
+
+struct Fetch {
+    tftp::TransferResult result;
+    size_t oacks_broken = 0;
+    size_t data_bytes = 0;  // sent by the sender
+};
+
+// fetch the file from a sender on ::1
+Fetch fetch(const std::string &dir, bool break_local) {
+    boost::asio::io_context io_context;
+    auto work = boost::asio::make_work_guard(io_context);
+
+    auto data = std::make_unique<LocalTransport>(
+        std::make_unique<tftp::UdpTransport>(io_context, udp::endpoint(udp::v6(), 0)), break_local);
+    auto transport = data.get();
+    auto sender = std::make_unique<TftpPeer>(
+        io_context, std::make_unique<tftp::UdpTransport>(io_context, udp::endpoint(udp::v6(), 0)), std::move(data));
+    sender->set_root(dir);
+    auto reader = std::make_unique<TftpPeer>(io_context, 0);
+    std::thread thread([&io_context]() { io_context.run(); });
+
+    udp::endpoint endpoint(boost::asio::ip::address_v6::loopback(), sender->local_endpoint().port());
+    auto copy = dir + (break_local ? "/udp.bin" : "/local.bin");
+    Fetch fetch;
+    fetch.result = reader->async_read_file("file.bin", copy, endpoint, tftp::Mode::octet, boost::asio::use_future).get();
+
+    io_context.stop();
+    thread.join();
+    fetch.oacks_broken = transport->oacks_broken;
+    fetch.data_bytes = transport->data_bytes;
+    // the peers go first, their coroutines are cleaned up along with the io_context
+    reader.reset();
+    sender.reset();
+    return fetch;
+}
+
+}  // namespace
+
+int main() {
+    tftp::ScratchDirectory dir;
+    std::string content(300000, 0);
+    std::mt19937 random(46);
+    for (auto &c : content)
+        c = (char)random();
+    std::ofstream(dir.path() + "/file.bin", std::ios::binary) << content;
+
+    // the reader copies the file, only the empty block 0 goes over the network
+    auto local = fetch(dir.path(), false);
+    CHECK(local.result.success);
+    CHECK(local.result.bytes == content.size());
+    CHECK(local.data_bytes == 0);
+    CHECK(read_file(dir.path() + "/local.bin") == content);
+
+    // the reader can't open the file, it turns the oack down and asks again
+    // without "local", the file comes over the network
+    auto udp = fetch(dir.path(), true);
+    CHECK(udp.oacks_broken == 1);
+    CHECK(udp.result.success);
+    CHECK(udp.result.bytes == content.size());
+    CHECK(udp.result.checksum_verified);
+    CHECK(udp.data_bytes >= content.size());
+    CHECK(read_file(dir.path() + "/udp.bin") == content);
+
+    tftp::log::Logger::instance().flush();
+    return tftp::test::result();
+}
@@ -0,0 +1,96 @@
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <string>
+
+#include "Check.hpp"
+#include "Netascii.hpp"
+
+// Mode netascii: line ends translated both ways, a text of any bytes
+// surviving the round trip however it is split into blocks, a CR at the end
+// of one block and its partner at the start of the next included, and the
+// vector scans finding the same line end as the plain loop.
+namespace {
+
+tftp::Buffer bytes(const std::string &text) {
+    return tftp::Buffer(text.begin(), text.end());
+}
+
+tftp::Buffer encode(const tftp::Buffer &text) {
+    tftp::Buffer out;
+    tftp::NetasciiEncoder().encode(text.data(), text.size(), out);
+    return out;
+}
+
+// in chunks of the given size, the last one shorter
+tftp::Buffer decode(const tftp::Buffer &wire, size_t chunk) {
+    tftp::NetasciiDecoder decoder;
+    tftp::Buffer out;
+    for (size_t offset = 0; offset < wire.size(); offset += chunk)
+        decoder.decode(wire.data() + offset, std::min(chunk, wire.size() - offset), out);
+    decoder.finish(out);
+    return out;
+}
+
+// every CR on the wire is followed by LF or NUL, and no LF stands alone
+bool is_netascii(const tftp::Buffer &wire) {
+    for (size_t i = 0; i < wire.size(); i++) {
+        if (wire[i] == '\r' && (i + 1 == wire.size() || (wire[i + 1] != '\n' && wire[i + 1] != '\0')))
+            return false;
+        if (wire[i] == '\n' && (i == 0 || wire[i - 1] != '\r'))
+            return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+int main() {
+    CHECK(encode(bytes("a\nb")) == bytes("a\r\nb"));
+    CHECK(encode(bytes(std::string("a\rb", 3))) == bytes(std::string("a\r\0b", 4)));
+    CHECK(encode(bytes("\r\n")) == bytes(std::string("\r\0\r\n", 4)));
+    CHECK(decode(bytes("a\r\nb"), 64) == bytes("a\nb"));
+    CHECK(decode(bytes(std::string("a\r\0b", 4)), 64) == bytes("a\rb"));
+    // the pair split between two blocks
+    CHECK(decode(bytes("a\r\nb"), 2) == bytes("a\nb"));
+    // a malformed pair keeps both bytes, a dangling CR is kept at the end
+    CHECK(decode(bytes("a\rb"), 64) == bytes("a\rb"));
+    CHECK(decode(bytes("a\r"), 64) == bytes("a\r"));
+
+    // mostly plain text, so the scans run over long stretches, with line
+    // ends, bare CRs and NULs in between
+    std::mt19937 random(32);
+    tftp::Buffer text(100000);
+    for (auto &byte : text) {
+        auto dice = random() % 100;
+        byte = dice == 0 ? '\r' : dice < 3 ? '\n' : dice == 3 ? '\0' : 'a' + random() % 26;
+    }
+    auto wire = encode(text);
+    CHECK(is_netascii(wire));
+    for (size_t chunk : {1, 2, 7, 31, 32, 33, 512, 65464})
+        CHECK(decode(wire, chunk) == text);
+
+    // the encoder in blocks gives the same wire data
+    tftp::NetasciiEncoder encoder;
+    tftp::Buffer blocks;
+    for (size_t offset = 0; offset < text.size(); offset += 509)
+        encoder.encode(text.data() + offset, std::min<size_t>(509, text.size() - offset), blocks);
+    CHECK(blocks == wire);
+
+#ifdef TFTP_NETASCII_HAS_SIMD
+    // a single line end at each place of runs around the vector widths
+    for (size_t size = 0; size <= 96; size++) {
+        for (size_t at = 0; at <= size; at++) {
+            tftp::Buffer run(size, 'x');
+            if (at < size)
+                run[at] = at % 2 ? '\r' : '\n';
+            size_t expected = tftp::NewlineScanner::find_sw(run.data(), size, 0);
+            CHECK(expected == at);
+            CHECK(tftp::NewlineScanner::find_sse2(run.data(), size) == expected);
+            if (__builtin_cpu_supports("avx2"))
+                CHECK(tftp::NewlineScanner::find_avx2(run.data(), size) == expected);
+        }
+    }
+#endif
+    return tftp::test::result();
+}
@@ -0,0 +1,132 @@
+#include <memory>
+#include <random>
+
+#include "Check.hpp"
+#include "CongestionControl.hpp"
+#include "DataStream.hpp"
+#include "TftpTransaction.hpp"
+
+// The window of a send transaction: acks of 16 bits widened to the index of
+// a transfer longer than 65536 blocks, old acks from before the wrap kept
+// apart from new ones, and a lost block resent after repeated acks of the
+// block in front of it instead of a timeout, once, with half the window.
+namespace {
+
+uint16_t block_of(const tftp::Buffer &datagram) {
+    return (uint16_t)((datagram[2] << 8) | datagram[3]);
+}
+
+std::unique_ptr<tftp::SendTransaction> transaction(const tftp::Buffer &data, uint16_t window) {
+    auto trans = std::make_unique<tftp::SendTransaction>(std::make_unique<tftp::MemorySource>(data));
+    trans->set_option_blksize(tftp::min_block_size);
+    trans->set_option_windowsize(window);
+    return trans;
+}
+
+}  // namespace
+
+int main() {
+    std::mt19937 random(28);
+    {
+        // 70000 blocks, the block numbers wrap around once
+        tftp::Buffer data(70000 * tftp::min_block_size + 3);
+        for (auto &byte : data)
+            byte = random();
+        auto trans = transaction(data, 16);
+
+        tftp::Buffer received;
+        size_t index = 0;
+        bool in_order = true, confirmed = true;
+        while (!trans->is_finished() && index <= 70001) {
+            while (trans->has_next_block()) {
+                auto datagram = trans->get_next_block();
+                in_order &= block_of(*datagram) == (uint16_t)index;
+                received.insert(received.end(), datagram->begin() + tftp::data_header_size, datagram->end());
+                // the ack carries the next block expected, 0 again after 65535
+                confirmed &= trans->confirm_ack((uint16_t)(index + 1));
+                index++;
+            }
+        }
+        CHECK(trans->is_finished());
+        CHECK(in_order);
+        CHECK(confirmed);
+        CHECK(index == 70001);
+        CHECK(received == data);
+        CHECK(trans->retransmissions() == 0);
+
+        // an ack from before the wrap is stale, not one from ahead
+        CHECK(!trans->confirm_ack((uint16_t)(70001 - 40000)));
+        CHECK(trans->stale_acks() == 1);
+    }
+    {
+        tftp::Buffer data(100 * tftp::min_block_size);
+        auto trans = transaction(data, 64);
+
+        // grow the window in slow start until 8 blocks are in flight
+        size_t next = 0, acked = 0;
+        while (next - acked < 8) {
+            while (trans->has_next_block()) {
+                trans->get_next_block();
+                next++;
+            }
+            if (next - acked < 8)
+                trans->confirm_ack((uint16_t)++acked);
+        }
+        CHECK(!trans->has_next_block());
+
+        // block acked is lost, the receiver acks the one in front of it again for each block past it
+        CHECK(!trans->confirm_ack((uint16_t)acked));
+        CHECK(!trans->fast_retransmit());
+        CHECK(!trans->confirm_ack((uint16_t)acked));
+        CHECK(!trans->fast_retransmit());
+        CHECK(!trans->confirm_ack((uint16_t)acked));
+        CHECK(trans->fast_retransmit());
+        CHECK(trans->duplicate_acks() == 3);
+
+        // back at the gap, with half the window: 4 of the 8 blocks go out again
+        size_t resent = 0;
+        bool from_gap = true;
+        while (trans->has_next_block()) {
+            from_gap &= block_of(*trans->get_next_block()) == (uint16_t)(acked + resent);
+            resent++;
+        }
+        CHECK(from_gap);
+        CHECK(resent == 4);
+        CHECK(trans->retransmissions() == 4);
+
+        // the other blocks past the gap report the same loss, it isn't resent again
+        for (int i = 0; i < 5; i++) {
+            trans->confirm_ack((uint16_t)acked);
+            CHECK(!trans->fast_retransmit());
+        }
+
+        // the gap is filled, the next one is found again
+        CHECK(trans->confirm_ack((uint16_t)(acked + 4)));
+        acked += 4;
+        while (trans->has_next_block())
+            trans->get_next_block();
+        for (int i = 0; i < 3; i++)
+            trans->confirm_ack((uint16_t)acked);
+        CHECK(trans->fast_retransmit());
+    }
+    {
+        tftp::CongestionControl cc;
+        cc.set_max_window(64);
+        CHECK(cc.window() == 2);
+        cc.on_ack(6);
+        CHECK(cc.window() == 8);
+        cc.on_fast_retransmit();
+        CHECK(cc.window() == 4);
+        // above the new threshold the window grows by a block per window
+        cc.on_ack(4);
+        CHECK(cc.window() == 5);
+        cc.on_timeout();
+        CHECK(cc.window() == 1);
+        CHECK(cc.rto() == std::chrono::seconds(2));
+
+        // never beyond the negotiated window
+        cc.on_ack(1000);
+        CHECK(cc.window() == 64);
+    }
+    return tftp::test::result();
+}
@@ -0,0 +1,117 @@
+#include <utility>
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "Check.hpp"
+#include "Clock.hpp"
+#include "TimingWheel.hpp"
+
+// The timing wheel on a virtual clock: a deadline on each level fires at its
+// tick, not earlier and not later, however often it was cascaded down on the
+// way; one further than the top level reaches is handed down until it is
+// due; cancelled and moved deadlines don't fire where they were.
+namespace {
+
+using Clock = tftp::Clock;
+using std::chrono::milliseconds;
+
+struct Wheel {
+    tftp::VirtualClock clock;
+    Clock::time_point start = clock.now();
+    boost::asio::io_context io_context;
+    tftp::TimingWheel &wheel = boost::asio::use_service<tftp::TimingWheel>(io_context);
+
+    // a timer that notes when it fired
+    struct Probe {
+        std::vector<Clock::duration> fired;
+        std::unique_ptr<tftp::TimingWheel::Timer> timer;
+    };
+
+    std::unique_ptr<Probe> probe() {
+        auto probe = std::make_unique<Probe>();
+        probe->timer = std::make_unique<tftp::TimingWheel::Timer>(
+            io_context, [this, probe = probe.get()]() { probe->fired.push_back(clock.now() - start); });
+        return probe;
+    }
+
+    // move the clock to each wakeup of the wheel until then, like its steady_timer would
+    void run_until(Clock::duration until) {
+        while (wheel.next_wakeup() <= start + until) {
+            clock.set(wheel.next_wakeup());
+            wheel.poll();
+            io_context.poll();
+        }
+        clock.set(start + until);
+    }
+};
+
+}  // namespace
+
+int main() {
+    {
+        // a deadline on each of the 4 levels, 1, 256, 65536 and 16777216 ticks wide
+        Wheel w;
+        std::vector<std::pair<Clock::duration, std::unique_ptr<Wheel::Probe>>> probes;
+        for (auto due : {milliseconds(1), milliseconds(7), milliseconds(255), milliseconds(256), milliseconds(300),
+                         milliseconds(65535), milliseconds(65536), milliseconds(100000), milliseconds(20000000)}) {
+            auto probe = w.probe();
+            probe->timer->expires_at(w.start + due);
+            probes.emplace_back(due, std::move(probe));
+        }
+        CHECK(w.wheel.size() == probes.size());
+        w.run_until(std::chrono::hours(6));
+        for (auto &[due, probe] : probes)
+            CHECK(probe->fired == std::vector<Clock::duration>{due});
+        CHECK(w.wheel.size() == 0);
+    }
+    {
+        // within a tick a deadline is rounded up, one already passed is due with the next tick
+        Wheel w;
+        auto late = w.probe();
+        auto between = w.probe();
+        w.clock.set(w.start + milliseconds(10));
+        late->timer->expires_at(w.start);
+        between->timer->expires_at(w.start + std::chrono::microseconds(10500));
+        w.run_until(milliseconds(20));
+        CHECK(late->fired == std::vector<Clock::duration>{milliseconds(11)});
+        CHECK(between->fired == std::vector<Clock::duration>{milliseconds(11)});
+    }
+    {
+        // cancelled on the top level, moved from a high level down to the lowest and back up
+        Wheel w;
+        auto cancelled = w.probe();
+        auto moved = w.probe();
+        auto moved_up = w.probe();
+        cancelled->timer->expires_at(w.start + milliseconds(70000));
+        moved->timer->expires_at(w.start + milliseconds(70000));
+        moved_up->timer->expires_at(w.start + milliseconds(5));
+        w.run_until(milliseconds(1));
+        cancelled->timer->cancel();
+        CHECK(cancelled->timer->expiry() == Clock::time_point::max());
+        moved->timer->expires_at(w.start + milliseconds(3));
+        moved_up->timer->expires_at(w.start + milliseconds(1000));
+        CHECK(w.wheel.size() == 2);
+        w.run_until(std::chrono::seconds(100));
+        CHECK(cancelled->fired.empty());
+        CHECK(moved->fired == std::vector<Clock::duration>{milliseconds(3)});
+        CHECK(moved_up->fired == std::vector<Clock::duration>{milliseconds(1000)});
+    }
+    {
+        // a callback may move its own deadline, like a retransmission timer does
+        Wheel w;
+        std::vector<Clock::duration> fired;
+        std::unique_ptr<tftp::TimingWheel::Timer> timer;
+        timer = std::make_unique<tftp::TimingWheel::Timer>(w.io_context, [&]() {
+            fired.push_back(w.clock.now() - w.start);
+            if (fired.size() < 3)
+                timer->expires_at(w.clock.now() + milliseconds(300));
+        });
+        timer->expires_at(w.start + milliseconds(300));
+        w.run_until(std::chrono::seconds(2));
+        CHECK(fired == std::vector<Clock::duration>{milliseconds(300), milliseconds(600), milliseconds(900)});
+    }
+    return tftp::test::result();
+}